@@ -0,0 +1,163 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#include "../src/lab.hpp"
+
+/**
+ * Compares standard containers backed by a buddy pool against the same
+ * containers on the default memory resource. Each container gets an
+ * insert heavy pass followed by an iteration heavy pass.
+ *
+ * usage: bench-pmr [elements] [iterations]
+ */
+
+using bench_clock = std::chrono::steady_clock;
+
+static double elapsed_ms(bench_clock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+struct result
+{
+  double insert_ms;
+  double iterate_ms;
+  unsigned long checksum;
+};
+
+static result bench_vector(std::pmr::memory_resource *mr, size_t n, size_t iters)
+{
+  result r{0, 0, 0};
+  auto start = bench_clock::now();
+  std::pmr::vector<std::pmr::vector<unsigned long>> outer(mr);
+  for (size_t i = 0; i < n / 16; i++)
+    {
+      //Many small vectors growing one element at a time
+      outer.emplace_back();
+      for (size_t j = 0; j < 16; j++)
+        {
+          outer.back().push_back(i + j);
+        }
+    }
+  r.insert_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (size_t it = 0; it < iters; it++)
+    {
+      for (const auto &inner : outer)
+        {
+          for (unsigned long v : inner)
+            {
+              r.checksum += v;
+            }
+        }
+    }
+  r.iterate_ms = elapsed_ms(start);
+  return r;
+}
+
+static result bench_map(std::pmr::memory_resource *mr, size_t n, size_t iters)
+{
+  result r{0, 0, 0};
+  auto start = bench_clock::now();
+  std::pmr::map<unsigned long, unsigned long> m(mr);
+  for (size_t i = 0; i < n; i++)
+    {
+      m.emplace((i * 2654435761UL) % (n * 4), i);
+    }
+  r.insert_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (size_t it = 0; it < iters; it++)
+    {
+      for (const auto &kv : m)
+        {
+          r.checksum += kv.second;
+        }
+    }
+  r.iterate_ms = elapsed_ms(start);
+  return r;
+}
+
+static result bench_unordered_map(std::pmr::memory_resource *mr, size_t n, size_t iters)
+{
+  result r{0, 0, 0};
+  auto start = bench_clock::now();
+  std::pmr::unordered_map<unsigned long, unsigned long> m(mr);
+  for (size_t i = 0; i < n; i++)
+    {
+      m.emplace(i * 2654435761UL, i);
+    }
+  r.insert_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (size_t it = 0; it < iters; it++)
+    {
+      for (const auto &kv : m)
+        {
+          r.checksum += kv.second;
+        }
+    }
+  r.iterate_ms = elapsed_ms(start);
+  return r;
+}
+
+static void report(const char *name, result def, result bud)
+{
+  printf("%-14s insert %9.2f ms %9.2f ms (%5.2fx)   iterate %9.2f ms %9.2f ms (%5.2fx)\n",
+         name,
+         def.insert_ms, bud.insert_ms, def.insert_ms / bud.insert_ms,
+         def.iterate_ms, bud.iterate_ms, def.iterate_ms / bud.iterate_ms);
+  if (def.checksum != bud.checksum)
+    {
+      fprintf(stderr, "%s: checksum mismatch\n", name);
+      exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+  size_t iters = argc > 2 ? strtoul(argv[2], NULL, 10) : 20;
+
+  printf("%zu elements, %zu iteration passes\n", n, iters);
+  printf("%-14s %-38s %s\n", "", "        default      buddy", "        default      buddy");
+
+  std::pmr::memory_resource *def = std::pmr::new_delete_resource();
+
+  //A fresh pool per container so earlier runs do not fragment later ones
+  {
+    buddy::pool pool;
+    buddy::memory_resource mr(pool);
+    report("vector", bench_vector(def, n, iters), bench_vector(&mr, n, iters));
+  }
+  {
+    buddy::pool pool;
+    buddy::memory_resource mr(pool);
+    report("map", bench_map(def, n, iters), bench_map(&mr, n, iters));
+  }
+  {
+    buddy::pool pool;
+    buddy::memory_resource mr(pool);
+    report("unordered_map", bench_unordered_map(def, n, iters), bench_unordered_map(&mr, n, iters));
+  }
+  {
+    //The classic allocator template on a node based container
+    buddy::pool pool;
+    auto start = bench_clock::now();
+    std::map<unsigned long, unsigned long, std::less<unsigned long>,
+             buddy::allocator<std::pair<const unsigned long, unsigned long>>>
+        m{buddy::allocator<std::pair<const unsigned long, unsigned long>>(pool)};
+    for (size_t i = 0; i < n; i++)
+      {
+        m.emplace(i, i);
+      }
+    printf("%-14s insert %9.2f ms (buddy::allocator)\n", "std::map", elapsed_ms(start));
+  }
+  return 0;
+}
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "../src/lab.h"
+#include "tools.h"
+
+/**
+ * Shows the conflict misses cache coloring removes.
+ *
+ * usage: colors [object bytes] [objects] [passes]
+ *
+ * Allocates objects of the same size from a pool without and with
+ * BUDDY_COLOR and then sweeps over the array reading the first word of every
+ * object, the way code walks the hot field of a set of structs. Without
+ * colors every one of those words sits at the same offset in its page and
+ * the sweep only ever uses a few cache sets. Where the kernel allows it the
+ * L1 data cache read misses are counted as well.
+ */
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*A counter of L1D read misses in user space, -1 if there is none*/
+static int miss_counter(void)
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static void counter_start(int fd)
+{
+#ifdef __linux__
+  if (fd >= 0)
+    {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#else
+  (void)fd;
+#endif
+}
+
+static uint64_t counter_stop(int fd)
+{
+  uint64_t count = 0;
+#ifdef __linux__
+  if (fd >= 0)
+    {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &count, sizeof(count)) != sizeof(count))
+        count = 0;
+    }
+#else
+  (void)fd;
+#endif
+  return count;
+}
+
+static int run(const char *name, unsigned int flags, size_t size, size_t count, size_t passes, int fd)
+{
+  size_t block = UINT64_C(1) << btok(size + sizeof(struct avail));
+  struct buddy_options opts = {.size = 2 * block * count, .flags = flags};
+  struct buddy_pool pool;
+  if (buddy_init_opts(&pool, &opts) == -1)
+    {
+      perror(name);
+      return -1;
+    }
+  uint64_t **objs = malloc(count * sizeof(uint64_t *));
+  if (!objs)
+    {
+      fprintf(stderr, "colors: out of memory\n");
+      buddy_destroy(&pool);
+      return -1;
+    }
+  size_t sets[BUDDY_COLORS] = {0};
+  size_t used = 0;
+  for (size_t i = 0; i < count; i++)
+    {
+      objs[i] = buddy_malloc(&pool, size);
+      if (!objs[i])
+        {
+          perror(name);
+          count = i;
+          break;
+        }
+      memset(objs[i], 0, size);
+      objs[i][0] = i;
+      size_t set = ((uintptr_t)objs[i] / BUDDY_COLOR_LINE) % BUDDY_COLORS;
+      used += sets[set]++ == 0;
+    }
+
+  //Warm up once, then time the sweeps
+  volatile uint64_t sink = 0;
+  for (size_t i = 0; i < count; i++)
+    sink += objs[i][0];
+  counter_start(fd);
+  double start = now_ns();
+  for (size_t p = 0; p < passes; p++)
+    {
+      uint64_t sum = 0;
+      for (size_t i = 0; i < count; i++)
+        sum += objs[i][0];
+      sink += sum;
+    }
+  double elapsed = now_ns() - start;
+  uint64_t misses = counter_stop(fd);
+
+  double reads = (double)count * (double)passes;
+  printf("%-10s %8zu %8zu %6zu/%-3d %9.2f", name, size, count, used, BUDDY_COLORS, reads ? elapsed / reads : 0.0);
+  if (fd >= 0)
+    printf(" %12.3f\n", reads ? (double)misses / reads : 0.0);
+  else
+    printf(" %12s\n", "-");
+
+  for (size_t i = 0; i < count; i++)
+    buddy_free(&pool, objs[i]);
+  free(objs);
+  buddy_destroy(&pool);
+  return 0;
+}
+
+int colors_main(int argc, char **argv)
+{
+  size_t size = argc > 1 ? strtoull(argv[1], NULL, 0) : 4096;
+  size_t count = argc > 2 ? strtoull(argv[2], NULL, 0) : 512;
+  size_t passes = argc > 3 ? strtoull(argv[3], NULL, 0) : 2000;
+  if (size < sizeof(uint64_t) || count == 0)
+    {
+      fprintf(stderr, "colors: objects must hold a word and there must be some\n");
+      return 1;
+    }
+
+  int fd = miss_counter();
+  printf("%-10s %8s %8s %10s %9s %12s\n", "pool", "bytes", "objects", "line sets", "ns/read", "L1D miss/rd");
+  int rval = run("plain", 0, size, count, passes, fd);
+  if (rval == 0)
+    rval = run("colored", BUDDY_COLOR, size, count, passes, fd);
+  if (fd >= 0)
+    close(fd);
+  return rval == 0 ? 0 : 1;
+}
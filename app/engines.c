@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../src/lab.h"
+#include "../src/fibonacci.h"
+#include "../src/trace.h"
+#include "tools.h"
+
+/**
+ * Compares the binary buddy engine with the Fibonacci one on a set of size
+ * distributions.
+ *
+ * usage: engines [pool bytes] [ops] [trace]
+ *
+ * For every distribution each engine is filled until the first failed
+ * allocation, which gives the share of the pool that ended up in user hands
+ * and the internal fragmentation of the blocks that were handed out. Then ops
+ * random mallocs and frees over a fixed set of slots are timed. With a trace
+ * recorded by buddy_trace_start the sizes of its mallocs are one more
+ * distribution.
+ */
+
+#define SLOTS 4096        /*live allocations during the timed churn*/
+#define SAMPLES 65536     /*sizes drawn up front so the RNG is not timed*/
+
+struct engine
+{
+  const char *name;
+  int (*init)(void *pool, size_t size);
+  void (*destroy)(void *pool);
+  void *(*malloc)(void *pool, size_t size);
+  void (*free)(void *pool, void *ptr);
+  size_t (*block)(void *pool, void *ptr);  /*bytes of the block behind ptr*/
+  size_t (*bytes)(void *pool);             /*bytes the pool manages*/
+};
+
+static int binary_init(void *pool, size_t size)
+{
+  struct buddy_options opts = {.size = size, .min_k = 0, .trim_k = 0};
+  return buddy_init_opts(pool, &opts);
+}
+
+static void binary_destroy(void *pool)
+{
+  buddy_destroy(pool);
+}
+
+static void *binary_malloc(void *pool, size_t size)
+{
+  return buddy_malloc(pool, size);
+}
+
+static void binary_free(void *pool, void *ptr)
+{
+  buddy_free(pool, ptr);
+}
+
+static size_t binary_block(void *pool, void *ptr)
+{
+  (void)pool;
+  return UINT64_C(1) << ((struct avail *)ptr - 1)->kval;
+}
+
+static size_t binary_bytes(void *pool)
+{
+  return ((struct buddy_pool *)pool)->numbytes;
+}
+
+static int fib_init(void *pool, size_t size)
+{
+  return buddy_fib_init(pool, size);
+}
+
+static void fib_destroy(void *pool)
+{
+  buddy_fib_destroy(pool);
+}
+
+static void *fib_malloc(void *pool, size_t size)
+{
+  return buddy_fib_malloc(pool, size);
+}
+
+static void fib_free(void *pool, void *ptr)
+{
+  buddy_fib_free(pool, ptr);
+}
+
+static size_t fib_block(void *pool, void *ptr)
+{
+  return ((struct buddy_fib *)pool)->sizes[((struct avail *)ptr - 1)->kval];
+}
+
+static size_t fib_bytes(void *pool)
+{
+  return ((struct buddy_fib *)pool)->numbytes;
+}
+
+static const struct engine engines[] = {
+  {"binary", binary_init, binary_destroy, binary_malloc, binary_free, binary_block, binary_bytes},
+  {"fibonacci", fib_init, fib_destroy, fib_malloc, fib_free, fib_block, fib_bytes},
+};
+
+/*Sizes of the mallocs in a trace file, NULL if there are none*/
+static size_t *trace_sizes(const char *path, size_t *count)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    {
+      perror(path);
+      return NULL;
+    }
+  struct trace_file_header hdr;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+      hdr.version != TRACE_VERSION || hdr.record_size != sizeof(struct trace_record))
+    {
+      fprintf(stderr, "%s: not an allocation trace\n", path);
+      fclose(fp);
+      return NULL;
+    }
+  size_t cap = 1024, n = 0;
+  size_t *sizes = malloc(cap * sizeof(size_t));
+  struct trace_record rec;
+  while (sizes && fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+      if ((rec.op != TRACE_MALLOC && rec.op != TRACE_REALLOC) || rec.size == 0)
+        continue;
+      if (n == cap)
+        {
+          cap *= 2;
+          size_t *grown = realloc(sizes, cap * sizeof(size_t));
+          if (!grown)
+            {
+              free(sizes);
+              sizes = NULL;
+              break;
+            }
+          sizes = grown;
+        }
+      sizes[n++] = (size_t)rec.size;
+    }
+  fclose(fp);
+  if (sizes && n == 0)
+    {
+      fprintf(stderr, "%s: no allocations in the trace\n", path);
+      free(sizes);
+      sizes = NULL;
+    }
+  *count = n;
+  return sizes;
+}
+
+static double uniform01(void)
+{
+  return (double)rand() / ((double)RAND_MAX + 1.0);
+}
+
+/*Fill sizes according to the named distribution*/
+static void draw_sizes(const char *dist, size_t *sizes, const size_t *from, size_t from_count)
+{
+  for (size_t i = 0; i < SAMPLES; i++)
+    {
+      if (strcmp(dist, "uniform") == 0)
+        sizes[i] = 1 + (size_t)(uniform01() * 4096);
+      else if (strcmp(dist, "log-uniform") == 0)
+        sizes[i] = (size_t)exp2(4 + uniform01() * 12);
+      else if (strcmp(dist, "small") == 0)
+        sizes[i] = 8 + 8 * (size_t)(uniform01() * 32);
+      else
+        sizes[i] = from[(size_t)(uniform01() * (double)from_count)];
+    }
+}
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void run(const struct engine *e, const char *dist, const size_t *sizes, size_t pool_bytes, size_t ops)
+{
+  union
+  {
+    struct buddy_pool binary;
+    struct buddy_fib fib;
+  } pool;
+  if (e->init(&pool, pool_bytes) == -1)
+    {
+      perror(e->name);
+      return;
+    }
+
+  //Fill until the first failure
+  size_t cap = 1024, n = 0;
+  void **live = malloc(cap * sizeof(void *));
+  size_t requested = 0, blocks = 0;
+  for (size_t i = 0; live; i++)
+    {
+      size_t size = sizes[i % SAMPLES];
+      void *p = e->malloc(&pool, size);
+      if (!p)
+        break;
+      if (n == cap)
+        {
+          cap *= 2;
+          void **grown = realloc(live, cap * sizeof(void *));
+          if (!grown)
+            {
+              e->free(&pool, p);
+              break;
+            }
+          live = grown;
+        }
+      live[n++] = p;
+      requested += size;
+      blocks += e->block(&pool, p);
+    }
+  for (size_t i = 0; i < n; i++)
+    e->free(&pool, live[i]);
+  free(live);
+
+  //Timed churn over a fixed number of slots
+  void *slots[SLOTS] = {0};
+  double start = now_ns();
+  for (size_t i = 0; i < ops; i++)
+    {
+      size_t s = (i * UINT64_C(0x9E3779B97F4A7C15) >> 20) % SLOTS;
+      if (slots[s])
+        {
+          e->free(&pool, slots[s]);
+          slots[s] = NULL;
+        }
+      else
+        {
+          slots[s] = e->malloc(&pool, sizes[i % SAMPLES]);
+        }
+    }
+  double elapsed = now_ns() - start;
+  for (size_t s = 0; s < SLOTS; s++)
+    e->free(&pool, slots[s]);
+
+  size_t bytes = e->bytes(&pool);
+  printf("%-12s %-10s %12zu %8zu %9.1f%% %9.1f%% %9.1f\n", dist, e->name, bytes, n,
+         100.0 * (double)requested / (double)bytes, blocks ? 100.0 * (1.0 - (double)requested / (double)blocks) : 0.0,
+         ops ? elapsed / (double)ops : 0.0);
+  e->destroy(&pool);
+}
+
+int engines_main(int argc, char **argv)
+{
+  size_t pool_bytes = argc > 1 ? strtoull(argv[1], NULL, 0) : UINT64_C(1) << 26;
+  size_t ops = argc > 2 ? strtoull(argv[2], NULL, 0) : 1000000;
+  size_t from_count = 0;
+  size_t *from = NULL;
+  if (argc > 3)
+    {
+      from = trace_sizes(argv[3], &from_count);
+      if (!from)
+        return 1;
+    }
+
+  size_t *sizes = malloc(SAMPLES * sizeof(size_t));
+  if (!sizes)
+    {
+      fprintf(stderr, "engines: out of memory\n");
+      free(from);
+      return 1;
+    }
+
+  const char *dists[] = {"uniform", "log-uniform", "small", "trace"};
+  size_t ndists = from ? 4 : 3;
+  printf("%-12s %-10s %12s %8s %10s %10s %9s\n", "sizes", "engine", "pool bytes", "allocs", "used",
+         "int frag", "ns/op");
+  for (size_t d = 0; d < ndists; d++)
+    {
+      srand(1);
+      draw_sizes(dists[d], sizes, from, from_count);
+      for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+        run(&engines[e], dists[d], sizes, pool_bytes, ops);
+    }
+  free(sizes);
+  free(from);
+  return 0;
+}
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/lab.h"
+#include "../src/heapmap.h"
+#include "tools.h"
+
+/**
+ * Renders a map written by buddy_dump_map as text.
+ *
+ * usage: heatmap <map> [columns] [rows]
+ *
+ * The occupancy grid shows how much of each cell is handed out. The order map
+ * has a row per block order with one field per aligned region of that order,
+ * which is where fragmentation shows: a region that is mostly free but still
+ * holds a reservation can not be handed out whole, the reservation pins it.
+ */
+
+#define PINNED_FREE 0.75 /*regions at least this free that are still held are pinned*/
+
+struct heapmap
+{
+  uint64_t kval_m;
+  uint64_t numbytes;
+  size_t count;
+  uint64_t *offsets;  /*start of each block*/
+  uint8_t *entries;   /*kval and HEAPMAP_RESERVED of each block*/
+};
+
+static uint64_t block_size(const struct heapmap *map, size_t i)
+{
+  return UINT64_C(1) << (map->entries[i] & HEAPMAP_KVAL_MASK);
+}
+
+static int load_map(const char *path, struct heapmap *map)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    {
+      perror(path);
+      return -1;
+    }
+  struct heapmap_header hdr;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, HEAPMAP_MAGIC, sizeof(HEAPMAP_MAGIC)) != 0 ||
+      hdr.version != HEAPMAP_VERSION || hdr.kval_m >= MAX_K)
+    {
+      fprintf(stderr, "%s: not a heap map\n", path);
+      fclose(fp);
+      return -1;
+    }
+  map->kval_m = hdr.kval_m;
+  map->numbytes = UINT64_C(1) << hdr.kval_m;
+  map->count = (size_t)hdr.blocks;
+  map->offsets = malloc(map->count * sizeof(uint64_t) + 1);
+  map->entries = malloc(map->count + 1);
+  if (!map->offsets || !map->entries || fread(map->entries, 1, map->count, fp) != map->count)
+    {
+      fprintf(stderr, "%s: truncated heap map\n", path);
+      fclose(fp);
+      return -1;
+    }
+  fclose(fp);
+
+  uint64_t offset = 0;
+  for (size_t i = 0; i < map->count; i++)
+    {
+      map->offsets[i] = offset;
+      offset += block_size(map, i);
+    }
+  if (offset != map->numbytes)
+    {
+      fprintf(stderr, "%s: blocks do not cover the pool\n", path);
+      return -1;
+    }
+  return 0;
+}
+
+/*Reserved bytes in [start, end)*/
+static uint64_t reserved_between(const struct heapmap *map, uint64_t start, uint64_t end)
+{
+  //First block that ends after start
+  size_t lo = 0, hi = map->count;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (map->offsets[mid] + block_size(map, mid) <= start)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  uint64_t reserved = 0;
+  for (size_t i = lo; i < map->count && map->offsets[i] < end; i++)
+    {
+      if (!(map->entries[i] & HEAPMAP_RESERVED))
+        continue;
+      uint64_t a = map->offsets[i] > start ? map->offsets[i] : start;
+      uint64_t b = map->offsets[i] + block_size(map, i);
+      reserved += (b < end ? b : end) - a;
+    }
+  return reserved;
+}
+
+static void print_summary(const struct heapmap *map)
+{
+  size_t reserved_blocks = 0;
+  uint64_t reserved = 0, largest = 0;
+  for (size_t i = 0; i < map->count; i++)
+    {
+      if (map->entries[i] & HEAPMAP_RESERVED)
+        {
+          reserved_blocks++;
+          reserved += block_size(map, i);
+        }
+      else if (block_size(map, i) > largest)
+        {
+          largest = block_size(map, i);
+        }
+    }
+  uint64_t free_bytes = map->numbytes - reserved;
+  printf("pool %llu bytes (2^%llu), %zu blocks, %zu reserved\n", (unsigned long long)map->numbytes,
+         (unsigned long long)map->kval_m, map->count, reserved_blocks);
+  printf("reserved %llu bytes, free %llu bytes, largest free block %llu bytes, external fragmentation %.3f\n\n",
+         (unsigned long long)reserved, (unsigned long long)free_bytes, (unsigned long long)largest,
+         free_bytes ? 1.0 - (double)largest / (double)free_bytes : 0.0);
+}
+
+static void print_occupancy(const struct heapmap *map, size_t cols, size_t rows)
+{
+  static const char ramp[] = " .:-=+*#%@";
+  const size_t steps = sizeof(ramp) - 2;
+  uint64_t cell = (map->numbytes + cols * rows - 1) / (cols * rows);
+
+  printf("occupancy, %llu bytes per cell (' ' free to '@' reserved)\n", (unsigned long long)cell);
+  for (size_t r = 0; r < rows; r++)
+    {
+      putchar('|');
+      for (size_t c = 0; c < cols; c++)
+        {
+          uint64_t start = (r * cols + c) * cell;
+          if (start >= map->numbytes)
+            {
+              putchar(' ');
+              continue;
+            }
+          uint64_t end = start + cell < map->numbytes ? start + cell : map->numbytes;
+          uint64_t used = reserved_between(map, start, end);
+          size_t step = (size_t)((double)used / (double)(end - start) * (double)steps + 0.5);
+          if (used > 0 && step == 0)
+            step = 1;
+          if (used < end - start && step == steps)
+            step = steps - 1;
+          putchar(ramp[step]);
+        }
+      printf("|\n");
+    }
+  putchar('\n');
+}
+
+static void print_orders(const struct heapmap *map, size_t cols)
+{
+  printf("order map (' ' free, '#' reserved, '+' split, '!' pinned: at least %.0f%% free but held)\n",
+         PINNED_FREE * 100);
+  for (uint64_t k = map->kval_m; k >= SMALLEST_K; k--)
+    {
+      uint64_t size = UINT64_C(1) << k;
+      uint64_t regions = map->numbytes / size;
+      if (regions > cols)
+        break;
+      size_t width = cols / regions;
+      size_t pinned = 0;
+      uint64_t pinned_free = 0;
+      printf("k=%-3llu|", (unsigned long long)k);
+      for (uint64_t r = 0; r < regions; r++)
+        {
+          uint64_t used = reserved_between(map, r * size, (r + 1) * size);
+          char mark;
+          if (used == 0)
+            {
+              mark = ' ';
+            }
+          else if (used == size)
+            {
+              mark = '#';
+            }
+          else if ((double)(size - used) >= PINNED_FREE * (double)size)
+            {
+              mark = '!';
+              pinned++;
+              pinned_free += size - used;
+            }
+          else
+            {
+              mark = '+';
+            }
+          for (size_t w = 0; w < width; w++)
+            putchar(mark);
+        }
+      for (size_t w = width * regions; w < cols; w++)
+        putchar(' ');
+      printf("| pinned %zu, %llu free bytes held\n", pinned, (unsigned long long)pinned_free);
+    }
+}
+
+int heatmap_main(int argc, char **argv)
+{
+  if (argc < 2)
+    {
+      fprintf(stderr, "usage: heatmap <map> [columns] [rows]\n");
+      return 1;
+    }
+  size_t cols = argc > 2 ? strtoull(argv[2], NULL, 0) : 64;
+  size_t rows = argc > 3 ? strtoull(argv[3], NULL, 0) : 16;
+  if (cols == 0 || rows == 0)
+    {
+      fprintf(stderr, "heatmap: columns and rows must be positive\n");
+      return 1;
+    }
+
+  struct heapmap map = {0};
+  int rval = load_map(argv[1], &map);
+  if (rval == 0)
+    {
+      print_summary(&map);
+      print_occupancy(&map, cols, rows);
+      print_orders(&map, cols);
+    }
+  free(map.offsets);
+  free(map.entries);
+  return rval == 0 ? 0 : 1;
+}
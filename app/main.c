@@ -1,7 +1,46 @@
 #include <stdio.h>
+#include <string.h>
 
-int main(void)
+#include "tools.h"
+
+struct tool
+{
+  const char *name;
+  int (*main)(int argc, char **argv);
+  const char *usage;
+};
+
+static const struct tool tools[] = {
+  {"replay", replay_main, "replay <trace> [pool bytes] [samples] [map out]"},
+  {"heatmap", heatmap_main, "heatmap <map> [columns] [rows]"},
+  {"engines", engines_main, "engines [pool bytes] [ops] [trace]"},
+  {"colors", colors_main, "colors [object bytes] [objects] [passes]"},
+  {"scratch", scratch_main, "scratch [threads] [object bytes] [writes]"},
+};
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s <tool> [args]\n", prog);
+  for (size_t i = 0; i < sizeof(tools) / sizeof(tools[0]); i++)
+    {
+      fprintf(stderr, "  %s %s\n", prog, tools[i].usage);
+    }
+}
+
+int main(int argc, char **argv)
 {
-  printf("hello world\n");
-  return 0;
+  if (argc < 2)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  for (size_t i = 0; i < sizeof(tools) / sizeof(tools[0]); i++)
+    {
+      if (strcmp(argv[1], tools[i].name) == 0)
+        {
+          return tools[i].main(argc - 1, argv + 1);
+        }
+    }
+  usage(argv[0]);
+  return 1;
 }
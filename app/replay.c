@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "../src/lab.h"
+#include "../src/trace.h"
+#include "../src/latency.h"
+#include "../src/heapmap.h"
+#include "tools.h"
+
+/**
+ * Replays a trace recorded with buddy_trace_start against a fresh pool.
+ *
+ * usage: replay <trace> [pool bytes] [samples] [map out]
+ *
+ * The pool defaults to (or with 0 is) the size of the traced pool. Fragmentation is sampled
+ * samples times (default 20) while the trace runs. If map out is given the
+ * pool is written there with buddy_dump_map at the end, for the heatmap tool.
+ */
+
+#define LAT_BUCKETS 40 /*log2 nanosecond buckets*/
+
+struct op_stats
+{
+  const char *name;
+  size_t count;
+  size_t failed;
+  double total_ns;
+  double max_ns;
+  size_t buckets[LAT_BUCKETS];
+};
+
+/*Records tagged with their position in the file so the sort is stable*/
+struct ordered_record
+{
+  struct trace_record rec;
+  size_t seq;
+};
+
+/*Open addressing map from trace id to the pointer it became in the replay*/
+struct id_map
+{
+  uint64_t *ids;
+  void **ptrs;
+  size_t mask;
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+static int by_time(const void *a, const void *b)
+{
+  const struct ordered_record *x = a, *y = b;
+  if (x->rec.ts != y->rec.ts)
+    return x->rec.ts < y->rec.ts ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static size_t map_slot(struct id_map *map, uint64_t id)
+{
+  size_t i = (size_t)(id * UINT64_C(0x9E3779B97F4A7C15)) & map->mask;
+  while (map->ids[i] != 0 && map->ids[i] != id)
+    {
+      i = (i + 1) & map->mask;
+    }
+  return i;
+}
+
+static void map_put(struct id_map *map, uint64_t id, void *ptr)
+{
+  size_t i = map_slot(map, id);
+  map->ids[i] = id;
+  map->ptrs[i] = ptr;
+}
+
+static void *map_get(struct id_map *map, uint64_t id)
+{
+  size_t i = map_slot(map, id);
+  return map->ids[i] == id ? map->ptrs[i] : NULL;
+}
+
+/*Remove with backward shift so lookups never need tombstones*/
+static void map_del(struct id_map *map, uint64_t id)
+{
+  size_t i = map_slot(map, id);
+  if (map->ids[i] != id)
+    return;
+  size_t j = i;
+  for (;;)
+    {
+      j = (j + 1) & map->mask;
+      if (map->ids[j] == 0)
+        break;
+      size_t home = (size_t)(map->ids[j] * UINT64_C(0x9E3779B97F4A7C15)) & map->mask;
+      //Move j back into the hole at i unless its home lies cyclically in (i, j]
+      if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j))
+        {
+          map->ids[i] = map->ids[j];
+          map->ptrs[i] = map->ptrs[j];
+          i = j;
+        }
+    }
+  map->ids[i] = 0;
+  map->ptrs[i] = NULL;
+}
+
+static void record_latency(struct op_stats *st, double ns)
+{
+  st->count++;
+  st->total_ns += ns;
+  if (ns > st->max_ns)
+    st->max_ns = ns;
+  size_t b = 0;
+  while (b < LAT_BUCKETS - 1 && (double)(UINT64_C(1) << (b + 1)) <= ns)
+    b++;
+  st->buckets[b]++;
+}
+
+/*Upper bound of the bucket holding quantile q*/
+static double latency_quantile(const struct op_stats *st, double q)
+{
+  size_t target = (size_t)(q * (double)st->count);
+  size_t seen = 0;
+  for (size_t b = 0; b < LAT_BUCKETS; b++)
+    {
+      seen += st->buckets[b];
+      if (seen > target)
+        return (double)(UINT64_C(1) << (b + 1));
+    }
+  return st->max_ns;
+}
+
+static void print_fragmentation(struct buddy_pool *pool, size_t op, size_t live)
+{
+  size_t free_bytes = 0;
+  size_t largest = 0;
+  for (size_t k = 0; k <= pool->kval_m; k++)
+    {
+      for (struct avail *a = pool->avail[k].next; a != &pool->avail[k]; a = a->next)
+        {
+          free_bytes += UINT64_C(1) << k;
+          largest = UINT64_C(1) << k;
+        }
+    }
+  double frag = free_bytes ? 1.0 - (double)largest / (double)free_bytes : 0.0;
+  double used = (double)(pool->numbytes - free_bytes);
+  printf("%10zu %14zu %14zu %14zu %8.3f %8.3f\n", op, live, free_bytes, largest, frag,
+         used > 0 ? (double)live / used : 1.0);
+}
+
+int replay_main(int argc, char **argv)
+{
+  if (argc < 2)
+    {
+      fprintf(stderr, "usage: replay <trace> [pool bytes] [samples] [map out]\n");
+      return 1;
+    }
+
+  FILE *fp = fopen(argv[1], "rb");
+  if (!fp)
+    {
+      perror(argv[1]);
+      return 1;
+    }
+  struct trace_file_header hdr;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+      hdr.version != TRACE_VERSION || hdr.record_size != sizeof(struct trace_record) ||
+      hdr.kval_m < MIN_K || hdr.kval_m >= MAX_K)
+    {
+      fprintf(stderr, "%s: not a trace file\n", argv[1]);
+      fclose(fp);
+      return 1;
+    }
+
+  size_t n = 0, cap = 1024;
+  struct ordered_record *recs = malloc(cap * sizeof(*recs));
+  struct trace_record rec;
+  while (recs && fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+      if (n == cap)
+        {
+          cap *= 2;
+          struct ordered_record *grown = realloc(recs, cap * sizeof(*recs));
+          if (!grown)
+            {
+              free(recs);
+              recs = NULL;
+              break;
+            }
+          recs = grown;
+        }
+      recs[n].rec = rec;
+      recs[n].seq = n;
+      n++;
+    }
+  fclose(fp);
+  if (!recs)
+    {
+      fprintf(stderr, "replay: out of memory\n");
+      return 1;
+    }
+  qsort(recs, n, sizeof(*recs), by_time);
+
+  size_t pool_bytes = argc > 2 ? strtoull(argv[2], NULL, 0) : 0;
+  if (pool_bytes == 0)
+    {
+      pool_bytes = UINT64_C(1) << hdr.kval_m;
+    }
+  size_t samples = argc > 3 ? strtoull(argv[3], NULL, 0) : 20;
+  size_t interval = samples && n > samples ? n / samples : 1;
+
+  struct id_map map;
+  size_t slots = 16;
+  while (slots < 2 * n)
+    slots *= 2;
+  map.ids = calloc(slots, sizeof(uint64_t));
+  map.ptrs = calloc(slots, sizeof(void *));
+  map.mask = slots - 1;
+  if (!map.ids || !map.ptrs)
+    {
+      fprintf(stderr, "replay: out of memory\n");
+      free(map.ids);
+      free(map.ptrs);
+      free(recs);
+      return 1;
+    }
+
+  struct buddy_pool pool;
+  struct buddy_options opts = {.size = pool_bytes};
+  if (buddy_init_opts(&pool, &opts) == -1)
+    {
+      fprintf(stderr, "replay: can not make a %zu byte pool: %s\n", pool_bytes, strerror(errno));
+      free(map.ids);
+      free(map.ptrs);
+      free(recs);
+      return 1;
+    }
+
+  struct op_stats stats[4] = {{0}};
+  stats[TRACE_MALLOC].name = "malloc";
+  stats[TRACE_FREE].name = "free";
+  stats[TRACE_REALLOC].name = "realloc";
+
+  printf("replaying %zu records on a %zu byte pool\n", n, (size_t)pool.numbytes);
+  printf("%10s %14s %14s %14s %8s %8s\n", "op", "live bytes", "free bytes", "largest free", "ext frag", "util");
+
+  size_t live = 0;
+  buddy_latency_reset();
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    {
+      struct trace_record *r = &recs[i].rec;
+      uint64_t t0, t1;
+      void *p;
+      switch (r->op)
+        {
+        case TRACE_MALLOC:
+          t0 = now_ns();
+          p = buddy_malloc(&pool, r->size);
+          t1 = now_ns();
+          record_latency(&stats[r->op], (double)(t1 - t0));
+          if (!p)
+            {
+              stats[r->op].failed++;
+            }
+          else if (r->id == 0)
+            {
+              //The recording run failed here, do not let the replay drift
+              buddy_free(&pool, p);
+            }
+          else
+            {
+              map_put(&map, r->id, p);
+              live += r->size;
+            }
+          break;
+        case TRACE_FREE:
+          p = map_get(&map, r->id);
+          if (!p)
+            break;
+          live -= ((struct avail *)p - 1)->size;
+          map_del(&map, r->id);
+          t0 = now_ns();
+          buddy_free(&pool, p);
+          t1 = now_ns();
+          record_latency(&stats[r->op], (double)(t1 - t0));
+          break;
+        case TRACE_REALLOC:
+          p = map_get(&map, r->old_id);
+          if (!p)
+            break;
+          {
+            size_t old_size = ((struct avail *)p - 1)->size;
+            t0 = now_ns();
+            void *q = buddy_realloc(&pool, p, r->size);
+            t1 = now_ns();
+            record_latency(&stats[r->op], (double)(t1 - t0));
+            if (!q)
+              {
+                stats[r->op].failed++;
+                break;
+              }
+            map_del(&map, r->old_id);
+            if (r->id != 0)
+              {
+                map_put(&map, r->id, q);
+              }
+            live = live - old_size + r->size;
+          }
+          break;
+        case TRACE_RESET:
+          buddy_reset(&pool, BUDDY_RESET_KEEP);
+          memset(map.ids, 0, (map.mask + 1) * sizeof(uint64_t));
+          live = 0;
+          break;
+        default:
+          break;
+        }
+      if ((i + 1) % interval == 0 || i + 1 == n)
+        {
+          print_fragmentation(&pool, i + 1, live);
+        }
+    }
+  double elapsed = (double)(now_ns() - start);
+
+  printf("\n%zu ops in %.3f ms, %.0f ops/s (including sampling)\n", n, elapsed / 1e6,
+         elapsed > 0 ? (double)n / (elapsed / 1e9) : 0.0);
+  printf("%-8s %10s %8s %10s %10s %10s %10s %10s\n", "op", "count", "failed", "mean ns", "p50 ns", "p99 ns",
+         "p999 ns", "max ns");
+  for (int op = TRACE_MALLOC; op <= TRACE_REALLOC; op++)
+    {
+      struct op_stats *st = &stats[op];
+      if (st->count == 0)
+        continue;
+      printf("%-8s %10zu %8zu %10.0f %10.0f %10.0f %10.0f %10.0f\n", st->name, st->count, st->failed,
+             st->total_ns / (double)st->count, latency_quantile(st, 0.5), latency_quantile(st, 0.99),
+             latency_quantile(st, 0.999), st->max_ns);
+    }
+
+  //Only there when built with make latency, broken down by split and merge depth
+  printf("\n");
+  if (buddy_latency_export(stdout) == -1 && errno != ENOSYS)
+    {
+      perror("replay: latency export");
+    }
+
+  if (argc > 4)
+    {
+      FILE *out = fopen(argv[4], "wb");
+      if (!out || buddy_dump_map(&pool, out) == -1)
+        {
+          perror(argv[4]);
+        }
+      if (out)
+        {
+          fclose(out);
+        }
+    }
+
+  buddy_destroy(&pool);
+  free(map.ids);
+  free(map.ptrs);
+  free(recs);
+  return 0;
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../src/lab.h"
+#include "tools.h"
+
+/**
+ * A cache-scratch benchmark for false sharing between threads.
+ *
+ * usage: scratch [threads] [object bytes] [writes]
+ *
+ * The main thread allocates one small object per thread back to back and
+ * hands them out. Each thread frees the object it was given, allocates one
+ * of its own of the same size, and then writes every byte of it writes
+ * times. An allocator that packs small objects together gives the threads
+ * objects on shared cache lines that bounce between their cores, even though
+ * no byte is shared. The run is done with the C library's malloc as the
+ * packing baseline, buddy_malloc and buddy_malloc_exclusive, and counts the
+ * pairs of threads whose objects share a line and the objects that are split
+ * over two lines. The pool is not thread safe, so allocations are serialized
+ * by a lock and only the writes run in parallel.
+ */
+
+struct scratch
+{
+  struct buddy_pool *pool;
+  pthread_mutex_t *lock;
+  void *(*alloc)(struct buddy_pool *pool, size_t size);
+  void (*free)(struct buddy_pool *pool, void *ptr);
+  char *given;                  /*object from the main thread, freed first*/
+  char *own;                    /*object the thread allocated and wrote*/
+  size_t size;
+  size_t writes;
+};
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void *libc_malloc(struct buddy_pool *pool, size_t size)
+{
+  (void)pool;
+  return malloc(size);
+}
+
+static void libc_free(struct buddy_pool *pool, void *ptr)
+{
+  (void)pool;
+  free(ptr);
+}
+
+static void *worker(void *arg)
+{
+  struct scratch *s = arg;
+  pthread_mutex_lock(s->lock);
+  s->free(s->pool, s->given);
+  s->own = s->alloc(s->pool, s->size);
+  pthread_mutex_unlock(s->lock);
+  if (!s->own)
+    return NULL;
+
+  volatile char *obj = s->own;
+  for (size_t w = 0; w < s->writes; w++)
+    for (size_t i = 0; i < s->size; i++)
+      obj[i]++;
+  return NULL;
+}
+
+/*Pairs of threads whose objects have a cache line in common*/
+static size_t shared_pairs(struct scratch *s, size_t threads)
+{
+  size_t pairs = 0;
+  for (size_t a = 0; a < threads; a++)
+    for (size_t b = a + 1; b < threads; b++)
+      {
+        uintptr_t a0 = (uintptr_t)s[a].own / BUDDY_CACHE_LINE;
+        uintptr_t a1 = ((uintptr_t)s[a].own + s[a].size - 1) / BUDDY_CACHE_LINE;
+        uintptr_t b0 = (uintptr_t)s[b].own / BUDDY_CACHE_LINE;
+        uintptr_t b1 = ((uintptr_t)s[b].own + s[b].size - 1) / BUDDY_CACHE_LINE;
+        pairs += a0 <= b1 && b0 <= a1;
+      }
+  return pairs;
+}
+
+/*Objects that start in one cache line and end in another*/
+static size_t split_objects(struct scratch *s, size_t threads)
+{
+  size_t split = 0;
+  for (size_t t = 0; t < threads; t++)
+    split += (uintptr_t)s[t].own / BUDDY_CACHE_LINE != ((uintptr_t)s[t].own + s[t].size - 1) / BUDDY_CACHE_LINE;
+  return split;
+}
+
+static int run(const char *name, void *(*alloc)(struct buddy_pool *, size_t),
+               void (*release)(struct buddy_pool *, void *), size_t threads, size_t size, size_t writes)
+{
+  struct buddy_pool pool;
+  struct buddy_options opts = {.size = UINT64_C(1) << MIN_K};
+  if (buddy_init_opts(&pool, &opts) == -1)
+    {
+      perror(name);
+      return -1;
+    }
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  struct scratch *s = calloc(threads, sizeof(struct scratch));
+  pthread_t *tid = calloc(threads, sizeof(pthread_t));
+  int rval = s && tid ? 0 : -1;
+  for (size_t t = 0; rval == 0 && t < threads; t++)
+    {
+      s[t] = (struct scratch){&pool, &lock, alloc, release, alloc(&pool, size), NULL, size, writes};
+      if (!s[t].given)
+        rval = -1;
+    }
+  if (rval == -1)
+    {
+      fprintf(stderr, "%s: out of memory\n", name);
+      for (size_t t = 0; s && t < threads; t++)
+        if (s[t].given)
+          release(&pool, s[t].given);
+      free(s);
+      free(tid);
+      buddy_destroy(&pool);
+      return -1;
+    }
+
+  double start = now_ns();
+  size_t started = 0;
+  for (; started < threads; started++)
+    if (pthread_create(&tid[started], NULL, worker, &s[started]) != 0)
+      break;
+  for (size_t t = 0; t < started; t++)
+    pthread_join(tid[t], NULL);
+  double elapsed = now_ns() - start;
+
+  if (started < threads)
+    {
+      fprintf(stderr, "%s: could only start %zu threads\n", name, started);
+      rval = -1;
+    }
+  else
+    {
+      printf("%-10s %8zu %8zu %13zu %10zu %10.2f\n", name, threads, size, shared_pairs(s, threads),
+             split_objects(s, threads), elapsed / 1e6);
+    }
+  for (size_t t = started; t < threads; t++)
+    release(&pool, s[t].given);
+  for (size_t t = 0; t < started; t++)
+    release(&pool, s[t].own);
+  free(s);
+  free(tid);
+  buddy_destroy(&pool);
+  return rval;
+}
+
+int scratch_main(int argc, char **argv)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = argc > 1 ? strtoull(argv[1], NULL, 0) : (cpus > 1 ? (size_t)cpus : 2);
+  size_t size = argc > 2 ? strtoull(argv[2], NULL, 0) : 8;
+  size_t writes = argc > 3 ? strtoull(argv[3], NULL, 0) : 1000000;
+  if (threads == 0 || size == 0)
+    {
+      fprintf(stderr, "scratch: needs at least one thread and one byte\n");
+      return 1;
+    }
+
+  printf("%-10s %8s %8s %13s %10s %10s\n", "alloc", "threads", "bytes", "shared pairs", "split objs", "ms");
+  int rval = run("libc", libc_malloc, libc_free, threads, size, writes);
+  if (rval == 0)
+    rval = run("buddy", buddy_malloc, buddy_free, threads, size, writes);
+  if (rval == 0)
+    rval = run("exclusive", buddy_malloc_exclusive, buddy_free, threads, size, writes);
+  return rval == 0 ? 0 : 1;
+}
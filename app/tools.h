@@ -0,0 +1,35 @@
+#ifndef TOOLS_H
+#define TOOLS_H
+
+/**
+ * Entry points of the tools bundled into myprogram. Each one gets argv with
+ * the tool name in argv[0] and returns the exit status.
+ */
+
+/**
+ * Re-execute an allocation trace against a fresh pool and report throughput,
+ * latency and fragmentation over time.
+ */
+int replay_main(int argc, char **argv);
+/**
+ * Render a map written by buddy_dump_map as an occupancy grid and a per order
+ * view of the free regions that reservations pin apart.
+ */
+int heatmap_main(int argc, char **argv);
+/**
+ * Compare memory efficiency and speed of the binary and Fibonacci buddy
+ * engines on synthetic size distributions and optionally a trace.
+ */
+int engines_main(int argc, char **argv);
+/**
+ * Time sweeps over the hot field of many equal sized objects from a plain
+ * and a cache colored pool.
+ */
+int colors_main(int argc, char **argv);
+/**
+ * Cache-scratch: threads write to objects the allocator may have put on
+ * shared cache lines, with buddy_malloc and buddy_malloc_exclusive.
+ */
+int scratch_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef ANNOTATE_H
+#define ANNOTATE_H
+
+/*
+ * Memory error checker annotations for pool managed memory. The pool is one
+ * big mmap so without these AddressSanitizer and Valgrind see every byte of it
+ * as valid. The invariant we maintain is:
+ *
+ *   - every block header (and the stub of an aligned allocation) is accessible
+ *   - the user memory of a reserved block is accessible up to the size asked for
+ *   - everything else, including the payload of free blocks, is not
+ *
+ * AddressSanitizer support is switched on by -fsanitize=address (make debug).
+ * Valgrind client requests need -DBUDDY_VALGRIND (make valgrind). Otherwise
+ * every macro expands to nothing; the sizeof keeps arguments that only exist
+ * for the annotations from being reported as unused without evaluating them.
+ */
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define BUDDY_ASAN 1
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+#define BUDDY_ASAN 1
+#endif
+
+#ifdef BUDDY_ASAN
+#include <sanitizer/asan_interface.h>
+#define ASAN_HIDE(addr, size) ASAN_POISON_MEMORY_REGION((addr), (size))
+#define ASAN_SHOW(addr, size) ASAN_UNPOISON_MEMORY_REGION((addr), (size))
+#define ASAN_HIDDEN(addr, size) (__asan_region_is_poisoned((void *)(addr), (size)) != NULL)
+#else
+#define ASAN_HIDE(addr, size) ((void)sizeof(addr), (void)sizeof(size))
+#define ASAN_SHOW(addr, size) ((void)sizeof(addr), (void)sizeof(size))
+#define ASAN_HIDDEN(addr, size) ((void)sizeof(addr), (void)sizeof(size), 0)
+#endif
+
+#ifdef BUDDY_VALGRIND
+#include <valgrind/memcheck.h>
+#define VG_HIDE(addr, size) VALGRIND_MAKE_MEM_NOACCESS((addr), (size))
+#define VG_SHOW(addr, size) VALGRIND_MAKE_MEM_UNDEFINED((addr), (size))
+#define VG_MALLOC(addr, size) VALGRIND_MALLOCLIKE_BLOCK((addr), (size), 0, 0)
+#define VG_FREE(addr) VALGRIND_FREELIKE_BLOCK((addr), 0)
+#define VG_RESIZE(addr, old_size, new_size) VALGRIND_RESIZEINPLACE_BLOCK((addr), (old_size), (new_size), 0)
+#else
+#define VG_HIDE(addr, size) ((void)sizeof(addr), (void)sizeof(size))
+#define VG_SHOW(addr, size) ((void)sizeof(addr), (void)sizeof(size))
+#define VG_MALLOC(addr, size) ((void)sizeof(addr), (void)sizeof(size))
+#define VG_FREE(addr) ((void)sizeof(addr))
+#define VG_RESIZE(addr, old_size, new_size) ((void)sizeof(addr), (void)sizeof(old_size), (void)sizeof(new_size))
+#endif
+
+/*Allocator metadata (headers, stubs) carved out of hidden memory*/
+#define ANNOTATE_META(addr, size) \
+    do                            \
+    {                             \
+        ASAN_SHOW(addr, size);    \
+        VG_SHOW(addr, size);      \
+    } while (0)
+
+/*Memory nobody may touch: free payloads and headers swallowed by a merge*/
+#define ANNOTATE_HIDE(addr, size) \
+    do                            \
+    {                             \
+        ASAN_HIDE(addr, size);    \
+        VG_HIDE(addr, size);      \
+    } while (0)
+
+/*User memory handed out by an allocation*/
+#define ANNOTATE_MALLOC(addr, size) \
+    do                              \
+    {                               \
+        ASAN_SHOW(addr, size);      \
+        VG_MALLOC(addr, size);      \
+    } while (0)
+
+/*User memory given back by a free, start is the pointer the user had*/
+#define ANNOTATE_FREE(addr, size) \
+    do                            \
+    {                             \
+        VG_FREE(addr);            \
+        ASAN_HIDE(addr, size);    \
+    } while (0)
+
+/*User memory that changed size without moving*/
+#define ANNOTATE_RESIZE(addr, old_size, new_size) \
+    do                                            \
+    {                                             \
+        VG_RESIZE(addr, old_size, new_size);      \
+        ASAN_HIDE(addr, old_size);                \
+        ASAN_SHOW(addr, new_size);                \
+    } while (0)
+
+/*True when a header we are about to read was hidden, i.e. a stale pointer*/
+#define ANNOTATE_HIDDEN(addr, size) ASAN_HIDDEN(addr, size)
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+
+#include "fibonacci.h"
+#include "annotate.h"
+
+/**
+ * @brief The smallest size class that holds bytes.
+ */
+static size_t fib_class(struct buddy_fib *pool, size_t bytes)
+{
+    size_t lo = 0, hi = pool->class_m;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (pool->sizes[mid] < bytes)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void avail_push(struct buddy_fib *pool, struct avail *block)
+{
+    struct avail *head = &pool->avail[block->kval];
+    block->tag = BLOCK_AVAIL;
+    block->next = head->next;
+    block->prev = head;
+    head->next->prev = block;
+    head->next = block;
+}
+
+static void avail_remove(struct avail *block)
+{
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+}
+
+int buddy_fib_init(struct buddy_fib *pool, size_t size)
+{
+    if (!pool || size >= (UINT64_C(1) << MAX_K)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (size == 0)
+        size = UINT64_C(1) << DEFAULT_K;
+
+    memset(pool, 0, sizeof(struct buddy_fib));
+    pool->sizes[0] = FIB_UNIT;
+    pool->sizes[1] = 2 * FIB_UNIT;
+    size_t c = 0;
+    while (pool->sizes[c] < size) {
+        c++;
+        if (c >= 2)
+            pool->sizes[c] = pool->sizes[c - 1] + pool->sizes[c - 2];
+    }
+    pool->class_m = c;
+    pool->numbytes = pool->sizes[c];
+    pool->base = mmap(NULL, pool->numbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == pool->base) {
+        pool->base = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    ANNOTATE_HIDE(pool->base, pool->numbytes);
+    ANNOTATE_META(pool->base, HEADER_SIZE);
+
+    for (size_t i = 0; i < FIB_CLASSES; i++) {
+        pool->avail[i].next = pool->avail[i].prev = &pool->avail[i];
+        pool->avail[i].kval = i;
+        pool->avail[i].tag = BLOCK_UNUSED;
+    }
+    struct avail *m = pool->base;
+    m->kval = c;
+    m->flags = 0;
+    avail_push(pool, m);
+    return 0;
+}
+
+void buddy_fib_destroy(struct buddy_fib *pool)
+{
+    if (!pool || !pool->base) {
+        return;
+    }
+    ANNOTATE_META(pool->base, pool->numbytes);
+    munmap(pool->base, pool->numbytes);
+    memset(pool, 0, sizeof(struct buddy_fib));
+}
+
+void *buddy_fib_malloc(struct buddy_fib *pool, size_t size)
+{
+    if (!pool || size == 0 || size > pool->numbytes - HEADER_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t required = fib_class(pool, size + HEADER_SIZE);
+    size_t c = required;
+    while (c <= pool->class_m && pool->avail[c].next == &pool->avail[c]) {
+        c++;
+    }
+    if (c > pool->class_m) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct avail *block = pool->avail[c].next;
+    avail_remove(block);
+    //Split into class c-1 on the left and c-2 on the right, keeping the
+    //smaller side whenever it is still big enough
+    while (c > required && c >= 2) {
+        struct avail *left = block;
+        struct avail *right = (struct avail *)((uint8_t *)block + pool->sizes[c - 1]);
+        ANNOTATE_META(right, HEADER_SIZE);
+        unsigned short flags = block->flags;
+        left->kval = c - 1;
+        left->flags = FIB_LEFT | ((flags & FIB_LEFT) ? FIB_MEMO : 0);
+        right->kval = c - 2;
+        right->flags = flags & FIB_MEMO;
+        if (c - 2 >= required) {
+            avail_push(pool, left);
+            block = right;
+            c -= 2;
+        } else {
+            avail_push(pool, right);
+            c -= 1;
+        }
+    }
+    block->tag = BLOCK_RESERVED;
+    block->size = size;
+
+    void *mem = (uint8_t *)block + HEADER_SIZE;
+    ANNOTATE_MALLOC(mem, size);
+    return mem;
+}
+
+void buddy_fib_free(struct buddy_fib *pool, void *ptr)
+{
+    if (!pool || !ptr || (uint8_t *)ptr < (uint8_t *)pool->base + HEADER_SIZE ||
+        (uint8_t *)ptr >= (uint8_t *)pool->base + pool->numbytes) {
+        return;
+    }
+    struct avail *block = (struct avail *)((uint8_t *)ptr - HEADER_SIZE);
+    size_t offset = (size_t)((uint8_t *)block - (uint8_t *)pool->base);
+    if ((offset & (FIB_UNIT - 1)) != 0 || ANNOTATE_HIDDEN(block, HEADER_SIZE) || block->tag != BLOCK_RESERVED) {
+        return;
+    }
+    ANNOTATE_FREE(ptr, pool->sizes[block->kval] - HEADER_SIZE);
+
+    for (;;) {
+        size_t c = block->kval;
+        struct avail *left, *right;
+        if (block->flags & FIB_LEFT) {
+            left = block;
+            right = (struct avail *)((uint8_t *)block + pool->sizes[c]);
+            if (c == 0 || c + 1 > pool->class_m || right->tag != BLOCK_AVAIL || right->kval != c - 1) {
+                break;
+            }
+            avail_remove(right);
+        } else {
+            if (c + 2 > pool->class_m || offset < pool->sizes[c + 1]) {
+                break;
+            }
+            left = (struct avail *)((uint8_t *)block - pool->sizes[c + 1]);
+            if (left->tag != BLOCK_AVAIL || left->kval != c + 1 || !(left->flags & FIB_LEFT)) {
+                break;
+            }
+            avail_remove(left);
+            right = block;
+        }
+        //The right header becomes payload, the parent takes its bits back
+        unsigned short flags = ((left->flags & FIB_MEMO) ? FIB_LEFT : 0) | (right->flags & FIB_MEMO);
+        ANNOTATE_HIDE(right, HEADER_SIZE);
+        left->kval = (unsigned short)(right == block ? c + 2 : c + 1);
+        left->flags = flags;
+        block = left;
+        offset = (size_t)((uint8_t *)block - (uint8_t *)pool->base);
+    }
+    avail_push(pool, block);
+}
@@ -0,0 +1,86 @@
+#ifndef FIBONACCI_H
+#define FIBONACCI_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * Block sizes of a Fibonacci pool are FIB_UNIT times 1, 2, 3, 5, 8, ... so
+   * neighbouring size classes are a factor of about 1.6 apart instead of 2.
+   * FIB_CLASSES covers every pool up to 2^MAX_K bytes.
+   */
+#define FIB_UNIT_K SMALLEST_K
+#define FIB_UNIT (UINT64_C(1) << FIB_UNIT_K)
+#define FIB_CLASSES 64
+
+  /**
+   * Bits kept in struct avail flags of a Fibonacci block so the buddy can be
+   * found without a size check on both sides. A block of class i splits into a
+   * left block of class i-1 and a right block of class i-2. FIB_LEFT tells
+   * which side a block is, FIB_MEMO remembers the FIB_LEFT bit of the parent.
+   */
+#define FIB_LEFT 0x1
+#define FIB_MEMO 0x2
+
+  /**
+   * A buddy pool with Fibonacci size classes. Same headers and the same contract
+   * as struct buddy_pool, kval of a block header holds its size class.
+   */
+  struct buddy_fib
+  {
+    size_t class_m;             /*The size class of the whole pool*/
+    size_t numbytes;            /*The number of bytes this pool is managing*/
+    void *base;                 /*Base address of the managed memory*/
+    size_t sizes[FIB_CLASSES];  /*Bytes of a block of each class*/
+    struct avail avail[FIB_CLASSES]; /*Heads of the available blocks of each class*/
+  };
+
+  /**
+   * Initialize a Fibonacci pool of at least size bytes, 0 for 2^DEFAULT_K. The
+   * pool is rounded up to the next size class.
+   *
+   * @param pool The pool to initialize
+   * @param size The size of the pool in bytes
+   * @return 0 on success, -1 with errno set to EINVAL if size is 2^MAX_K or
+   * more, ENOMEM if the memory can not be mapped
+   */
+  int buddy_fib_init(struct buddy_fib *pool, size_t size);
+
+  /**
+   * Unmap a Fibonacci pool.
+   *
+   * @param pool The pool to destroy
+   */
+  void buddy_fib_destroy(struct buddy_fib *pool);
+
+  /**
+   * Same contract as buddy_malloc. User memory is 8 byte aligned.
+   *
+   * @param pool The pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @return A pointer to the memory block or NULL with errno set to ENOMEM
+   */
+  void *buddy_fib_malloc(struct buddy_fib *pool, size_t size);
+
+  /**
+   * Same contract as buddy_free.
+   *
+   * @param pool The pool
+   * @param ptr Pointer to the memory block to free
+   */
+  void buddy_fib_free(struct buddy_fib *pool, void *ptr);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
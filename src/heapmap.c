@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <string.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+
+#include "heapmap.h"
+
+/**
+ * State of a map walk.
+ */
+struct map_walk_ctx
+{
+    struct buddy_pool *pool;
+    FILE *out;                  /*Where to write one byte per block, or NULL to only count*/
+    int64_t blocks;
+};
+
+static void map_entry(struct map_walk_ctx *walk, uint8_t entry)
+{
+    if (walk->out) {
+        fputc(entry, walk->out);
+    }
+    walk->blocks++;
+}
+
+static int map_block(const struct buddy_block *block, void *ctx)
+{
+    struct map_walk_ctx *walk = ctx;
+    uint8_t reserved = block->reserved ? HEAPMAP_RESERVED : 0;
+    if (block->bytes == (UINT64_C(1) << block->kval)) {
+        map_entry(walk, (uint8_t)block->kval | reserved);
+        return 0;
+    }
+    //A trimmed block is written as the blocks it kept
+    uint64_t offset = (uint64_t)((uint8_t *)block->start - (uint8_t *)walk->pool->base);
+    uint64_t end = offset + block->bytes;
+    while (offset < end) {
+        uint64_t k = block->kval;
+        while ((offset & ((UINT64_C(1) << k) - 1)) != 0 || offset + (UINT64_C(1) << k) > end) {
+            k--;
+        }
+        map_entry(walk, (uint8_t)k | reserved);
+        offset += UINT64_C(1) << k;
+    }
+    return 0;
+}
+
+/**
+ * @brief Walk every block of the pool in address order.
+ *
+ * @param pool The memory pool
+ * @param out Where to write one byte per block, or NULL to only count
+ * @return int64_t the number of blocks or -1 if a header does not make sense
+ */
+static int64_t map_walk(struct buddy_pool *pool, FILE *out)
+{
+    struct map_walk_ctx walk = {pool, out, 0};
+    //A nested pool does not manage its lead, it shows up as one reserved block
+    if (pool->lead != 0) {
+        map_entry(&walk, (uint8_t)btok(pool->lead) | HEAPMAP_RESERVED);
+    }
+    if (buddy_walk(pool, map_block, &walk) != 0) {
+        return -1;
+    }
+    return walk.blocks;
+}
+
+int buddy_dump_map(struct buddy_pool *pool, FILE *out)
+{
+    if (!pool || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    //Validate everything first so a damaged pool does not leave half a map
+    int64_t blocks = map_walk(pool, NULL);
+    if (blocks < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    struct heapmap_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, HEAPMAP_MAGIC, sizeof(HEAPMAP_MAGIC));
+    hdr.version = HEAPMAP_VERSION;
+    hdr.kval_m = pool->kval_m;
+    hdr.blocks = (uint64_t)blocks;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    map_walk(pool, out);
+
+    if (fflush(out) == EOF || ferror(out)) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef HEAPMAP_H
+#define HEAPMAP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * Identifies a heap map file.
+   */
+#define HEAPMAP_MAGIC "BDDYMAP"
+#define HEAPMAP_VERSION 1
+
+  /**
+   * Each block is one byte: its kval in the low bits and HEAPMAP_RESERVED set
+   * if it is handed out. Blocks are listed in address order with no gaps so
+   * the offset of a block is the sum of the sizes before it.
+   */
+#define HEAPMAP_KVAL_MASK 0x3f
+#define HEAPMAP_RESERVED  0x80
+
+  /**
+   * The first bytes of every heap map, followed by blocks bytes.
+   */
+  struct heapmap_header
+  {
+    char magic[8];              /*HEAPMAP_MAGIC*/
+    uint32_t version;           /*HEAPMAP_VERSION*/
+    uint32_t unused;            /*Zero*/
+    uint64_t kval_m;            /*The max kval of the pool*/
+    uint64_t blocks;            /*Number of block bytes that follow*/
+  };
+
+  /**
+   * Walk the pool by address with buddy_walk and write the order and state of
+   * every block to out. Nothing else may use the pool
+   * while this runs.
+   *
+   * Render the map with:
+   *
+   *   ./myprogram heatmap pool.map
+   *
+   * @param pool The memory pool to dump
+   * @param out Where to write the map
+   * @return 0 on success, -1 with errno set to EIO if a header is damaged
+   * (nothing is written then) or to whatever the write failed with
+   */
+  int buddy_dump_map(struct buddy_pool *pool, FILE *out);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <sys/mman.h>
@@ -8,6 +9,7 @@
 #include <execinfo.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
@@ -15,6 +17,13 @@
 #endif
 
 #include "lab.h"
+#include "annotate.h"
+#include "trace.h"
+#include "profile.h"
+#include "latency.h"
+#include "leaks.h"
+#include "registry.h"
+#include "quota.h"
 
 #define handle_error_and_die(msg) \
     do                            \
@@ -70,38 +79,30 @@ struct avail *buddy_calc(struct buddy_pool *pool, struct avail *buddy)
     return (struct avail*)buddy_address;
 }
 
-void *buddy_malloc(struct buddy_pool *pool, size_t size)
+/**
+ * @brief The kval of the smallest block of this pool that holds bytes.
+ */
+static size_t pool_kval(struct buddy_pool *pool, size_t bytes)
 {
-    //Validate Values
-    if (size == 0 || !pool || (size > pool->numbytes)){
-        errno = ENOMEM;
-        return NULL;
-    }
-
-    //get the kval for the requested size with enough room for the tag and kval fields
-    size_t required_kval = btok(size + HEADER_SIZE);
-
-    //R1 Find a block where k <= j <= m, if no available block, fail to allocate and return
-    size_t target_kval = required_kval;
-    size_t max_kval = pool->kval_m;
-
+    size_t kval = btok(bytes);
+    return kval < pool->min_k ? pool->min_k : kval;
+}
 
-    while (target_kval <= max_kval){
-        //check for available block
-        if(pool->avail[target_kval].next != &pool->avail[target_kval]){
-            //a block found so exit
-            break;
-        }
-        target_kval++;
-    }
-    //There was not enough memory to satisfy the request we set error and return NULL
-    if (target_kval > max_kval){
-        errno = ENOMEM;
-        return NULL;
-    }
+/**
+ * @brief Reserve a free block, splitting it down to required_kval. The lower
+ * half is kept at every split so the block handed out starts where the free
+ * block did.
+ *
+ * @param pool The memory pool
+ * @param current_block A block on one of the avail lists
+ * @param required_kval The kval of the block to hand out, at most current_block->kval
+ * @return void* pointer to the user memory
+ */
+static void *block_take(struct buddy_pool *pool, struct avail *current_block, size_t required_kval)
+{
+    size_t target_kval = current_block->kval;
 
     //R2 Remove from list;
-    struct avail *current_block = pool->avail[target_kval].next; //grab block
     current_block->prev->next = current_block->next; //update next pointer
     current_block->next->prev = current_block->prev; //update next prev pointer
 
@@ -115,9 +116,11 @@ void *buddy_malloc(struct buddy_pool *pool, size_t size)
          //R4 Split the block
         size_t buddy_size = (UINT64_C(1) << target_kval);
         struct avail *buddy = (struct avail *)((uint8_t *)current_block + buddy_size);
+        ANNOTATE_META(buddy, HEADER_SIZE);
         
         buddy->kval = target_kval;
         buddy->tag = BLOCK_AVAIL;
+        buddy->flags = 0;
 
         //Make the buddy available
         buddy->next = pool->avail[target_kval].next;
@@ -129,37 +132,516 @@ void *buddy_malloc(struct buddy_pool *pool, size_t size)
         current_block->kval = target_kval;
     }
     current_block->tag = BLOCK_RESERVED;
+    current_block->flags &= BLOCK_TAIL;
    
     return (void *)((uint8_t *)current_block + HEADER_SIZE);
 }
 
-void buddy_free(struct buddy_pool *pool, void *ptr)
+/**
+ * @brief The smallest order from required_kval up that has a free block,
+ * kval_m + 1 if there is none.
+ */
+static size_t avail_kval(struct buddy_pool *pool, size_t required_kval)
+{
+    //R1 Find a block where k <= j <= m
+    size_t target_kval = required_kval;
+    while (target_kval <= pool->kval_m){
+        //check for available block
+        if(pool->avail[target_kval].next != &pool->avail[target_kval]){
+            //a block found so exit
+            break;
+        }
+        target_kval++;
+    }
+    return target_kval;
+}
+
+static bool handles_purge(struct buddy_pool *pool, size_t kval);
+
+/**
+ * @brief Take a block of exactly required_kval off the avail lists, splitting a
+ * larger block if no exact fit is available. Purgeable allocations are
+ * reclaimed when nothing fits. Callers validate their arguments.
+ *
+ * @param pool The memory pool to alloc from
+ * @param required_kval The kval of the block to hand out
+ * @return void* pointer to the user memory or NULL with errno set to ENOMEM
+ */
+static void *block_alloc(struct buddy_pool *pool, size_t required_kval)
+{
+    size_t target_kval = avail_kval(pool, required_kval);
+    if (target_kval > pool->kval_m && pool->handles && handles_purge(pool, required_kval)){
+        target_kval = avail_kval(pool, required_kval);
+    }
+    //There was not enough memory to satisfy the request we set error and return NULL
+    if (target_kval > pool->kval_m){
+        errno = ENOMEM;
+        return NULL;
+    }
+    LATENCY_LEVEL(target_kval - required_kval);
+    return block_take(pool, pool->avail[target_kval].next, required_kval);
+}
+
+size_t buddy_block_span(const struct buddy_pool *pool, const struct avail *block)
+{
+    if (block->tag == BLOCK_RESERVED && (block->flags & BLOCK_TRIMMED)){
+        size_t unit = (UINT64_C(1) << pool->min_k) - 1;
+        return (block->size + HEADER_SIZE + unit) & ~unit;
+    }
+    return UINT64_C(1) << block->kval;
+}
+
+int buddy_walk(struct buddy_pool *pool, buddy_walk_fn fn, void *ctx)
+{
+    if (!pool || !pool->base || !fn){
+        errno = EINVAL;
+        return -1;
+    }
+    uint8_t *base = pool->base;
+    size_t offset = pool->lead;
+    while (offset < pool->numbytes){
+        //Read the header once, the checks and the callback see the same values
+        struct avail *header = (struct avail *)(base + offset);
+        struct avail snap;
+        memcpy(&snap, header, sizeof(snap));
+        size_t size = UINT64_C(1) << snap.kval;
+        if (snap.kval < pool->min_k || snap.kval > pool->kval_m || (offset & (size - 1)) != 0 ||
+            (snap.tag != BLOCK_AVAIL && snap.tag != BLOCK_RESERVED)){
+            errno = EIO;
+            return -1;
+        }
+        struct buddy_block block;
+        block.start = header;
+        block.bytes = buddy_block_span(pool, &snap);
+        block.kval = snap.kval;
+        block.reserved = snap.tag == BLOCK_RESERVED;
+        block.ptr = block.reserved ? (uint8_t *)header + HEADER_SIZE : NULL;
+        block.size = block.reserved ? snap.size : 0;
+        block.flags = snap.flags;
+        if (block.bytes > size || block.bytes <= HEADER_SIZE){
+            errno = EIO;
+            return -1;
+        }
+        int rval = fn(&block, ctx);
+        if (rval != 0){
+            return rval;
+        }
+        offset += block.bytes;
+    }
+    return 0;
+}
+
+/**
+ * @brief Hand everything past buddy_block_span of a fresh reservation back to
+ * the avail lists. Going down from the whole block, an upper half that is not
+ * needed is freed and the search continues in the lower half, otherwise the
+ * lower half is kept and the search continues in the upper half. The freed
+ * halves are marked BLOCK_TAIL because their lower buddies have no header.
+ *
+ * @param pool The memory pool
+ * @param block The reserved block with size set
+ */
+static void block_trim(struct buddy_pool *pool, struct avail *block)
+{
+    block->flags |= BLOCK_TRIMMED;
+    uint8_t *lo = (uint8_t *)block;
+    uint8_t *end = lo + buddy_block_span(pool, block);
+    size_t k = block->kval;
+    while (end < lo + (UINT64_C(1) << k)){
+        k--;
+        size_t half = UINT64_C(1) << k;
+        if (end <= lo + half){
+            struct avail *tail = (struct avail *)(lo + half);
+            ANNOTATE_META(tail, HEADER_SIZE);
+            tail->tag = BLOCK_AVAIL;
+            tail->kval = k;
+            tail->flags = BLOCK_TAIL;
+            tail->next = pool->avail[k].next;
+            tail->prev = &pool->avail[k];
+            pool->avail[k].next->prev = tail;
+            pool->avail[k].next = tail;
+        } else {
+            lo += half;
+        }
+    }
+}
+
+/**
+ * @brief Allocate size bytes without any of the tracing hooks. Shared by the
+ * public entry points so that realloc is recorded as a single call.
+ *
+ * @param pool The memory pool to alloc from
+ * @param size The size of the user requested memory block in bytes
+ * @return void* pointer to the user memory or NULL with errno set to ENOMEM
+ */
+static void *pool_malloc(struct buddy_pool *pool, size_t size)
 {
     //Validate Values
-    if ( !pool || !ptr){
-        return;
+    if (size == 0 || !pool || (size > pool->numbytes)){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    //get the kval for the requested size with enough room for the tag and kval fields
+    size_t required_kval = pool_kval(pool, size + HEADER_SIZE);
+
+    void *mem = block_alloc(pool, required_kval);
+    if (mem){
+        ((struct avail *)mem - 1)->size = size;
+        if (pool->trim_k != 0 && required_kval >= pool->trim_k){
+            block_trim(pool, (struct avail *)mem - 1);
+        }
+        ANNOTATE_MALLOC(mem, size);
+    }
+    return mem;
+}
+
+/**
+ * @brief Let the heap profiler sample a fresh allocation. Never inlined so the
+ * profiler knows how many of its frames to drop from the backtrace.
+ *
+ * @param pool The memory pool
+ * @param block The header of the block mem was carved from
+ * @param mem The user memory
+ * @param size The bytes the user asked for
+ */
+__attribute__((noinline)) static void profile_hook(struct buddy_pool *pool, struct avail *block, void *mem, size_t size)
+{
+    if (profile_malloc(pool, mem, size)){
+        block->flags |= BLOCK_SAMPLED;
+    }
+}
+
+/**
+ * @brief The bytes pool_malloc takes from the pool for size, which is what a
+ * tenant is charged for it.
+ */
+static size_t pool_bytes(struct buddy_pool *pool, size_t size)
+{
+    if (size > pool->numbytes){
+        return pool->numbytes;
+    }
+    size_t kval = pool_kval(pool, size + HEADER_SIZE);
+    if (pool->trim_k != 0 && kval >= pool->trim_k){
+        size_t unit = (UINT64_C(1) << pool->min_k) - 1;
+        return (size + HEADER_SIZE + unit) & ~unit;
+    }
+    return UINT64_C(1) << kval;
+}
+
+/**
+ * @brief Move the user memory of a fresh block up by the next cache color
+ * that fits in the slack of the block, leaving a stub in front of it like an
+ * aligned allocation has so that frees find the header.
+ *
+ * @param pool The memory pool
+ * @param block The block pool_malloc just handed out
+ * @param size The bytes the user asked for
+ * @return void* the user memory, colored or not
+ */
+static void *block_color(struct buddy_pool *pool, struct avail *block, size_t size)
+{
+    void *mem = (uint8_t *)block + HEADER_SIZE;
+    if (block->flags & BLOCK_TRIMMED){
+        return mem;
+    }
+    size_t colors = ((UINT64_C(1) << block->kval) - HEADER_SIZE - size) / BUDDY_COLOR_LINE + 1;
+    if (colors > BUDDY_COLORS){
+        colors = BUDDY_COLORS;
+    }
+    size_t color = pool->color++ % colors;
+    if (color == 0){
+        return mem;
+    }
+    uint8_t *user = (uint8_t *)mem + color * BUDDY_COLOR_LINE;
+    ANNOTATE_FREE(mem, size);
+    struct avail *stub = (struct avail *)(user - HEADER_SIZE);
+    ANNOTATE_META(stub, HEADER_SIZE);
+    stub->tag = BLOCK_INDIRECT;
+    stub->kval = block->kval;
+    stub->next = block;
+    stub->size = 0;
+    ANNOTATE_MALLOC(user, size);
+    return user;
+}
+
+/**
+ * @brief buddy_malloc for a tenant. Always inlined so the profiler sees the
+ * public entry point as the frame above its hook.
+ *
+ * @param pool The memory pool to alloc from
+ * @param tenant The tenant to charge
+ * @param size The size of the user requested memory block in bytes
+ * @param site The return address to stamp on the block
+ * @return void* pointer to the user memory or NULL with errno set to ENOMEM
+ */
+static inline __attribute__((always_inline)) void *tenant_malloc(struct buddy_pool *pool, unsigned int tenant,
+                                                                 size_t size, void *site)
+{
+    LATENCY_BEGIN(start);
+    void *mem = NULL;
+    if (!pool || !pool->quota || quota_admit(pool, tenant, pool_bytes(pool, size))){
+        mem = pool_malloc(pool, size);
+    } else {
+        errno = ENOMEM;
+    }
+    struct avail *block = mem ? (struct avail *)mem - 1 : NULL;
+    if (block){
+        block->site = site;
+        block->flags |= (unsigned short)(tenant << BLOCK_TENANT_SHIFT);
+        if (pool->flags & BUDDY_COLOR){
+            mem = block_color(pool, block, size);
+        }
+    }
+    LATENCY_END(start, LATENCY_MALLOC);
+    if (pool && pool->trace){
+        trace_malloc(pool, mem, size);
+    }
+    if (pool && pool->profile && profile_should_sample(size)){
+        profile_hook(pool, block, mem, size);
+    }
+    if (block && pool->quota){
+        quota_charge(pool, tenant, buddy_block_span(pool, block));
+    }
+    return mem;
+}
+
+void *buddy_malloc(struct buddy_pool *pool, size_t size)
+{
+    return tenant_malloc(pool, 0, size, __builtin_return_address(0));
+}
+
+void *buddy_tenant_malloc(struct buddy_pool *pool, unsigned int tenant, size_t size)
+{
+    if (tenant >= BUDDY_TENANTS){
+        errno = EINVAL;
+        return NULL;
+    }
+    return tenant_malloc(pool, tenant, size, __builtin_return_address(0));
+}
+
+void *buddy_malloc_order(struct buddy_pool *pool, size_t kval)
+{
+    //Validate Values
+    if (!pool || kval < pool->min_k || kval > pool->kval_m){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (pool->quota && !quota_admit(pool, 0, UINT64_C(1) << kval)){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    //Fast path: an exact fit is waiting so there is nothing to scan or split
+    LATENCY_BEGIN(start);
+    struct avail *head = &pool->avail[kval];
+    struct avail *current_block = head->next;
+    void *mem;
+    if (current_block != head){
+        current_block->prev->next = current_block->next;
+        current_block->next->prev = current_block->prev;
+        current_block->tag = BLOCK_RESERVED;
+        current_block->flags &= BLOCK_TAIL;
+        mem = (uint8_t *)current_block + HEADER_SIZE;
+    } else {
+        mem = block_alloc(pool, kval);
+    }
+
+    size_t size = (UINT64_C(1) << kval) - HEADER_SIZE;
+    if (mem){
+        ((struct avail *)mem - 1)->size = size;
+        ((struct avail *)mem - 1)->site = __builtin_return_address(0);
+        ANNOTATE_MALLOC(mem, size);
+    }
+    LATENCY_END(start, LATENCY_MALLOC);
+    if (pool->trace){
+        trace_malloc(pool, mem, size);
+    }
+    if (pool->profile && profile_should_sample(size)){
+        profile_hook(pool, mem ? (struct avail *)mem - 1 : NULL, mem, size);
+    }
+    if (mem && pool->quota){
+        quota_charge(pool, 0, UINT64_C(1) << kval);
+    }
+    return mem;
+}
+
+/**
+ * @brief Bytes in front of the user memory of an aligned allocation: the real
+ * header plus a stub directly in front of the user memory. Blocks are aligned
+ * to their size relative to base, so if base is aligned as well the lead can
+ * be rounded up exactly, otherwise we need slack.
+ */
+static size_t aligned_lead(struct buddy_pool *pool, size_t alignment)
+{
+    size_t lead = 2 * HEADER_SIZE;
+    if (((uintptr_t)pool->base & (alignment - 1)) == 0){
+        return (lead + alignment - 1) & ~(alignment - 1);
+    }
+    return lead + alignment - 1;
+}
+
+/**
+ * @brief Aligned allocation without any of the tracing hooks. The stub keeps
+ * the alignment so buddy_realloc can keep it when the data moves.
+ *
+ * @param pool The memory pool to alloc from
+ * @param size The size of the user requested memory block in bytes
+ * @param alignment A power of two stricter than the header's alignment
+ * @return void* pointer to the user memory or NULL with errno set to ENOMEM
+ */
+static void *pool_malloc_aligned(struct buddy_pool *pool, size_t size, size_t alignment)
+{
+    size_t lead = aligned_lead(pool, alignment);
+    if (size > pool->numbytes || size > pool->numbytes - lead){
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *mem = block_alloc(pool, pool_kval(pool, size + lead));
+    if (!mem){
+        return NULL;
+    }
+    struct avail *block = (struct avail *)((uint8_t *)mem - HEADER_SIZE);
+    block->size = size;
+
+    uintptr_t user = ((uintptr_t)block + 2 * HEADER_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    struct avail *stub = (struct avail *)(user - HEADER_SIZE);
+    ANNOTATE_META(stub, HEADER_SIZE);
+    stub->tag = BLOCK_INDIRECT;
+    stub->kval = block->kval;
+    stub->next = block;
+    stub->size = alignment;
+    ANNOTATE_MALLOC((void *)user, size);
+    return (void *)user;
+}
+
+void *buddy_malloc_aligned(struct buddy_pool *pool, size_t size, size_t alignment)
+{
+    //Validate Values
+    if (size == 0 || !pool || (size > pool->numbytes) ||
+        alignment == 0 || (alignment & (alignment - 1)) != 0){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    //Every block starts HEADER_SIZE before the user memory so anything up to the
+    //alignment of the header comes for free
+    if (alignment <= _Alignof(struct avail)){
+        void *mem = buddy_malloc(pool, size);
+        if (mem){
+            ((struct avail *)mem - 1)->site = __builtin_return_address(0);
+        }
+        return mem;
+    }
+
+    size_t lead = aligned_lead(pool, alignment);
+    if (size > pool->numbytes - lead){
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t kval = pool_kval(pool, size + lead);
+    if (pool->quota && !quota_admit(pool, 0, UINT64_C(1) << kval)){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    LATENCY_BEGIN(start);
+    void *user = pool_malloc_aligned(pool, size, alignment);
+    struct avail *block = user ? ((struct avail *)user - 1)->next : NULL;
+    if (block){
+        block->site = __builtin_return_address(0);
+    }
+    LATENCY_END(start, LATENCY_MALLOC);
+    if (pool->trace){
+        trace_malloc(pool, user, size);
+    }
+    if (pool->profile && profile_should_sample(size)){
+        profile_hook(pool, block, user, size);
+    }
+    if (block && pool->quota){
+        quota_charge(pool, 0, UINT64_C(1) << kval);
+    }
+    return user;
+}
+
+void *buddy_malloc_exclusive(struct buddy_pool *pool, size_t size)
+{
+    if (size == 0 || size > SIZE_MAX - BUDDY_CACHE_LINE){
+        errno = ENOMEM;
+        return NULL;
+    }
+    //With the block on a line boundary an aligned allocation puts the header
+    //and stub in the first line and the user memory from the second on
+    size_t lines = (size + BUDDY_CACHE_LINE - 1) & ~(size_t)(BUDDY_CACHE_LINE - 1);
+    void *mem = buddy_malloc_aligned(pool, lines, BUDDY_CACHE_LINE);
+    if (mem){
+        ((struct avail *)mem - 1)->next->site = __builtin_return_address(0);
     }
+    return mem;
+}
 
+/**
+ * @brief Find the header of the block that ptr was handed out from.
+ *
+ * @param pool The memory pool
+ * @param ptr Pointer returned by one of the malloc functions
+ * @return struct avail* the block header or NULL if ptr is not a live allocation
+ */
+static struct avail *block_of(struct buddy_pool *pool, void *ptr)
+{
      // Check if the pointer is within the managed memory range (LLM Suggested)
-     if ((uint8_t*)ptr < (uint8_t*)pool->base || (uint8_t*)ptr >= (uint8_t*)pool->base + pool->numbytes) {
-        return; // Pointer is outside our pool
+     if ((uint8_t*)ptr < (uint8_t*)pool->base + pool->lead || (uint8_t*)ptr >= (uint8_t*)pool->base + pool->numbytes) {
+        return NULL; // Pointer is outside our pool
     }
      // Find the header by subtracting the header size from the ptr
      struct avail *block = (struct avail *)((uint8_t *)ptr - HEADER_SIZE);
-    
+     if (ANNOTATE_HIDDEN(block, HEADER_SIZE)) {
+         return NULL; // the header was swallowed by an earlier free
+     }
+
+     // Aligned allocations keep a stub in front of the user memory that points
+     // back to the real header at the start of the block
+     if (block->tag == BLOCK_INDIRECT) {
+         struct avail *real = block->next;
+         if ((uint8_t *)real < (uint8_t *)pool->base || (uint8_t *)real >= (uint8_t *)block ||
+             (uint8_t *)ptr >= (uint8_t *)real + (UINT64_C(1) << real->kval)) {
+             return NULL; // stale or corrupt stub
+         }
+         block = real;
+     }
+
      // Validate that this is a reserved block
      if (block->tag != BLOCK_RESERVED) {
-         return; // ignore unreserved blocs
+         return NULL; // ignore unreserved blocs
      }
-     
+     return block;
+}
+
+/**
+ * @brief Make a block available and coalesce it with its buddies as far as
+ * they are free.
+ *
+ * @param pool The memory pool
+ * @param block A block with its kval set that is on no avail list
+ */
+static void block_release(struct buddy_pool *pool, struct avail *block)
+{
      // Mark the block as available
      block->tag = BLOCK_AVAIL;
+     block->flags &= BLOCK_TAIL;
      
      // Try to coalesce with buddy
      size_t k_val = block->kval;
+     size_t first_kval = k_val;
      while (k_val < pool->kval_m) {
          // Calculate the buddy
          struct avail *buddy = buddy_calc(pool, block);
+
+         // the lower buddy of a tail is user memory of a trimmed block
+         if (buddy < block && (block->flags & BLOCK_TAIL)) {
+             break;
+         }
          
          // check buddy is available with same kval
          if (buddy->tag != BLOCK_AVAIL || buddy->kval != k_val) {
@@ -170,98 +652,1146 @@ void buddy_free(struct buddy_pool *pool, void *ptr)
          buddy->prev->next = buddy->next;
          buddy->next->prev = buddy->prev;
          
-         // Determine which block is lower in memory
+         // Determine which block is lower in memory, the upper header becomes payload
          if (buddy < block) {
              // merger lower memory block
+             ANNOTATE_HIDE(block, HEADER_SIZE);
              block = buddy;
+         } else {
+             ANNOTATE_HIDE(buddy, HEADER_SIZE);
          }
          
          k_val++;
          block->kval = k_val;
      }
      
+     LATENCY_LEVEL(k_val - first_kval);
+
      // Add the block
      block->next = pool->avail[k_val].next;
      block->prev = &pool->avail[k_val];
      pool->avail[k_val].next->prev = block;
      pool->avail[k_val].next = block;
- }
-
-//IF time allows....
-// /**
-//  * @brief This is a simple version of realloc.
-//  *
-//  * @param poolThe memory pool
-//  * @param ptr  The user memory
-//  * @param size the new size requested
-//  * @return void* pointer to the new user memory
-//  */
-// void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size)
-// {
-//     //Required for Grad Students
-//     //Optional for Undergrad Students
-// }
+}
 
-void buddy_init(struct buddy_pool *pool, size_t size)
+/**
+ * @brief Free a trimmed block. Its kept part is split into the blocks that
+ * block_trim left it as, the tails lose their barrier, and the parts are
+ * released from the top so each one finds its upper buddy already merged.
+ *
+ * @param pool The memory pool
+ * @param block The trimmed block, with its memory already hidden
+ */
+static void trimmed_release(struct buddy_pool *pool, struct avail *block)
 {
-    size_t kval = 0;
-    if (size == 0)
-        kval = DEFAULT_K;
-    else
-        kval = btok(size);
-
-    if (kval < MIN_K)
-        kval = MIN_K;
-    if (kval > MAX_K)
-        kval = MAX_K - 1;
+    struct avail *kept[MAX_K];
+    size_t kvals[MAX_K];
+    size_t count = 0;
+    uint8_t *lo = (uint8_t *)block;
+    uint8_t *end = lo + buddy_block_span(pool, block);
+    size_t k = block->kval;
+    unsigned short tail = block->flags & BLOCK_TAIL;
+    while (end < lo + (UINT64_C(1) << k)){
+        k--;
+        size_t half = UINT64_C(1) << k;
+        if (end <= lo + half){
+            ((struct avail *)(lo + half))->flags &= (unsigned short)~BLOCK_TAIL;
+        } else {
+            kept[count] = (struct avail *)lo;
+            kvals[count++] = k;
+            lo += half;
+        }
+    }
+    kept[count] = (struct avail *)lo;
+    kvals[count++] = k;
 
-    //make sure pool struct is cleared out
-    memset(pool,0,sizeof(struct buddy_pool));
-    pool->kval_m = kval;
-    pool->numbytes = (UINT64_C(1) << pool->kval_m);
-    //Memory map a block of raw memory to manage
-    pool->base = mmap(
-        NULL,                               /*addr to map to*/
-        pool->numbytes,                     /*length*/
-        PROT_READ | PROT_WRITE,             /*prot*/
-        MAP_PRIVATE | MAP_ANONYMOUS,        /*flags*/
-        -1,                                 /*fd -1 when using MAP_ANONYMOUS*/
-        0                                   /* offset 0 when using MAP_ANONYMOUS*/
-    );
-    if (MAP_FAILED == pool->base)
-    {
-        handle_error_and_die("buddy_init avail array mmap failed");
+    //Every part needs a header before the first one can look at its buddies
+    for (size_t i = 0; i < count; i++){
+        ANNOTATE_META(kept[i], HEADER_SIZE);
+        kept[i]->tag = BLOCK_RESERVED;
+        kept[i]->kval = kvals[i];
+        kept[i]->flags = 0;
+    }
+    block->flags = tail;
+    while (count > 0){
+        block_release(pool, kept[--count]);
     }
+}
 
-    //Set all blocks to empty. We are using circular lists so the first elements just point
-    //to an available block. Thus the tag, and kval feild are unused burning a small bit of
-    //memory but making the code more readable. We mark these blocks as UNUSED to aid in debugging.
-    for (size_t i = 0; i <= kval; i++)
-    {
+/**
+ * @brief Free a live block found with block_of.
+ *
+ * @param pool The memory pool
+ * @param block The header of the block
+ * @param ptr Pointer to the memory block to free
+ */
+static void block_free(struct buddy_pool *pool, struct avail *block, void *ptr)
+{
+     if ((uint8_t *)ptr != (uint8_t *)block + HEADER_SIZE) {
+         ((struct avail *)ptr - 1)->tag = BLOCK_UNUSED; // a second free of ptr is now ignored
+     }
+
+     // Hide the user memory, and the stub of an aligned allocation, from checkers
+     uint8_t *block_end = (uint8_t *)block + buddy_block_span(pool, block);
+     ANNOTATE_FREE(ptr, (size_t)(block_end - (uint8_t *)ptr));
+     ANNOTATE_HIDE((uint8_t *)block + HEADER_SIZE, (size_t)(block_end - (uint8_t *)block) - HEADER_SIZE);
+
+     if (block->flags & BLOCK_TRIMMED) {
+         trimmed_release(pool, block);
+     } else {
+         block_release(pool, block);
+     }
+ }
+
+/**
+ * @brief Free without any of the tracing hooks.
+ *
+ * @param pool The memory pool
+ * @param ptr Pointer to the memory block to free
+ */
+static void pool_free(struct buddy_pool *pool, void *ptr)
+{
+     struct avail *block = block_of(pool, ptr);
+     if (block) {
+         block_free(pool, block, ptr);
+     }
+}
+
+void buddy_free(struct buddy_pool *pool, void *ptr)
+{
+    //Validate Values
+    if ( !pool || !ptr){
+        return;
+    }
+    if (pool->trace){
+        trace_free(pool, ptr);
+    }
+    //Handle memory is only ever freed through its handle
+    struct avail *block = block_of(pool, ptr);
+    if (!block || (block->flags & BLOCK_HANDLE)){
+        return;
+    }
+    if (pool->profile && (block->flags & BLOCK_SAMPLED)){
+        profile_free(pool, ptr);
+    }
+    if (pool->quota){
+        quota_credit(pool, block->flags >> BLOCK_TENANT_SHIFT, buddy_block_span(pool, block));
+    }
+    LATENCY_BEGIN(start);
+    block_free(pool, block, ptr);
+    LATENCY_END(start, LATENCY_FREE);
+}
+
+void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    //Tails, heap samples, tenants and colors are only known from the header
+    if (!pool || !ptr || size == 0 || size > pool->numbytes || pool->trim_k != 0 || pool->profile || pool->quota ||
+        (pool->flags & BUDDY_COLOR)){
+        buddy_free(pool, ptr);
+        return;
+    }
+    //Anything but a live plain block, like an aligned allocation behind its
+    //stub, a handle or a second free, is sorted out by buddy_free
+    struct avail *block = (struct avail *)((uint8_t *)ptr - HEADER_SIZE);
+    if ((uint8_t *)block < (uint8_t *)pool->base + pool->lead || (uint8_t *)ptr >= (uint8_t *)pool->base + pool->numbytes ||
+        ANNOTATE_HIDDEN(block, HEADER_SIZE) || block->tag != BLOCK_RESERVED || (block->flags & ~BLOCK_TAIL) != 0){
+        buddy_free(pool, ptr);
+        return;
+    }
+    size_t kval = pool_kval(pool, size + HEADER_SIZE);
+    if (block->kval != kval){
+#ifdef BUDDY_DEBUG
+        fprintf(stderr, "buddy_free_sized: %p is not a live allocation of %zu bytes\n", ptr, size);
+        abort();
+#endif
+        buddy_free(pool, ptr);
+        return;
+    }
+    if (pool->trace){
+        trace_free(pool, ptr);
+    }
+    LATENCY_BEGIN(start);
+    ANNOTATE_FREE(ptr, (UINT64_C(1) << kval) - HEADER_SIZE);
+    ANNOTATE_HIDE(ptr, (UINT64_C(1) << kval) - HEADER_SIZE);
+    block_release(pool, block);
+    LATENCY_END(start, LATENCY_FREE);
+}
+
+bool buddy_owns(const struct buddy_pool *pool, const void *ptr)
+{
+    if (!pool || !pool->base) {
+        return false;
+    }
+    return (const uint8_t *)ptr >= (const uint8_t *)pool->base + pool->lead &&
+           (const uint8_t *)ptr < (const uint8_t *)pool->base + pool->numbytes;
+}
+
+/**
+ * @brief Check whether a block can grow in place to required_kval, which is
+ * the case when it is the lower half at every level up to there and each of
+ * those upper halves is a whole free block.
+ *
+ * @param pool The memory pool
+ * @param block The reserved block
+ * @param required_kval The kval it needs to grow to
+ * @return true if the block can grow in place
+ */
+static bool block_can_grow(struct buddy_pool *pool, struct avail *block, size_t required_kval)
+{
+    if (required_kval > pool->kval_m){
+        return false;
+    }
+    uintptr_t offset = (uintptr_t)block - (uintptr_t)pool->base;
+    for (size_t k = block->kval; k < required_kval; k++){
+        size_t bytes = UINT64_C(1) << k;
+        struct avail *buddy = (struct avail *)((uint8_t *)block + bytes);
+        if ((offset & bytes) != 0 || buddy->tag != BLOCK_AVAIL || buddy->kval != k){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Realloc without any of the tracing hooks. Shrinks and grows in place
+ * when the buddy system allows it and moves the data otherwise.
+ *
+ * @param pool The memory pool
+ * @param ptr  The user memory, not NULL
+ * @param size the new size requested, not zero
+ * @return void* pointer to the new user memory or NULL with errno set to ENOMEM
+ */
+static void *pool_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    struct avail *block = block_of(pool, ptr);
+    if (!block || size > pool->numbytes){
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t old_size = block->size;
+    size_t required_kval = pool_kval(pool, size + HEADER_SIZE);
+
+    //Aligned and colored allocations always move, the new block gets a stub
+    //with the same alignment or the next color. Trimmed ones move because
+    //their tails may be in use.
+    if ((uint8_t *)ptr == (uint8_t *)block + HEADER_SIZE && !(block->flags & BLOCK_TRIMMED)){
+        if (required_kval <= block->kval){
+            //Shrink by handing the upper halves back, they can not coalesce
+            //because their buddy is the block we are keeping
+            ANNOTATE_RESIZE(ptr, old_size, size);
+            LATENCY_LEVEL(block->kval - required_kval);
+            while (block->kval > required_kval){
+                block->kval--;
+                struct avail *buddy = (struct avail *)((uint8_t *)block + (UINT64_C(1) << block->kval));
+                ANNOTATE_META(buddy, HEADER_SIZE);
+                buddy->tag = BLOCK_AVAIL;
+                buddy->kval = block->kval;
+                buddy->flags = 0;
+                buddy->next = pool->avail[buddy->kval].next;
+                buddy->prev = &pool->avail[buddy->kval];
+                pool->avail[buddy->kval].next->prev = buddy;
+                pool->avail[buddy->kval].next = buddy;
+            }
+            block->size = size;
+            return ptr;
+        }
+        if (block_can_grow(pool, block, required_kval)){
+            //Swallow the free upper halves, their headers become user memory
+            LATENCY_LEVEL(required_kval - block->kval);
+            while (block->kval < required_kval){
+                struct avail *buddy = (struct avail *)((uint8_t *)block + (UINT64_C(1) << block->kval));
+                buddy->prev->next = buddy->next;
+                buddy->next->prev = buddy->prev;
+                block->kval++;
+            }
+            ANNOTATE_RESIZE(ptr, old_size, size);
+            block->size = size;
+            return ptr;
+        }
+    }
+
+    struct avail *stub = (struct avail *)ptr - 1;
+    void *mem;
+    if (stub != block && stub->size != 0){
+        mem = pool_malloc_aligned(pool, size, stub->size);
+    } else {
+        mem = pool_malloc(pool, size);
+    }
+    if (!mem){
+        return NULL;
+    }
+    struct avail *to = (struct avail *)mem - 1;
+    if (to->tag == BLOCK_INDIRECT){
+        to = to->next;
+    } else if (pool->flags & BUDDY_COLOR){
+        mem = block_color(pool, to, size);
+    }
+    memcpy(mem, ptr, old_size < size ? old_size : size);
+    to->flags |= block->flags & (unsigned short)~((1u << BLOCK_TENANT_SHIFT) - 1);
+    pool_free(pool, ptr);
+    return mem;
+}
+
+void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    if (!ptr){
+        void *mem = buddy_malloc(pool, size);
+        if (mem){
+            ((struct avail *)mem - 1)->site = __builtin_return_address(0);
+        }
+        return mem;
+    }
+    if (!pool){
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (size == 0){
+        buddy_free(pool, ptr);
+        return NULL;
+    }
+    struct avail *block = pool->profile || pool->quota ? block_of(pool, ptr) : NULL;
+    bool sampled = block && (block->flags & BLOCK_SAMPLED);
+    unsigned int tenant = block ? block->flags >> BLOCK_TENANT_SHIFT : 0;
+    size_t old_bytes = block ? buddy_block_span(pool, block) : 0;
+    if (pool->quota && block){
+        size_t bytes = pool_bytes(pool, size);
+        if (bytes > old_bytes && !quota_admit(pool, tenant, bytes - old_bytes)){
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    LATENCY_BEGIN(start);
+    void *mem = pool_realloc(pool, ptr, size);
+    LATENCY_END(start, LATENCY_REALLOC);
+    if (mem && mem != ptr){
+        block_of(pool, mem)->site = __builtin_return_address(0);
+    }
+    if (pool->trace){
+        trace_realloc(pool, ptr, mem, size);
+    }
+    if (mem && pool->profile){
+        //The old sample is gone, the new size gets its own chance to be sampled
+        block = block_of(pool, mem);
+        if (sampled){
+            profile_free(pool, ptr);
+            block->flags &= (unsigned short)~BLOCK_SAMPLED;
+        }
+        if (profile_should_sample(size)){
+            profile_hook(pool, block, mem, size);
+        }
+    }
+    if (mem && pool->quota && old_bytes != 0){
+        //Only the difference is counted so a tenant sitting on a limit is not
+        //taken under and over it again by every realloc
+        size_t new_bytes = buddy_block_span(pool, block_of(pool, mem));
+        if (new_bytes > old_bytes){
+            quota_charge(pool, tenant, new_bytes - old_bytes);
+        } else if (new_bytes < old_bytes){
+            quota_credit(pool, tenant, old_bytes - new_bytes);
+        }
+    }
+    return mem;
+}
+
+/**
+ * A handle table entry. Free entries are chained through next_free.
+ */
+struct handle_slot
+{
+    void *ptr;                  /*user memory, NULL while the slot is free*/
+    uint32_t gen;               /*bumped on every free so stale handles are caught*/
+    uint32_t pins;              /*outstanding buddy_hpin calls*/
+    size_t next_free;           /*index + 1 of the next free slot, 0 ends the list*/
+    buddy_purge_fn purge;       /*told when a purgeable allocation is reclaimed*/
+    void *ctx;                  /*passed to purge*/
+    uint64_t unpinned;          /*handle clock when the last pin was dropped*/
+    void *site;                 /*return address of the halloc call, the header holds the slot*/
+};
+
+/**
+ * The handles of a pool, hung off struct buddy_pool. A handle is the index of
+ * its slot plus one in the low 32 bits and the slot generation in the high 32.
+ */
+struct buddy_handles
+{
+    struct handle_slot *slots;  /*grows as needed, never shrinks*/
+    size_t count;               /*slots in use or on the free list*/
+    size_t cap;                 /*slots allocated*/
+    size_t free_head;           /*index + 1 of the first free slot, 0 if none*/
+    size_t purgeable;           /*live purgeable allocations*/
+    uint64_t clock;             /*ticks on every allocation and last unpin*/
+};
+
+/**
+ * @brief Look up the slot of a live handle.
+ *
+ * @return struct handle_slot* the slot or NULL if handle is stale or invalid
+ */
+static struct handle_slot *handle_slot(struct buddy_pool *pool, buddy_handle handle)
+{
+    size_t index = (size_t)(handle & UINT32_MAX);
+    if (!pool || !pool->handles || index == 0 || index > pool->handles->count){
+        return NULL;
+    }
+    struct handle_slot *slot = &pool->handles->slots[index - 1];
+    if (!slot->ptr || slot->gen != (uint32_t)(handle >> 32)){
+        return NULL;
+    }
+    return slot;
+}
+
+/**
+ * @brief Allocate a handle, purgeable if flags has BLOCK_PURGEABLE.
+ *
+ * @param pool The memory pool to alloc from
+ * @param size The size of the user requested memory block in bytes
+ * @param flags 0 or BLOCK_PURGEABLE
+ * @param fn Called when a purgeable allocation is reclaimed, may be NULL
+ * @param ctx Passed through to fn
+ * @param site The return address of the public entry point
+ * @return buddy_handle the handle or 0 with errno set to ENOMEM
+ */
+static buddy_handle handle_alloc(struct buddy_pool *pool, size_t size, unsigned short flags, buddy_purge_fn fn,
+                                 void *ctx, void *site)
+{
+    if (!pool){
+        errno = ENOMEM;
+        return 0;
+    }
+    if (!pool->handles){
+        pool->handles = calloc(1, sizeof(struct buddy_handles));
+        if (!pool->handles){
+            return 0;
+        }
+    }
+    struct buddy_handles *handles = pool->handles;
+    if (handles->free_head == 0 && handles->count == handles->cap){
+        size_t cap = handles->cap ? 2 * handles->cap : 64;
+        struct handle_slot *slots = cap < UINT32_MAX ? realloc(handles->slots, cap * sizeof(struct handle_slot)) : NULL;
+        if (!slots){
+            errno = ENOMEM;
+            return 0;
+        }
+        handles->slots = slots;
+        handles->cap = cap;
+    }
+
+    if (pool->quota && !quota_admit(pool, 0, pool_bytes(pool, size))){
+        errno = ENOMEM;
+        return 0;
+    }
+    void *mem = pool_malloc(pool, size);
+    if (!mem){
+        return 0;
+    }
+
+    size_t index;
+    if (handles->free_head != 0){
+        index = handles->free_head - 1;
+        handles->free_head = handles->slots[index].next_free;
+    } else {
+        index = handles->count++;
+        handles->slots[index].gen = 1;
+    }
+    struct handle_slot *slot = &handles->slots[index];
+    slot->ptr = mem;
+    slot->pins = 0;
+    slot->next_free = 0;
+    slot->purge = fn;
+    slot->ctx = ctx;
+    slot->site = site;
+    slot->unpinned = ++handles->clock;
+    if (flags & BLOCK_PURGEABLE){
+        handles->purgeable++;
+    }
+
+    struct avail *block = (struct avail *)mem - 1;
+    block->flags |= BLOCK_HANDLE | flags;
+    block->slot = index;
+    if (pool->quota){
+        quota_charge(pool, 0, buddy_block_span(pool, block));
+    }
+    return ((uint64_t)slot->gen << 32) | (index + 1);
+}
+
+buddy_handle buddy_halloc(struct buddy_pool *pool, size_t size)
+{
+    return handle_alloc(pool, size, 0, NULL, NULL, __builtin_return_address(0));
+}
+
+buddy_handle buddy_palloc(struct buddy_pool *pool, size_t size, buddy_purge_fn fn, void *ctx)
+{
+    return handle_alloc(pool, size, BLOCK_PURGEABLE, fn, ctx, __builtin_return_address(0));
+}
+
+void *handle_site(const struct buddy_pool *pool, size_t slot)
+{
+    if (!pool->handles || slot >= pool->handles->count){
+        return NULL;
+    }
+    return pool->handles->slots[slot].site;
+}
+
+void *buddy_hpin(struct buddy_pool *pool, buddy_handle handle)
+{
+    struct handle_slot *slot = handle_slot(pool, handle);
+    if (!slot){
+        errno = EINVAL;
+        return NULL;
+    }
+    slot->pins++;
+    return slot->ptr;
+}
+
+void buddy_hunpin(struct buddy_pool *pool, buddy_handle handle)
+{
+    struct handle_slot *slot = handle_slot(pool, handle);
+    if (slot && slot->pins > 0 && --slot->pins == 0){
+        slot->unpinned = ++pool->handles->clock;
+    }
+}
+
+/**
+ * @brief Free the memory of a live handle slot and put the slot on the free
+ * list.
+ */
+static void handle_release(struct buddy_pool *pool, struct handle_slot *slot)
+{
+    struct avail *block = (struct avail *)slot->ptr - 1;
+    if (block->flags & BLOCK_PURGEABLE){
+        pool->handles->purgeable--;
+    }
+    if (pool->quota){
+        quota_credit(pool, block->flags >> BLOCK_TENANT_SHIFT, buddy_block_span(pool, block));
+    }
+    pool_free(pool, slot->ptr);
+    slot->ptr = NULL;
+    slot->purge = NULL;
+    slot->gen++;
+    slot->next_free = pool->handles->free_head;
+    pool->handles->free_head = (size_t)(slot - pool->handles->slots) + 1;
+}
+
+/**
+ * @brief Tell the owner of a purgeable allocation it is gone and free it.
+ */
+static void handle_purge(struct buddy_pool *pool, struct handle_slot *slot)
+{
+    size_t index = (size_t)(slot - pool->handles->slots);
+    if (slot->purge){
+        slot->purge(pool, ((uint64_t)slot->gen << 32) | (index + 1), slot->ctx);
+    }
+    handle_release(pool, slot);
+}
+
+/**
+ * @brief Reclaim unpinned purgeable allocations until a block of kval or
+ * larger is free. The one unpinned the longest among those big enough on their
+ * own goes first. Otherwise they go in slot order until enough has coalesced.
+ *
+ * @param pool The memory pool
+ * @param kval The order that is needed
+ * @return true if a block of kval or larger is free now
+ */
+static bool handles_purge(struct buddy_pool *pool, size_t kval)
+{
+    struct buddy_handles *handles = pool->handles;
+    if (handles->purgeable == 0){
+        return false;
+    }
+    struct handle_slot *oldest = NULL;
+    for (size_t i = 0; i < handles->count; i++){
+        struct handle_slot *slot = &handles->slots[i];
+        if (!slot->ptr || slot->pins != 0){
+            continue;
+        }
+        struct avail *block = (struct avail *)slot->ptr - 1;
+        if ((block->flags & BLOCK_PURGEABLE) && block->kval >= kval && (!oldest || slot->unpinned < oldest->unpinned)){
+            oldest = slot;
+        }
+    }
+    if (oldest){
+        handle_purge(pool, oldest);
+        if (avail_kval(pool, kval) <= pool->kval_m){
+            return true;
+        }
+    }
+    for (size_t i = 0; i < handles->count && handles->purgeable > 0; i++){
+        struct handle_slot *slot = &handles->slots[i];
+        if (slot->ptr && slot->pins == 0 && (((struct avail *)slot->ptr - 1)->flags & BLOCK_PURGEABLE)){
+            handle_purge(pool, slot);
+            if (avail_kval(pool, kval) <= pool->kval_m){
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void buddy_hfree(struct buddy_pool *pool, buddy_handle handle)
+{
+    struct handle_slot *slot = handle_slot(pool, handle);
+    if (slot){
+        handle_release(pool, slot);
+    }
+}
+
+/**
+ * Free blocks of one order that buddy_compact may move into, kept as a min
+ * heap on the address so the lowest one is always on top.
+ */
+struct compact_heap
+{
+    struct avail **items;
+    size_t count;
+    size_t cap;
+};
+
+static bool compact_push(struct compact_heap *heap, struct avail *block)
+{
+    if (heap->count == heap->cap){
+        size_t cap = heap->cap ? 2 * heap->cap : 16;
+        struct avail **items = realloc(heap->items, cap * sizeof(struct avail *));
+        if (!items){
+            return false;
+        }
+        heap->items = items;
+        heap->cap = cap;
+    }
+    size_t i = heap->count++;
+    while (i > 0 && heap->items[(i - 1) / 2] > block){
+        heap->items[i] = heap->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->items[i] = block;
+    return true;
+}
+
+static void compact_pop(struct compact_heap *heap)
+{
+    struct avail *last = heap->items[--heap->count];
+    size_t i = 0;
+    for (size_t c = 1; c < heap->count; c = 2 * i + 1){
+        if (c + 1 < heap->count && heap->items[c + 1] < heap->items[c]){
+            c++;
+        }
+        if (heap->items[c] > last){
+            break;
+        }
+        heap->items[i] = heap->items[c];
+        i = c;
+    }
+    heap->items[i] = last;
+}
+
+/**
+ * @brief The lowest free block of order kval below limit. Blocks are moved
+ * highest first, so limit only goes down and whatever is not below it
+ * anymore is dropped for good. Everything that is still below it is exactly
+ * as it was pushed, since only a move takes a block there and the space a
+ * move frees coalesces above the next limit.
+ *
+ * @return struct avail* the block or NULL if there is none
+ */
+static struct avail *compact_lowest(struct compact_heap *heap, size_t kval, struct avail *limit)
+{
+    while (heap->count > 0){
+        struct avail *top = heap->items[0];
+        if (top < limit && top->tag == BLOCK_AVAIL && top->kval == kval){
+            return top;
+        }
+        compact_pop(heap);
+    }
+    return NULL;
+}
+
+/**
+ * @brief The order the space of a reserved block coalesces to once it is
+ * released, the same way block_release would, if dest is taken first.
+ */
+static size_t release_kval(struct buddy_pool *pool, struct avail *block, struct avail *dest)
+{
+    size_t k_val = block->kval;
+    struct avail *low = block;
+    while (k_val < pool->kval_m){
+        uintptr_t offset = ((uintptr_t)low - (uintptr_t)pool->base) ^ (UINT64_C(1) << k_val);
+        struct avail *buddy = (struct avail *)((uint8_t *)pool->base + offset);
+        if (buddy < low && (low->flags & BLOCK_TAIL)){
+            break;
+        }
+        if (buddy == dest || buddy->tag != BLOCK_AVAIL || buddy->kval != k_val){
+            break;
+        }
+        if (buddy < low){
+            low = buddy;
+        }
+        k_val++;
+    }
+    return k_val;
+}
+
+size_t buddy_compact(struct buddy_pool *pool, uint64_t budget_ns)
+{
+    if (!pool || !pool->handles || pool->handles->count == 0){
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t deadline = (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec + budget_ns;
+
+    //Collect the blocks we may move in address order
+    struct avail **movable = malloc(pool->handles->count * sizeof(struct avail *));
+    if (!movable){
+        return 0;
+    }
+    //and the free blocks they may go to by order
+    struct compact_heap free_blocks[MAX_K] = {0};
+    bool ok = true;
+    size_t count = 0;
+    for (uint8_t *p = (uint8_t *)pool->base + pool->lead; ok && p < (uint8_t *)pool->base + pool->numbytes; p += buddy_block_span(pool, (struct avail *)p)){
+        struct avail *block = (struct avail *)p;
+        if (block->tag == BLOCK_AVAIL){
+            ok = compact_push(&free_blocks[block->kval], block);
+        } else if (block->tag == BLOCK_RESERVED && (block->flags & (BLOCK_HANDLE | BLOCK_TRIMMED)) == BLOCK_HANDLE &&
+            pool->handles->slots[block->slot].pins == 0){
+            movable[count++] = block;
+        }
+    }
+    if (!ok){
+        count = 0;
+    }
+
+    //Highest first, so what they leave behind can coalesce with the free space above
+    size_t moved = 0;
+    while (count > 0){
+        if (moved > 0){
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            if ((uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec >= deadline){
+                break;
+            }
+        }
+        struct avail *block = movable[--count];
+
+        //Never split a free block larger than what the move frees, or the
+        //largest free block could shrink
+        size_t most = release_kval(pool, block, NULL);
+        struct avail *dest = NULL;
+        for (size_t k = block->kval; k <= most; k++){
+            struct avail *low = compact_lowest(&free_blocks[k], k, block);
+            if (low && (!dest || low < dest)){
+                dest = low;
+            }
+        }
+        if (!dest || dest->kval > release_kval(pool, block, dest)){
+            continue;
+        }
+
+        size_t from = dest->kval;
+        compact_pop(&free_blocks[from]);
+        void *old = (uint8_t *)block + HEADER_SIZE;
+        void *mem = block_take(pool, dest, block->kval);
+        for (size_t k = block->kval; k < from; k++){
+            compact_push(&free_blocks[k], (struct avail *)((uint8_t *)dest + (UINT64_C(1) << k)));
+        }
+        struct avail *to = (struct avail *)mem - 1;
+        ANNOTATE_MALLOC(mem, block->size);
+        memcpy(mem, old, block->size);
+        to->size = block->size;
+        to->flags = (unsigned short)((to->flags & BLOCK_TAIL) | (block->flags & ~BLOCK_TAIL));
+        to->slot = block->slot;
+        pool->handles->slots[block->slot].ptr = mem;
+        pool_free(pool, old);
+        moved++;
+    }
+    for (size_t k = 0; k < MAX_K; k++){
+        free(free_blocks[k].items);
+    }
+    free(movable);
+    return moved;
+}
+
+/**
+ * @brief Bytes mapped for a pool of order kval: the managed memory followed by
+ * the kval + 1 avail list heads, rounded up to whole pages.
+ */
+static size_t pool_maplen(size_t kval)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t heads = (kval + 1) * sizeof(struct avail);
+    return (UINT64_C(1) << kval) + ((heads + page - 1) & ~(page - 1));
+}
+
+/**
+ * @brief Put a pool with base, kval_m, lead and avail set up into the state
+ * where all of its memory is free: one block, or for a nested pool the
+ * descending run of blocks that covers everything after the lead.
+ *
+ * @param pool The memory pool
+ */
+static void pool_format(struct buddy_pool *pool)
+{
+    size_t kval = pool->kval_m;
+    ANNOTATE_HIDE((uint8_t *)pool->base + pool->lead, pool->numbytes - pool->lead);
+
+    //Set all blocks to empty. We are using circular lists so the first elements just point
+    //to an available block. Thus the tag, and kval feild are unused burning a small bit of
+    //memory but making the code more readable. We mark these blocks as UNUSED to aid in debugging.
+    for (size_t i = 0; i <= kval; i++)
+    {
         pool->avail[i].next = pool->avail[i].prev = &pool->avail[i];
         pool->avail[i].kval = i;
         pool->avail[i].tag = BLOCK_UNUSED;
     }
 
-    //Add in the first block
-    pool->avail[kval].next = pool->avail[kval].prev = (struct avail *)pool->base;
-    struct avail *m = pool->avail[kval].next;
-    m->tag = BLOCK_AVAIL;
-    m->kval = kval;
-    m->next = m->prev = &pool->avail[kval];
+    //Add in the first block. A nested pool starts with the blocks of orders
+    //lead to kval - 1, which never coalesce with the lead because the parent's
+    //reserved header sits at its start.
+    size_t first = kval;
+    size_t offset = 0;
+    if (pool->lead != 0){
+        first = btok(pool->lead);
+        offset = pool->lead;
+    }
+    for (size_t k = first; k <= kval && offset < pool->numbytes; k++){
+        struct avail *m = (struct avail *)((uint8_t *)pool->base + offset);
+        ANNOTATE_META(m, HEADER_SIZE);
+        m->tag = BLOCK_AVAIL;
+        m->kval = k;
+        m->flags = 0;
+        m->next = m->prev = &pool->avail[k];
+        pool->avail[k].next = pool->avail[k].prev = m;
+        offset += UINT64_C(1) << k;
+    }
+}
+
+/**
+ * A slice of a pool for one prefault thread.
+ */
+struct prefault_slice
+{
+    uint8_t *start;
+    size_t len;
+    size_t page;
+};
+
+static void *prefault_slice(void *arg)
+{
+    struct prefault_slice *slice = arg;
+    for (size_t off = 0; off < slice->len; off += slice->page){
+        ((volatile uint8_t *)slice->start)[off] = 0;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fault in every page of a fresh mapping, split between threads. Any
+ * thread that can not be started has its slice done by the caller.
+ *
+ * @param base The start of the mapping, page aligned
+ * @param len Bytes to fault in
+ * @param threads Threads to use, 0 for one per online CPU
+ */
+static void prefault(uint8_t *base, size_t len, size_t threads)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (threads == 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (size_t)cpus : 1;
+    }
+    size_t most = (len + BUDDY_PREFAULT_SLICE - 1) / BUDDY_PREFAULT_SLICE;
+    if (threads > most){
+        threads = most;
+    }
+    if (threads > 64){
+        threads = 64;
+    }
+    if (threads == 0){
+        threads = 1;
+    }
+
+    pthread_t tids[64];
+    bool started[64];
+    struct prefault_slice slices[64];
+    size_t pages = (len + page - 1) / page;
+    for (size_t i = 0; i < threads; i++){
+        size_t first = pages * i / threads;
+        size_t last = pages * (i + 1) / threads;
+        slices[i].start = base + first * page;
+        slices[i].len = (last - first) * page;
+        slices[i].page = page;
+        //The caller takes the first slice itself
+        started[i] = i > 0 && pthread_create(&tids[i], NULL, prefault_slice, &slices[i]) == 0;
+    }
+    for (size_t i = 0; i < threads; i++){
+        if (started[i]){
+            pthread_join(tids[i], NULL);
+        } else {
+            prefault_slice(&slices[i]);
+        }
+    }
+}
+
+int buddy_init_opts(struct buddy_pool *pool, const struct buddy_options *opts)
+{
+    if (!pool || !opts) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t min_k = opts->min_k ? opts->min_k : SMALLEST_K;
+    size_t kval = opts->size ? btok(opts->size) : DEFAULT_K;
+    if (kval < min_k)
+        kval = min_k;
+    const unsigned int known = BUDDY_POPULATE | BUDDY_PREFAULT | BUDDY_MLOCK | BUDDY_MLOCK_ONFAULT | BUDDY_LEAK_CHECK |
+                                BUDDY_COLOR;
+    if (min_k < SMALLEST_K || kval >= MAX_K || (opts->trim_k != 0 && opts->trim_k <= min_k) ||
+        (opts->flags & ~known) != 0 || (opts->flags & (BUDDY_MLOCK | BUDDY_MLOCK_ONFAULT)) == (BUDDY_MLOCK | BUDDY_MLOCK_ONFAULT)) {
+        errno = EINVAL;
+        return -1;
+    }
+#ifndef MLOCK_ONFAULT
+    if (opts->flags & BUDDY_MLOCK_ONFAULT) {
+        errno = ENOSYS;
+        return -1;
+    }
+#endif
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+    if (opts->flags & BUDDY_POPULATE)
+        map_flags |= MAP_POPULATE;
+#endif
+
+    //make sure pool struct is cleared out
+    memset(pool,0,sizeof(struct buddy_pool));
+    pool->kval_m = kval;
+    pool->min_k = min_k;
+    pool->trim_k = opts->trim_k;
+    pool->flags = opts->flags;
+    pool->numbytes = (UINT64_C(1) << pool->kval_m);
+    //Memory map a block of raw memory to manage, the avail heads live right after it
+    void *base = mmap(
+        NULL,                               /*addr to map to*/
+        pool_maplen(kval),                  /*length*/
+        PROT_READ | PROT_WRITE,             /*prot*/
+        map_flags,                          /*flags*/
+        -1,                                 /*fd -1 when using MAP_ANONYMOUS*/
+        0                                   /* offset 0 when using MAP_ANONYMOUS*/
+    );
+    if (MAP_FAILED == base)
+    {
+        return -1;
+    }
+#ifndef MAP_POPULATE
+    if (opts->flags & BUDDY_POPULATE)
+        prefault(base, pool->numbytes, 1);
+#endif
+    //Before the memory is hidden from checkers, the threads write to it
+    if (opts->flags & BUDDY_PREFAULT)
+        prefault(base, pool->numbytes, opts->prefault_threads);
+    int rval = 0;
+    if (opts->flags & BUDDY_MLOCK)
+        rval = mlock(base, pool_maplen(kval));
+#ifdef MLOCK_ONFAULT
+    if (opts->flags & BUDDY_MLOCK_ONFAULT)
+        rval = mlock2(base, pool_maplen(kval), MLOCK_ONFAULT);
+#endif
+    if (rval == -1)
+    {
+        int err = errno;
+        munmap(base, pool_maplen(kval));
+        memset(pool, 0, sizeof(struct buddy_pool));
+        errno = err;
+        return -1;
+    }
+    pool->base = base;
+    pool->avail = (struct avail *)((uint8_t *)base + pool->numbytes);
+    if (registry_insert(pool) == -1)
+    {
+        munmap(base, pool_maplen(kval));
+        memset(pool, 0, sizeof(struct buddy_pool));
+        errno = ENOMEM;
+        return -1;
+    }
+    ANNOTATE_HIDE(base, pool->numbytes);
+    pool_format(pool);
+    return 0;
+}
+
+/**
+ * @brief The lead a nested pool of order kval needs: room for the parent's
+ * header and the avail heads, rounded up to a block of its own.
+ */
+static size_t nested_lead(size_t kval, size_t min_k)
+{
+    size_t k = btok(HEADER_SIZE + (kval + 1) * sizeof(struct avail));
+    return UINT64_C(1) << (k < min_k ? min_k : k);
+}
+
+int buddy_init_in(struct buddy_pool *pool, struct buddy_pool *parent, size_t size)
+{
+    if (!pool || !parent) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t kval = pool_kval(parent, size ? size : 1);
+    while (kval <= parent->kval_m && (UINT64_C(1) << kval) - nested_lead(kval, parent->min_k) < size) {
+        kval++;
+    }
+    if (kval > parent->kval_m) {
+        errno = ENOMEM;
+        return -1;
+    }
+    void *mem = buddy_malloc_order(parent, kval);
+    if (!mem) {
+        return -1;
+    }
+    ((struct avail *)mem - 1)->site = __builtin_return_address(0);
+
+    memset(pool, 0, sizeof(struct buddy_pool));
+    pool->kval_m = kval;
+    pool->min_k = parent->min_k;
+    pool->numbytes = UINT64_C(1) << kval;
+    pool->base = (uint8_t *)mem - HEADER_SIZE;
+    pool->lead = nested_lead(kval, parent->min_k);
+    pool->avail = mem;
+    pool->parent = parent;
+    if (registry_insert(pool) == -1) {
+        buddy_free(parent, mem);
+        memset(pool, 0, sizeof(struct buddy_pool));
+        errno = ENOMEM;
+        return -1;
+    }
+    pool_format(pool);
+    return 0;
+}
+
+void buddy_init(struct buddy_pool *pool, size_t size)
+{
+    size_t kval = 0;
+    if (size == 0)
+        kval = DEFAULT_K;
+    else
+        kval = btok(size);
+
+    if (kval < MIN_K)
+        kval = MIN_K;
+    if (kval > MAX_K)
+        kval = MAX_K - 1;
+
+    struct buddy_options opts = {.size = UINT64_C(1) << kval, .min_k = SMALLEST_K};
+    if (buddy_init_opts(pool, &opts) == -1)
+    {
+        handle_error_and_die("buddy_init avail array mmap failed");
+    }
 }
 
 void buddy_destroy(struct buddy_pool *pool)
 {
-    int rval = munmap(pool->base, pool->numbytes);
-    if (-1 == rval)
+    if (pool->flags & BUDDY_LEAK_CHECK)
+    {
+        buddy_leak_report(pool, stderr);
+    }
+    if (pool->trace)
+    {
+        buddy_trace_stop(pool);
+    }
+    if (pool->profile)
+    {
+        buddy_profile_stop(pool);
+    }
+    if (pool->handles)
+    {
+        free(pool->handles->slots);
+        free(pool->handles);
+    }
+    free(pool->quota);
+    registry_remove(pool);
+    if (pool->parent)
+    {
+        //The whole child is one block of the parent, the free takes care of the shadow state
+        buddy_free(pool->parent, (uint8_t *)pool->base + HEADER_SIZE);
+    }
+    else
     {
-        handle_error_and_die("buddy_destroy avail array");
+        //Do not leave stale shadow state behind for whatever gets mapped here next
+        ANNOTATE_META(pool->base, pool->numbytes);
+        int rval = munmap(pool->base, pool_maplen(pool->kval_m));
+        if (-1 == rval)
+        {
+            handle_error_and_die("buddy_destroy avail array");
+        }
     }
     //Zero out the array so it can be reused it needed
     memset(pool,0,sizeof(struct buddy_pool));
 }
 
+int buddy_reset(struct buddy_pool *pool, size_t keep)
+{
+    if (!pool || !pool->base)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    //Child pools die with their blocks, their memory maps to this pool again.
+    //Done first so a failure leaves the pool as it was.
+    if (registry_insert(pool) == -1)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (pool->trace)
+    {
+        trace_reset(pool);
+    }
+    if (pool->profile)
+    {
+        profile_reset(pool);
+    }
+    if (pool->quota)
+    {
+        quota_reset(pool);
+    }
+    if (pool->handles)
+    {
+        //Every handle goes stale and its slot goes back on the free list
+        struct buddy_handles *handles = pool->handles;
+        handles->free_head = 0;
+        handles->purgeable = 0;
+        for (size_t i = handles->count; i > 0; i--)
+        {
+            struct handle_slot *slot = &handles->slots[i - 1];
+            if (slot->ptr)
+            {
+                slot->ptr = NULL;
+                slot->gen++;
+            }
+            slot->pins = 0;
+            slot->next_free = handles->free_head;
+            handles->free_head = i;
+        }
+    }
+
+    //Release before formatting, the kernel hands back zero pages and the
+    //headers pool_format writes must survive. The first header always stays.
+    if (keep != BUDDY_RESET_KEEP)
+    {
+        uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        size_t skip = keep < HEADER_SIZE ? HEADER_SIZE : keep;
+        uintptr_t start = (uintptr_t)pool->base + pool->lead;
+        uintptr_t end = ((uintptr_t)pool->base + pool->numbytes) & ~(page - 1);
+        if (end > start && skip < end - start)
+        {
+            start = (start + skip + page - 1) & ~(page - 1);
+            if (start < end)
+            {
+                madvise((void *)start, end - start, MADV_DONTNEED);
+            }
+        }
+    }
+    pool_format(pool);
+    return 0;
+}
+
 #define UNUSED(x) (void)x
 
 /**
@@ -36,8 +36,16 @@ extern "C"
 
 #define BLOCK_AVAIL    1  /*Block is available to allocate*/
 #define BLOCK_RESERVED 0  /*Block has been handed to user*/
+#define BLOCK_INDIRECT 2  /*Stub in front of an aligned allocation*/
 #define BLOCK_UNUSED   3  /*Block is not used at all*/
 
+#define BLOCK_SAMPLED  0x1 /*Flag: the heap profiler holds a sample of this block*/
+#define BLOCK_HANDLE   0x2 /*Flag: the block belongs to a handle and may be moved*/
+#define BLOCK_TRIMMED  0x4 /*Flag: only buddy_block_span bytes of the block are kept*/
+#define BLOCK_TAIL     0x8 /*Flag: the lower buddy is part of a trimmed block, never merge down*/
+#define BLOCK_PURGEABLE 0x10 /*Flag: the handle's memory may be reclaimed while unpinned*/
+#define BLOCK_TENANT_SHIFT 8 /*Flags: the tenant of a reserved block is in the high byte*/
+
 
   /**
    * The size of the header for the block
@@ -52,8 +60,18 @@ extern "C"
   {
     unsigned short int tag;     /*Tag for block status BLOCK_AVAIL, BLOCK_RESERVED*/
     unsigned short int kval;    /*The kval of this block*/
-    struct avail *next;         /*next memory block*/
-    struct avail *prev;         /*prev memory block*/
+    unsigned short int flags;   /*BLOCK_SAMPLED, BLOCK_HANDLE, BLOCK_TRIMMED, BLOCK_PURGEABLE and the tenant while BLOCK_RESERVED, BLOCK_TAIL always*/
+    union
+    {
+      struct avail *next;       /*next memory block*/
+      size_t slot;              /*handle table slot while reserved with BLOCK_HANDLE*/
+      void *site;               /*return address of the malloc call while reserved otherwise*/
+    };
+    union
+    {
+      struct avail *prev;       /*prev memory block*/
+      size_t size;              /*bytes the user asked for while BLOCK_RESERVED*/
+    };
   };
 
   /**
@@ -62,11 +80,132 @@ extern "C"
   struct buddy_pool
   {
     size_t kval_m;              /*The max kval of this pool*/
+    size_t min_k;               /*The kval of the smallest block handed out*/
     size_t numbytes;            /*The number of bytes this pool is managing*/
     void *base;                 /*Base address used to scale memory for buddy calculations*/
-    struct avail avail[MAX_K];  /*The array of available memory blocks*/
+    struct avail *avail;        /*The kval_m + 1 heads of the available memory blocks*/
+    size_t lead;                /*Bytes at base that are not managed, 0 unless nested*/
+    struct buddy_pool *parent;  /*Pool the memory was carved from or NULL if mapped*/
+    size_t trim_k;              /*Allocations needing a block of this order or more are trimmed, 0 never*/
+    unsigned int flags;         /*buddy_options flags the pool was created with*/
+    struct buddy_trace *trace;  /*Allocation trace being recorded or NULL*/
+    struct buddy_profile *profile; /*Heap profile being collected or NULL*/
+    struct buddy_handles *handles; /*Handle table, NULL until the first buddy_halloc*/
+    struct buddy_quota *quota;  /*Tenant accounting, NULL until the first limit or watermark*/
+    size_t color;               /*Turn of the next allocation to get a cache color, see BUDDY_COLOR*/
+  };
+
+  /**
+   * Flags for buddy_options. BUDDY_POPULATE has mmap fault the pool in,
+   * BUDDY_PREFAULT does it afterwards with several threads. BUDDY_MLOCK locks
+   * the pool into RAM right away, BUDDY_MLOCK_ONFAULT locks each page when it
+   * is first touched.
+   */
+#define BUDDY_POPULATE      0x1
+#define BUDDY_PREFAULT      0x2
+#define BUDDY_MLOCK         0x4
+#define BUDDY_MLOCK_ONFAULT 0x8
+
+  /**
+   * Flag for buddy_options: buddy_destroy prints a buddy_leak_report of what
+   * is still allocated to stderr before the pool goes away.
+   */
+#define BUDDY_LEAK_CHECK    0x10
+
+  /**
+   * Flag for buddy_options: cache coloring. Blocks are aligned to their size,
+   * so the user memory of equal sized allocations starts at the same offset
+   * within a page and their first lines all compete for the same cache sets.
+   * With BUDDY_COLOR, buddy_malloc moves the user memory up by 0, 1, 2, ...
+   * cache lines in turn, as far as the unused tail of the block allows and up
+   * to BUDDY_COLORS lines, with a stub in front as for an aligned allocation.
+   * No extra memory is used, so only sizes well short of their block get
+   * colors. Allocations that get a color always move on buddy_realloc.
+   */
+#define BUDDY_COLOR         0x20
+
+  /**
+   * The cache line size allocations are laid out for.
+   */
+#define BUDDY_CACHE_LINE 64
+
+  /**
+   * Bytes between two cache colors and the number of colors, which together
+   * cover a page so every L1 set can be used.
+   */
+#define BUDDY_COLOR_LINE BUDDY_CACHE_LINE
+#define BUDDY_COLORS 64
+
+  /**
+   * A prefault thread is only started for every this many bytes of the pool.
+   */
+#define BUDDY_PREFAULT_SLICE (UINT64_C(1) << 24)
+
+  /**
+   * Per pool settings for buddy_init_opts. Zero any field to get the default.
+   */
+  struct buddy_options
+  {
+    size_t size;                /*Bytes to manage, rounded up to a power of two, 0 for 2^DEFAULT_K*/
+    size_t min_k;               /*Order of the smallest block handed out, 0 for SMALLEST_K*/
+    size_t trim_k;              /*Trim allocations needing a block of this order or more, 0 never*/
+    unsigned int flags;         /*BUDDY_POPULATE, BUDDY_PREFAULT, BUDDY_MLOCK, BUDDY_MLOCK_ONFAULT, BUDDY_LEAK_CHECK, BUDDY_COLOR*/
+    size_t prefault_threads;    /*Threads for BUDDY_PREFAULT, 0 for one per online CPU*/
+  };
+
+  /**
+   * Bytes of the pool a block covers. That is 2^kval except for a trimmed
+   * allocation, which keeps its header and size rounded up to the smallest
+   * block and has handed the rest of its block back.
+   *
+   * @param pool The memory pool
+   * @param block A block header
+   * @return size_t the bytes from block to the next block
+   */
+  size_t buddy_block_span(const struct buddy_pool *pool, const struct avail *block);
+
+  /**
+   * What buddy_walk reports about one block. Everything is copied out of the
+   * header before the callback runs.
+   */
+  struct buddy_block
+  {
+    void *start;                /*First byte of the block, where its header is*/
+    size_t bytes;               /*Bytes up to the next block, see buddy_block_span*/
+    size_t kval;                /*Order of the block*/
+    bool reserved;              /*true if handed out, false if on an avail list*/
+    void *ptr;                  /*User memory after the header if reserved, NULL if free*/
+    size_t size;                /*Bytes asked for if reserved, 0 if free*/
+    unsigned short flags;       /*BLOCK_ flags of the header*/
   };
 
+  /**
+   * Called by buddy_walk for every block. Return 0 to go on, anything else
+   * stops the walk and is returned from it.
+   */
+  typedef int (*buddy_walk_fn)(const struct buddy_block *block, void *ctx);
+
+  /**
+   * Visit every block of the pool in address order, going from header to
+   * header by buddy_block_span from the first managed byte. Every header is
+   * checked before it is trusted, so a header that is damaged, or torn by a
+   * thread that changes the pool during the walk, ends the walk with an error
+   * instead of a wild read. The walk allocates nothing, so the callback may
+   * run in a signal handler or under the allocator's own lock. The callback
+   * must not allocate from or free to the pool it walks.
+   *
+   * For an aligned allocation ptr is the user memory that directly follows
+   * the header, not the pointer buddy_malloc_aligned returned.
+   *
+   * @param pool The memory pool to walk
+   * @param fn Called once per block
+   * @param ctx Passed through to fn
+   * @return 0 once every block was visited, whatever fn returned if it stopped
+   * the walk, or -1 with errno set to EINVAL for a NULL argument or EIO for a
+   * damaged header
+   */
+  int buddy_walk(struct buddy_pool *pool, buddy_walk_fn fn, void *ctx);
+
   /**
    * Converts bytes to its equivalent K value defined as bytes <= 2^K
    * @param bytes The bytes needed
@@ -97,6 +236,75 @@ extern "C"
    */
   void *buddy_malloc(struct buddy_pool *pool, size_t size);
 
+  /**
+   * buddy_malloc on behalf of a tenant, which is charged for the block until
+   * it is freed. Every other allocation function charges tenant 0. If the
+   * block would take the tenant over the hard limit set with
+   * buddy_tenant_limit (see quota.h) the return value is NULL and errno is
+   * set to ENOMEM without searching the pool.
+   *
+   * @param pool The memory pool to alloc from
+   * @param tenant The tenant, below BUDDY_TENANTS
+   * @param size The size of the user requested memory block in bytes
+   * @return A pointer to the memory block
+   */
+  void *buddy_tenant_malloc(struct buddy_pool *pool, unsigned int tenant, size_t size);
+
+  /**
+   * Allocates a block of exactly 2^kval bytes (header included) and returns a
+   * pointer to the user portion of it. This is the fast path for callers that
+   * already know the order, for example C++ code that computes it at compile
+   * time from sizeof(T). If a block of that order is free it is handed out
+   * directly without scanning the larger lists or splitting.
+   *
+   * If pool is NULL or kval is outside [pool->min_k, pool->kval_m] the return
+   * value will be NULL and errno is set to ENOMEM.
+   *
+   * @param pool The memory pool to alloc from
+   * @param kval The order of the block to allocate
+   * @return A pointer to the memory block
+   */
+  void *buddy_malloc_order(struct buddy_pool *pool, size_t kval);
+
+  /**
+   * Allocates size bytes whose address is a multiple of alignment. Requests
+   * for an alignment no stricter than the block header behave exactly like
+   * buddy_malloc. Stricter alignments place a small stub in front of the
+   * user memory that buddy_free follows back to the block header, so the
+   * result is released with buddy_free like any other allocation. The stub
+   * also records the alignment, which buddy_realloc keeps.
+   *
+   * If size is zero, pool is NULL or alignment is not a power of two the
+   * return value will be NULL and errno is set to ENOMEM.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @param alignment The required alignment, a power of two
+   * @return A pointer to the memory block
+   */
+  void *buddy_malloc_aligned(struct buddy_pool *pool, size_t size, size_t alignment);
+
+  /**
+   * Allocates size bytes on cache lines of their own, for objects that
+   * different threads write to. Blocks are at least a line and aligned to
+   * their size within a pool that starts on a page, so two allocations never
+   * share a line anyway. Here the user memory also starts on a
+   * BUDDY_CACHE_LINE boundary, so it is not split over more lines than it
+   * needs. It is rounded up to whole lines that may all be used, and the
+   * block headers get a line of their own in front. The allocator reads a
+   * header when it coalesces the block's buddy, and with this layout that
+   * read does not touch the user's lines. The cost is up to two lines per
+   * allocation. Release it with buddy_free.
+   *
+   * If size is zero or pool is NULL the return value will be NULL and errno
+   * is set to ENOMEM.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @return A pointer to the memory block
+   */
+  void *buddy_malloc_exclusive(struct buddy_pool *pool, size_t size);
+
   /**
    * A block of memory previously allocated by a call to malloc,
    * calloc or realloc is deallocated, making it available again
@@ -114,6 +322,39 @@ extern "C"
    */
   void buddy_free(struct buddy_pool *pool, void *ptr);
 
+  /**
+   * Free ptr like buddy_free when the caller still knows the size it asked
+   * for, as C++ sized deallocation does. The order of the block comes from
+   * size, so the free checks the header's tag and order with one load and
+   * goes straight to coalescing. Any size that needs the same order as the
+   * original request works.
+   *
+   * Memory from buddy_malloc, buddy_malloc_order and buddy_realloc takes the
+   * fast path. Everything else, like aligned or exclusive allocations, a
+   * pointer the pool does not own or a second free, is passed on to
+   * buddy_free, and so is any pointer of a pool with trim_k, a running heap
+   * profile, tenant limits or BUDDY_COLOR. A size that does not match the
+   * header also falls back to buddy_free, except in builds with BUDDY_DEBUG,
+   * which abort so the caller's bug is found.
+   *
+   * @param pool The memory pool
+   * @param ptr Pointer to the memory block to free
+   * @param size The size ptr was allocated with
+   */
+  void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size);
+
+  /**
+   * Check if ptr points into the memory pool hands out, which is a pair of
+   * compares and does not touch the heap. It does not say whether ptr is a
+   * live allocation. To find the pool from the pointer alone see
+   * buddy_pool_of in registry.h.
+   *
+   * @param pool The memory pool
+   * @param ptr Any address
+   * @return true if ptr lies in the pool's managed memory
+   */
+  bool buddy_owns(const struct buddy_pool *pool, const void *ptr);
+
   /**
    * Changes the size of the memory block pointed to by ptr.
    * The function may move the memory block to a new location
@@ -130,6 +371,10 @@ extern "C"
    * if size is equal to zero, and ptr is not NULL, then the  call
    * is equivalent to free(ptr)
    *
+   * Memory from buddy_malloc_aligned and buddy_malloc_exclusive always moves
+   * and keeps its alignment, so exclusive memory still starts on a line of
+   * its own. Memory of a BUDDY_COLOR pool that moves gets the next color.
+   *
    * @param pool The memory pool
    * @param ptr Pointer to a memory block
    * @param size The new size of the memory block
@@ -137,6 +382,91 @@ extern "C"
    */
   void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size);
 
+  /**
+   * A relocatable allocation. 0 is never a valid handle.
+   */
+  typedef uint64_t buddy_handle;
+
+  /**
+   * Allocate size bytes that the pool is allowed to move. The memory is only
+   * reachable through buddy_hpin, and only stays put while pinned, so long
+   * lived data kept this way does not fragment the pool forever: see
+   * buddy_compact. The memory must not be passed to buddy_realloc, and
+   * buddy_free ignores it.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @return The handle or 0 with errno set to ENOMEM
+   */
+  buddy_handle buddy_halloc(struct buddy_pool *pool, size_t size);
+
+  /**
+   * Called when the pool reclaims a purgeable allocation, just before its
+   * memory is freed. The handle is stale once this returns. The callback
+   * must not call into the pool.
+   */
+  typedef void (*buddy_purge_fn)(struct buddy_pool *pool, buddy_handle handle, void *ctx);
+
+  /**
+   * Allocate size bytes like buddy_halloc that the pool may also take back.
+   * When an allocation finds no free block of any order, unpinned purgeable
+   * allocations are reclaimed until one has coalesced, the one that was
+   * unpinned the longest first, so caches can fill free memory without
+   * making anything else run out. Pin the handle with buddy_hpin while using
+   * the memory. Once buddy_hpin fails the data is gone and has to be rebuilt.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @param fn Called when the allocation is reclaimed, may be NULL
+   * @param ctx Passed through to fn
+   * @return The handle or 0 with errno set to ENOMEM
+   */
+  buddy_handle buddy_palloc(struct buddy_pool *pool, size_t size, buddy_purge_fn fn, void *ctx);
+
+  /**
+   * Get the address of a handle's memory and keep the pool from moving it
+   * until the matching buddy_hunpin. Pins nest.
+   *
+   * @param pool The memory pool
+   * @param handle A handle from buddy_halloc
+   * @return The address or NULL with errno set to EINVAL for a stale handle
+   */
+  void *buddy_hpin(struct buddy_pool *pool, buddy_handle handle);
+
+  /**
+   * Drop a pin taken with buddy_hpin. The address must not be used after the
+   * last pin is dropped.
+   *
+   * @param pool The memory pool
+   * @param handle A pinned handle
+   */
+  void buddy_hunpin(struct buddy_pool *pool, buddy_handle handle);
+
+  /**
+   * Free the memory of a handle, pinned or not. The handle is stale after
+   * this and buddy_hpin on it fails.
+   *
+   * @param pool The memory pool
+   * @param handle A handle from buddy_halloc, 0 is ignored
+   */
+  void buddy_hfree(struct buddy_pool *pool, buddy_handle handle);
+
+  /**
+   * Move unpinned handle allocations down into the lowest free block that
+   * fits, highest addresses first, so their old blocks coalesce into large
+   * free orders again. A block only moves into a free block no larger than
+   * the one its old space coalesces to, so the largest free block never
+   * shrinks. Runs until nothing more can move or budget_ns has
+   * passed, so it can be called from an idle loop or timer to defragment a
+   * long running pool a slice at a time. At least one block is moved per
+   * call if any can be.
+   *
+   * @param pool The memory pool
+   * @param budget_ns Time to spend in nanoseconds
+   * @return The number of blocks moved, 0 once the pool is compact
+   */
+  size_t buddy_compact(struct buddy_pool *pool, uint64_t budget_ns);
+
   /**
    * Initialize a new memory pool using the buddy algorithm. Internally,
    * this function uses mmap to get a block of memory to manage so should be
@@ -151,13 +481,86 @@ extern "C"
    *
    * NOTE: Memory pools returned by this function can not be intermingled.
    * Calling buddy_malloc with pool A and then calling buddy_free with
-   * pool B will result in undefined behavior.
+   * pool B will result in undefined behavior. This includes child pools made
+   * with buddy_init_in and their parent.
    *
    * @param size The size of the pool in bytes.
    * @param pool A pointer to the pool to initialize
    */
   void buddy_init(struct buddy_pool *pool, size_t size);
 
+  /**
+   * Initialize a memory pool with explicit limits. Unlike buddy_init there is
+   * no MIN_K floor, so a pool can be as small as a single block of 2^min_k
+   * bytes, and the avail list heads are sized to the pool: only kval_m + 1 of
+   * them are kept, in the same mapping right after the managed memory. Raising
+   * min_k trades internal fragmentation for fewer, larger blocks.
+   *
+   * With trim_k set, buddy_malloc and buddy_realloc hand the unused upper end
+   * of every block of order trim_k or more straight back to the avail lists
+   * as free buddies, so a request just over a power of two costs about its
+   * own size instead of twice that. Trimmed allocations never grow or shrink
+   * in place and are skipped by buddy_compact.
+   *
+   * The flags take page faults off the allocation path: a pool that is
+   * populated or prefaulted is resident before buddy_init_opts returns, and a
+   * locked one stays resident. Prefaulting splits the pool between threads
+   * that each write one byte per page, which is faster than MAP_POPULATE for
+   * pools of many gigabytes. Locking is subject to RLIMIT_MEMLOCK.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param opts The limits of the pool
+   * @return 0 on success, -1 with errno set to EINVAL if min_k is below
+   * SMALLEST_K, trim_k is not above min_k, the pool order would reach MAX_K
+   * or the flags are unknown or ask for both kinds of locking, or why mmap or
+   * mlock failed
+   */
+  int buddy_init_opts(struct buddy_pool *pool, const struct buddy_options *opts);
+
+  /**
+   * Initialize a child pool inside a single block allocated from parent, with
+   * no mmap of its own. The child is an independent pool with the parent's
+   * min_k; use it from one thread at a time like any other pool. Destroying
+   * the child with buddy_destroy is one buddy_free on the parent, however many
+   * allocations the child still holds, so request scoped memory can be thrown
+   * away in O(1). The parent must outlive the child.
+   *
+   * The child keeps its avail heads in the first few hundred bytes of the
+   * block, next to the parent's header, and never hands that part out. So the
+   * largest single allocation from the child is half of its block.
+   *
+   * @param pool A pointer to the child pool to initialize
+   * @param parent The pool to carve the child from
+   * @param size The number of bytes the child must be able to hand out in total
+   * @return 0 on success, -1 with errno set to ENOMEM if parent has no room or
+   * EINVAL for a NULL pool
+   */
+  int buddy_init_in(struct buddy_pool *pool, struct buddy_pool *parent, size_t size);
+
+  /**
+   * Pass as keep to buddy_reset to leave every page resident.
+   */
+#define BUDDY_RESET_KEEP SIZE_MAX
+
+  /**
+   * Free every allocation of a pool at once and put it back in the state
+   * buddy_init left it in, without giving up the mapping. Pages stay
+   * resident, so a pool recycled between batches does not fault its memory
+   * back in. Handles of the pool become stale, an active trace records the
+   * reset and an active profile forgets its live samples.
+   *
+   * The pages past the first keep bytes of managed memory are returned to the
+   * kernel with madvise and read back as zeros. Pass 0 to release nearly
+   * everything or BUDDY_RESET_KEEP to release nothing. Locked pools keep all
+   * of their pages.
+   *
+   * @param pool The memory pool to reset
+   * @param keep Bytes from the start of the pool to leave resident
+   * @return 0 on success, -1 with errno set to EINVAL if pool is not initialized
+   * or ENOMEM if the registry could not take back the memory of child pools
+   */
+  int buddy_reset(struct buddy_pool *pool, size_t keep);
+
   /**
    * Inverse of buddy_init.
    *
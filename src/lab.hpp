@@ -0,0 +1,271 @@
+#ifndef LAB_HPP
+#define LAB_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+#include "lab.h"
+
+namespace buddy
+{
+  /**
+   * Compile time twin of btok. Converts bytes to the smallest K such that
+   * bytes <= 2^K, starting at SMALLEST_K and never exceeding MAX_K.
+   *
+   * @param bytes The bytes needed (header included)
+   * @return The order of the block that will hold bytes
+   */
+  constexpr std::size_t order_for(std::size_t bytes) noexcept
+  {
+    std::size_t k = SMALLEST_K;
+    while ((std::size_t{1} << k) < bytes && k < MAX_K)
+      {
+        k++;
+      }
+    return k;
+  }
+
+  /**
+   * The order of the block needed to hold N objects of type T plus the block
+   * header. Evaluated entirely at compile time.
+   */
+  template <class T, std::size_t N = 1>
+  inline constexpr std::size_t order_of = order_for(N * sizeof(T) + HEADER_SIZE);
+
+  /**
+   * The alignment every pointer returned by buddy_malloc is guaranteed to
+   * have. Stricter alignments go through buddy_malloc_aligned.
+   */
+  inline constexpr std::size_t guaranteed_alignment = alignof(struct avail);
+
+  /**
+   * RAII owner of a struct buddy_pool. The pool is created in the constructor
+   * and destroyed in the destructor. The registry entry of the pool and the
+   * child pools made with buddy_init_in point at the struct itself, so a
+   * pool can be neither copied nor moved.
+   */
+  class pool
+  {
+  public:
+    /**
+     * @param bytes The size of the pool in bytes, 0 selects DEFAULT_K
+     */
+    explicit pool(std::size_t bytes = 0) noexcept
+    {
+      buddy_init(&pool_, bytes);
+    }
+
+    ~pool()
+    {
+      buddy_destroy(&pool_);
+    }
+
+    pool(const pool &) = delete;
+    pool &operator=(const pool &) = delete;
+    pool(pool &&) = delete;
+    pool &operator=(pool &&) = delete;
+
+    /**
+     * @return The underlying C pool for use with the lab.h API
+     */
+    struct buddy_pool *get() noexcept
+    {
+      return &pool_;
+    }
+
+    /**
+     * Allocates uninitialized storage for n objects of type T. When n is a
+     * constant at the call site the order folds to a constant as well.
+     *
+     * @param n The number of objects
+     * @return Pointer to the storage or nullptr with errno set to ENOMEM
+     */
+    template <class T>
+    T *allocate(std::size_t n = 1) noexcept
+    {
+      if (n == 0 || n > (pool_.numbytes - HEADER_SIZE) / sizeof(T))
+        {
+          errno = ENOMEM;
+          return nullptr;
+        }
+      if constexpr (alignof(T) > guaranteed_alignment)
+        {
+          return static_cast<T *>(buddy_malloc_aligned(&pool_, n * sizeof(T), alignof(T)));
+        }
+      else if (n == 1)
+        {
+          return static_cast<T *>(buddy_malloc_order(&pool_, order_of<T>));
+        }
+      else
+        {
+          return static_cast<T *>(buddy_malloc_order(&pool_, order_for(n * sizeof(T) + HEADER_SIZE)));
+        }
+    }
+
+    /**
+     * Allocates uninitialized storage for exactly N objects of type T. The
+     * order is a template constant so no size to order conversion is done at
+     * runtime.
+     *
+     * @return Pointer to the storage or nullptr with errno set to ENOMEM
+     */
+    template <class T, std::size_t N>
+    T *allocate() noexcept
+    {
+      static_assert(N > 0, "cannot allocate zero objects");
+      if constexpr (alignof(T) > guaranteed_alignment)
+        {
+          return static_cast<T *>(buddy_malloc_aligned(&pool_, N * sizeof(T), alignof(T)));
+        }
+      else
+        {
+          return static_cast<T *>(allocate_order<order_of<T, N>>());
+        }
+    }
+
+    /**
+     * Fixed order fast path. Hands out a block of exactly 2^K bytes (header
+     * included) straight from avail[K] when one is free.
+     *
+     * @return Pointer to the user memory or nullptr with errno set to ENOMEM
+     */
+    template <std::size_t K>
+    void *allocate_order() noexcept
+    {
+      static_assert(K >= SMALLEST_K && K < MAX_K, "order out of range");
+      return buddy_malloc_order(&pool_, K);
+    }
+
+    /**
+     * Returns storage obtained from allocate back to the pool.
+     *
+     * @param p Pointer returned by allocate, may be nullptr
+     * @param n The number of objects passed to allocate
+     */
+    template <class T>
+    void deallocate(T *p, std::size_t n = 1) noexcept
+    {
+      (void)n;
+      buddy_free(&pool_, const_cast<std::remove_cv_t<T> *>(p));
+    }
+
+  private:
+    struct buddy_pool pool_;
+  };
+
+  /**
+   * A std::pmr::memory_resource that carves its memory out of a buddy pool.
+   * The alignment argument is honoured through buddy_malloc_aligned. The
+   * resource does not own the pool, which must outlive it.
+   */
+  class memory_resource : public std::pmr::memory_resource
+  {
+  public:
+    explicit memory_resource(struct buddy_pool *pool) noexcept : pool_(pool) {}
+    explicit memory_resource(buddy::pool &pool) noexcept : pool_(pool.get()) {}
+
+    struct buddy_pool *get() const noexcept
+    {
+      return pool_;
+    }
+
+  private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+      void *p = buddy_malloc_aligned(pool_, bytes == 0 ? 1 : bytes, alignment);
+      if (!p)
+        {
+          throw std::bad_alloc();
+        }
+      return p;
+    }
+
+    void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+    {
+      //Only allocations without a stub can be freed by size
+      if (alignment <= guaranteed_alignment)
+        {
+          buddy_free_sized(pool_, p, bytes == 0 ? 1 : bytes);
+        }
+      else
+        {
+          buddy_free(pool_, p);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+      const auto *o = dynamic_cast<const memory_resource *>(&other);
+      return o && o->pool_ == pool_;
+    }
+
+    struct buddy_pool *pool_;
+  };
+
+  /**
+   * A classic STL allocator over a buddy pool for containers that do not
+   * take a polymorphic allocator. Copies and rebinds share the pool.
+   */
+  template <class T>
+  class allocator
+  {
+  public:
+    using value_type = T;
+
+    explicit allocator(struct buddy_pool *pool) noexcept : pool_(pool) {}
+    explicit allocator(buddy::pool &pool) noexcept : pool_(pool.get()) {}
+
+    template <class U>
+    allocator(const allocator<U> &other) noexcept : pool_(other.pool_) {}
+
+    T *allocate(std::size_t n)
+    {
+      if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+        {
+          throw std::bad_array_new_length();
+        }
+      void *p = buddy_malloc_aligned(pool_, n == 0 ? 1 : n * sizeof(T), alignof(T));
+      if (!p)
+        {
+          throw std::bad_alloc();
+        }
+      return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept
+    {
+      if constexpr (alignof(T) > guaranteed_alignment)
+        {
+          buddy_free(pool_, p);
+        }
+      else
+        {
+          buddy_free_sized(pool_, p, n == 0 ? 1 : n * sizeof(T));
+        }
+    }
+
+    template <class U>
+    bool operator==(const allocator<U> &other) const noexcept
+    {
+      return pool_ == other.pool_;
+    }
+
+    template <class U>
+    bool operator!=(const allocator<U> &other) const noexcept
+    {
+      return pool_ != other.pool_;
+    }
+
+  private:
+    template <class U>
+    friend class allocator;
+
+    struct buddy_pool *pool_;
+  };
+} // namespace buddy
+
+#endif
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <string.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+
+#include "latency.h"
+
+uint64_t buddy_latency_bucket_floor(size_t bucket)
+{
+    if (bucket < (1u << LATENCY_SUB_BITS)) {
+        return bucket;
+    }
+    unsigned exp = (unsigned)(bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1u << LATENCY_SUB_BITS) - 1);
+    return (UINT64_C(1) << exp) | (sub << (exp - LATENCY_SUB_BITS));
+}
+
+static uint64_t snapshot_count(const struct buddy_latency_snapshot *snap, int op, int level, size_t bucket)
+{
+    if (level >= 0) {
+        return snap->counts[op][level][bucket];
+    }
+    uint64_t sum = 0;
+    for (int l = 0; l < LATENCY_LEVELS; l++) {
+        sum += snap->counts[op][l][bucket];
+    }
+    return sum;
+}
+
+double buddy_latency_quantile(const struct buddy_latency_snapshot *snap, int op, int level, double q)
+{
+    uint64_t total = 0;
+    for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+        total += snapshot_count(snap, op, level, b);
+    }
+    if (total == 0) {
+        return 0.0;
+    }
+    uint64_t target = (uint64_t)(q * (double)total);
+    if (target >= total) {
+        target = total - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += snapshot_count(snap, op, level, b);
+        if (seen > target) {
+            uint64_t ceiling = b + 1 < LATENCY_BUCKETS ? buddy_latency_bucket_floor(b + 1)
+                                                       : UINT64_C(1) << LATENCY_MAX_BITS;
+            return (double)ceiling / snap->ticks_per_ns;
+        }
+    }
+    return (double)(UINT64_C(1) << LATENCY_MAX_BITS) / snap->ticks_per_ns;
+}
+
+#ifdef BUDDY_LATENCY
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LATENCY_TSC 1
+#endif
+
+/**
+ * The histograms of one thread. Only the owner writes the counts, relaxed
+ * atomics let a snapshot read them while it does without a lock.
+ */
+struct latency_thread
+{
+    struct latency_thread *next;    /*next thread in the registry*/
+    _Atomic uint64_t counts[LATENCY_OPS][LATENCY_LEVELS][LATENCY_BUCKETS];
+};
+
+__thread unsigned latency_levels;
+
+static __thread struct latency_thread *tls_hist;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;
+
+/*The counts of threads that exited, always last in the registry*/
+static struct latency_thread retired;
+static struct latency_thread *registry = &retired;
+
+uint64_t latency_now(void)
+{
+#ifdef LATENCY_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static size_t latency_bucket(uint64_t ticks)
+{
+    if (ticks < (1u << LATENCY_SUB_BITS)) {
+        return (size_t)ticks;
+    }
+    unsigned exp = 63 - (unsigned)__builtin_clzll(ticks);
+    if (exp >= LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+    return ((size_t)(exp - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) |
+           (size_t)((ticks >> (exp - LATENCY_SUB_BITS)) & ((1u << LATENCY_SUB_BITS) - 1));
+}
+
+/**
+ * @brief Thread exit destructor. Folds the thread's counts into retired and
+ * frees its histograms.
+ */
+static void latency_thread_exit(void *ptr)
+{
+    struct latency_thread *hist = ptr;
+    pthread_mutex_lock(&registry_lock);
+    struct latency_thread **link = &registry;
+    while (*link != hist) {
+        link = &(*link)->next;
+    }
+    *link = hist->next;
+    for (int op = 0; op < LATENCY_OPS; op++) {
+        for (int l = 0; l < LATENCY_LEVELS; l++) {
+            for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+                uint64_t count = atomic_load_explicit(&hist->counts[op][l][b], memory_order_relaxed);
+                if (count != 0) {
+                    atomic_fetch_add_explicit(&retired.counts[op][l][b], count, memory_order_relaxed);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    tls_hist = NULL;
+    free(hist);
+}
+
+static void latency_key_create(void)
+{
+    pthread_key_create(&exit_key, latency_thread_exit);
+}
+
+/**
+ * @brief Allocate and register the calling thread's histograms.
+ *
+ * @return struct latency_thread* the histograms or NULL if out of memory
+ */
+static struct latency_thread *latency_thread_register(void)
+{
+    pthread_once(&exit_once, latency_key_create);
+    struct latency_thread *hist = calloc(1, sizeof(struct latency_thread));
+    if (hist) {
+        if (pthread_setspecific(exit_key, hist) != 0) {
+            free(hist);
+            return NULL;
+        }
+        pthread_mutex_lock(&registry_lock);
+        hist->next = registry;
+        registry = hist;
+        pthread_mutex_unlock(&registry_lock);
+        tls_hist = hist;
+    }
+    return hist;
+}
+
+void latency_record(int op, uint64_t ticks)
+{
+    struct latency_thread *hist = tls_hist ? tls_hist : latency_thread_register();
+    if (!hist) {
+        return;
+    }
+    unsigned level = latency_levels < LATENCY_LEVELS ? latency_levels : LATENCY_LEVELS - 1;
+    _Atomic uint64_t *count = &hist->counts[op][level][latency_bucket(ticks)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Measure the timer against CLOCK_MONOTONIC once per process.
+ */
+static double ticks_per_ns(void)
+{
+#ifdef LATENCY_TSC
+    static double rate;
+    if (rate == 0.0) {
+        struct timespec start, end, pause = {0, 10 * 1000 * 1000};
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint64_t t0 = __rdtsc();
+        nanosleep(&pause, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        uint64_t t1 = __rdtsc();
+        double ns = (double)(end.tv_sec - start.tv_sec) * 1e9 + (double)(end.tv_nsec - start.tv_nsec);
+        rate = (double)(t1 - t0) / ns;
+    }
+    return rate;
+#else
+    return 1.0;
+#endif
+}
+
+int buddy_latency_snapshot(struct buddy_latency_snapshot *snap)
+{
+    if (!snap) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(snap, 0, sizeof(struct buddy_latency_snapshot));
+    snap->ticks_per_ns = ticks_per_ns();
+
+    pthread_mutex_lock(&registry_lock);
+    for (struct latency_thread *hist = registry; hist; hist = hist->next) {
+        for (int op = 0; op < LATENCY_OPS; op++) {
+            for (int l = 0; l < LATENCY_LEVELS; l++) {
+                for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+                    snap->counts[op][l][b] += atomic_load_explicit(&hist->counts[op][l][b], memory_order_relaxed);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return 0;
+}
+
+void buddy_latency_reset(void)
+{
+    pthread_mutex_lock(&registry_lock);
+    for (struct latency_thread *hist = registry; hist; hist = hist->next) {
+        for (int op = 0; op < LATENCY_OPS; op++) {
+            for (int l = 0; l < LATENCY_LEVELS; l++) {
+                for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+                    atomic_store_explicit(&hist->counts[op][l][b], 0, memory_order_relaxed);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+int buddy_latency_export(FILE *out)
+{
+    static const char *names[LATENCY_OPS] = {"malloc", "free", "realloc"};
+    if (!out) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct buddy_latency_snapshot *snap = malloc(sizeof(struct buddy_latency_snapshot));
+    if (!snap) {
+        return -1;
+    }
+    buddy_latency_snapshot(snap);
+
+    fprintf(out, "# %-8s %5s %12s %10s %10s %10s %10s\n", "op", "level", "count", "p50 ns", "p99 ns", "p999 ns",
+            "max ns");
+    for (int op = 0; op < LATENCY_OPS; op++) {
+        for (int l = 0; l < LATENCY_LEVELS; l++) {
+            uint64_t count = 0;
+            for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+                count += snap->counts[op][l][b];
+            }
+            if (count == 0) {
+                continue;
+            }
+            fprintf(out, "# %-8s %5d %12llu %10.0f %10.0f %10.0f %10.0f\n", names[op], l, (unsigned long long)count,
+                    buddy_latency_quantile(snap, op, l, 0.5), buddy_latency_quantile(snap, op, l, 0.99),
+                    buddy_latency_quantile(snap, op, l, 0.999), buddy_latency_quantile(snap, op, l, 1.0));
+        }
+    }
+    for (int op = 0; op < LATENCY_OPS; op++) {
+        for (int l = 0; l < LATENCY_LEVELS; l++) {
+            for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+                if (snap->counts[op][l][b] != 0) {
+                    fprintf(out, "%s %d %.1f %llu\n", names[op], l,
+                            (double)buddy_latency_bucket_floor(b) / snap->ticks_per_ns,
+                            (unsigned long long)snap->counts[op][l][b]);
+                }
+            }
+        }
+    }
+    free(snap);
+
+    if (fflush(out) == EOF || ferror(out)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+int buddy_latency_snapshot(struct buddy_latency_snapshot *snap)
+{
+    (void)snap;
+    errno = ENOSYS;
+    return -1;
+}
+
+void buddy_latency_reset(void)
+{
+}
+
+int buddy_latency_export(FILE *out)
+{
+    (void)out;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
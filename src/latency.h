@@ -0,0 +1,119 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * Operations that get a histogram of their own.
+   */
+#define LATENCY_MALLOC  0  /*buddy_malloc, buddy_malloc_order and buddy_malloc_aligned*/
+#define LATENCY_FREE    1  /*buddy_free*/
+#define LATENCY_REALLOC 2  /*buddy_realloc with a non NULL ptr and non zero size*/
+#define LATENCY_OPS     3
+
+  /**
+   * Each operation is further split by how many levels it split (malloc),
+   * merged (free) or grew, shrank or merged (realloc). The last level also
+   * counts everything deeper.
+   */
+#define LATENCY_LEVELS 16
+
+  /**
+   * Log-linear buckets: values below 2^LATENCY_SUB_BITS get a bucket each,
+   * every power of two above that is split into 2^LATENCY_SUB_BITS buckets,
+   * so a bucket is never more than 12.5% wide. Values of 2^LATENCY_MAX_BITS
+   * ticks or more land in the last bucket.
+   */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_MAX_BITS 32
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+  /**
+   * The sum of every thread's histograms at one point in time. This is about
+   * 90KiB so allocate it on the heap.
+   */
+  struct buddy_latency_snapshot
+  {
+    double ticks_per_ns;        /*Timer ticks per nanosecond*/
+    uint64_t counts[LATENCY_OPS][LATENCY_LEVELS][LATENCY_BUCKETS];
+  };
+
+  /**
+   * Sum the histograms of every thread that has timed an operation into snap.
+   * Threads keep recording while this runs so the snapshot is not atomic, but
+   * every count in it was really recorded. A thread that exits folds its
+   * counts into one histogram kept for all exited threads and frees its own.
+   *
+   * @param snap Where to store the histograms
+   * @return 0 on success, -1 with errno set to ENOSYS if built without BUDDY_LATENCY
+   */
+  int buddy_latency_snapshot(struct buddy_latency_snapshot *snap);
+
+  /**
+   * Zero every thread's histograms.
+   */
+  void buddy_latency_reset(void);
+
+  /**
+   * The smallest value, in ticks, that falls into bucket.
+   *
+   * @param bucket A bucket index below LATENCY_BUCKETS
+   * @return uint64_t the lower bound of the bucket
+   */
+  uint64_t buddy_latency_bucket_floor(size_t bucket);
+
+  /**
+   * Estimate a quantile from a snapshot.
+   *
+   * @param snap A snapshot
+   * @param op One of the LATENCY_ operations
+   * @param level A split or merge level, or -1 for all of them
+   * @param q The quantile between 0 and 1
+   * @return double the upper bound of the bucket holding q, in nanoseconds
+   */
+  double buddy_latency_quantile(const struct buddy_latency_snapshot *snap, int op, int level, double q);
+
+  /**
+   * Write a snapshot as text: a summary line per operation and level with
+   * count, p50, p99, p999 and max followed by every non empty bucket as
+   * "op level floor_ns count" lines for offline plotting.
+   *
+   * @param out Where to write
+   * @return 0 on success, -1 with errno set (ENOSYS if built without BUDDY_LATENCY)
+   */
+  int buddy_latency_export(FILE *out);
+
+#ifdef BUDDY_LATENCY
+
+  /*Levels of the operation in progress on this thread*/
+  extern __thread unsigned latency_levels;
+
+  uint64_t latency_now(void);
+  void latency_record(int op, uint64_t ticks);
+
+  /**
+   * Instrumentation used by lab.c. Without BUDDY_LATENCY all of it expands to
+   * nothing, not even a timer read.
+   */
+#define LATENCY_BEGIN(t) uint64_t t = (latency_levels = 0, latency_now())
+#define LATENCY_LEVEL(n) (latency_levels = (unsigned)(n))
+#define LATENCY_END(t, op) latency_record((op), latency_now() - (t))
+#else
+#define LATENCY_BEGIN(t) ((void)0)
+#define LATENCY_LEVEL(n) ((void)sizeof(n))
+#define LATENCY_END(t, op) ((void)0)
+#endif
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
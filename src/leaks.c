@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <string.h>
+#include <execinfo.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+
+#include "leaks.h"
+
+/**
+ * Reserved bytes and blocks from one call site.
+ */
+struct leak_site
+{
+    void *site;                 /*return address of the malloc or halloc call*/
+    size_t blocks;
+    size_t bytes;
+};
+
+/**
+ * State of a leak walk.
+ */
+struct leak_walk_ctx
+{
+    const struct buddy_pool *pool;
+    struct leak_site *sites;    /*Where to store one entry per reserved block, or NULL to only count*/
+    int64_t cap;                /*Entries sites has room for*/
+    int64_t count;
+};
+
+static int leak_block(const struct buddy_block *block, void *ctx)
+{
+    struct leak_walk_ctx *walk = ctx;
+    if (!block->reserved) {
+        return 0;
+    }
+    if (walk->sites) {
+        if (walk->count == walk->cap) {
+            return 1;
+        }
+        struct leak_site *site = &walk->sites[walk->count];
+        const struct avail *header = block->start;
+        site->site = (block->flags & BLOCK_HANDLE) ? handle_site(walk->pool, header->slot) : header->site;
+        site->blocks = 1;
+        site->bytes = block->size;
+    }
+    walk->count++;
+    return 0;
+}
+
+/**
+ * @brief Walk the reserved blocks of the pool in address order.
+ *
+ * @param pool The memory pool
+ * @param sites Where to store one entry per reserved block, or NULL to only count
+ * @param cap Entries sites has room for, more reserved blocks are not stored
+ * @return int64_t the number of reserved blocks or -1 if a header does not make sense
+ */
+static int64_t leak_walk(struct buddy_pool *pool, struct leak_site *sites, int64_t cap)
+{
+    struct leak_walk_ctx walk = {pool, sites, cap, 0};
+    if (buddy_walk(pool, leak_block, &walk) == -1) {
+        return -1;
+    }
+    return walk.count;
+}
+
+static int by_site(const void *a, const void *b)
+{
+    const struct leak_site *x = a, *y = b;
+    return (uintptr_t)x->site < (uintptr_t)y->site ? -1 : (uintptr_t)x->site > (uintptr_t)y->site;
+}
+
+static int by_bytes(const void *a, const void *b)
+{
+    const struct leak_site *x = a, *y = b;
+    return x->bytes > y->bytes ? -1 : x->bytes < y->bytes;
+}
+
+int64_t buddy_leak_report(struct buddy_pool *pool, FILE *out)
+{
+    if (!pool || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    int64_t count = leak_walk(pool, NULL, 0);
+    if (count <= 0) {
+        if (count < 0)
+            errno = EIO;
+        return count;
+    }
+
+    struct leak_site *sites = malloc((size_t)count * sizeof(struct leak_site));
+    if (!sites) {
+        errno = ENOMEM;
+        return -1;
+    }
+    count = leak_walk(pool, sites, count);
+    if (count <= 0) {
+        free(sites);
+        if (count < 0)
+            errno = EIO;
+        return count;
+    }
+
+    //Fold the blocks of each call site into one entry
+    qsort(sites, (size_t)count, sizeof(struct leak_site), by_site);
+    size_t groups = 0, bytes = 0;
+    for (int64_t i = 0; i < count; i++) {
+        bytes += sites[i].bytes;
+        if (groups > 0 && sites[groups - 1].site == sites[i].site) {
+            sites[groups - 1].blocks++;
+            sites[groups - 1].bytes += sites[i].bytes;
+        } else {
+            sites[groups++] = sites[i];
+        }
+    }
+    qsort(sites, groups, sizeof(struct leak_site), by_bytes);
+
+    void **addrs = malloc(groups * sizeof(void *));
+    char **names = NULL;
+    if (addrs) {
+        for (size_t i = 0; i < groups; i++)
+            addrs[i] = sites[i].site;
+        names = backtrace_symbols(addrs, (int)groups);
+    }
+
+    fprintf(out, "buddy: %lld blocks with %zu bytes still allocated from %zu call sites\n", (long long)count,
+            bytes, groups);
+    for (size_t i = 0; i < groups; i++) {
+        fprintf(out, "%12zu bytes in %zu %s", sites[i].bytes, sites[i].blocks, sites[i].blocks == 1 ? "block" : "blocks");
+        if (names)
+            fprintf(out, " from %s\n", names[i]);
+        else
+            fprintf(out, " from %p\n", sites[i].site);
+    }
+    fflush(out);
+    free(names);
+    free(addrs);
+    free(sites);
+    return count;
+}
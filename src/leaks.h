@@ -0,0 +1,46 @@
+#ifndef LEAKS_H
+#define LEAKS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * Walk the pool by address and report every block that is still reserved,
+   * grouped by the call that allocated it, biggest group first. Every malloc
+   * entry point records its return address in the block header, so this
+   * works on any pool at any time; BUDDY_LEAK_CHECK runs it from
+   * buddy_destroy. Handle allocations keep their slot where the call site
+   * would go, and the slot holds the call site of buddy_halloc or
+   * buddy_palloc instead. Nothing else may use the pool while this runs.
+   *
+   * Call sites are symbolized with backtrace_symbols, which needs -rdynamic
+   * to name functions of the executable itself; addr2line takes the raw
+   * addresses otherwise.
+   *
+   * @param pool The memory pool to check
+   * @param out Where to write the report, nothing is written if there are no leaks
+   * @return int64_t the number of reserved blocks or -1 with errno set to EIO
+   * if a header is damaged or ENOMEM if the report could not be built
+   */
+  int64_t buddy_leak_report(struct buddy_pool *pool, FILE *out);
+
+  /**
+   * Called by the report to find the call site of the handle allocation in
+   * slot, NULL if the slot is not in use.
+   */
+  void *handle_site(const struct buddy_pool *pool, size_t slot);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+
+#include "packed.h"
+#include "annotate.h"
+
+#define TAG_SHIFT 6
+#define KVAL_MASK 0x3f
+
+/*Free blocks need their whole header, links included, to be accessible*/
+#define FREE_HEADER_SIZE sizeof(struct packed_avail)
+
+static unsigned block_tag(const struct packed_avail *block)
+{
+    return block->tagk >> TAG_SHIFT;
+}
+
+static size_t block_kval(const struct packed_avail *block)
+{
+    return block->tagk & KVAL_MASK;
+}
+
+static void block_set(struct packed_avail *block, unsigned tag, size_t kval)
+{
+    block->tagk = (uint8_t)((tag << TAG_SHIFT) | kval);
+}
+
+static struct packed_avail *block_at(struct buddy_packed *pool, uint32_t num)
+{
+    return (struct packed_avail *)((uint8_t *)pool->base + ((size_t)num << pool->min_k));
+}
+
+static uint32_t block_num(struct buddy_packed *pool, struct packed_avail *block)
+{
+    return (uint32_t)(((uint8_t *)block - (uint8_t *)pool->base) >> pool->min_k);
+}
+
+/**
+ * @brief Push a block onto the front of the avail list of its order.
+ */
+static void avail_push(struct buddy_packed *pool, struct packed_avail *block)
+{
+    size_t kval = block_kval(block);
+    uint32_t num = block_num(pool, block);
+    block->prev = PACKED_NIL;
+    block->next = pool->avail[kval];
+    if (block->next != PACKED_NIL) {
+        block_at(pool, block->next)->prev = num;
+    }
+    pool->avail[kval] = num;
+}
+
+/**
+ * @brief Unlink a block from the avail list of its order.
+ */
+static void avail_remove(struct buddy_packed *pool, struct packed_avail *block)
+{
+    if (block->prev == PACKED_NIL) {
+        pool->avail[block_kval(block)] = block->next;
+    } else {
+        block_at(pool, block->prev)->next = block->next;
+    }
+    if (block->next != PACKED_NIL) {
+        block_at(pool, block->next)->prev = block->prev;
+    }
+}
+
+int buddy_packed_init(struct buddy_packed *pool, size_t size, size_t min_k)
+{
+    if (!pool || min_k < PACKED_MIN_K || min_k > PACKED_MAX_MIN_K) {
+        errno = EINVAL;
+        return -1;
+    }
+    //Same rounding rules as buddy_init
+    size_t kval = size == 0 ? DEFAULT_K : btok(size);
+    if (kval < MIN_K)
+        kval = MIN_K;
+    if (kval > MAX_K)
+        kval = MAX_K - 1;
+    if (kval - min_k >= PACKED_MAX_BLOCKS_K) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(pool, 0, sizeof(struct buddy_packed));
+    pool->kval_m = kval;
+    pool->min_k = min_k;
+    pool->numbytes = UINT64_C(1) << kval;
+    pool->base = mmap(NULL, pool->numbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == pool->base) {
+        pool->base = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    ANNOTATE_HIDE(pool->base, pool->numbytes);
+    ANNOTATE_META(pool->base, FREE_HEADER_SIZE);
+
+    for (size_t i = 0; i < MAX_K; i++) {
+        pool->avail[i] = PACKED_NIL;
+    }
+    struct packed_avail *m = pool->base;
+    block_set(m, BLOCK_AVAIL, kval);
+    avail_push(pool, m);
+    return 0;
+}
+
+void buddy_packed_destroy(struct buddy_packed *pool)
+{
+    if (!pool || !pool->base) {
+        return;
+    }
+    ANNOTATE_META(pool->base, pool->numbytes);
+    munmap(pool->base, pool->numbytes);
+    memset(pool, 0, sizeof(struct buddy_packed));
+}
+
+void *buddy_packed_malloc(struct buddy_packed *pool, size_t size)
+{
+    if (!pool || size == 0 || size > pool->numbytes - PACKED_HEADER_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t required_kval = pool->min_k;
+    while ((UINT64_C(1) << required_kval) < size + PACKED_HEADER_SIZE) {
+        required_kval++;
+    }
+
+    size_t kval = required_kval;
+    while (kval <= pool->kval_m && pool->avail[kval] == PACKED_NIL) {
+        kval++;
+    }
+    if (kval > pool->kval_m) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct packed_avail *block = block_at(pool, pool->avail[kval]);
+    avail_remove(pool, block);
+    //Split keeping the lower half
+    while (kval > required_kval) {
+        kval--;
+        struct packed_avail *buddy = (struct packed_avail *)((uint8_t *)block + (UINT64_C(1) << kval));
+        ANNOTATE_META(buddy, FREE_HEADER_SIZE);
+        block_set(buddy, BLOCK_AVAIL, kval);
+        avail_push(pool, buddy);
+    }
+    block_set(block, BLOCK_RESERVED, required_kval);
+    //Requests of 4GiB and up are recorded as the whole block
+    block->next = size < UINT32_MAX ? (uint32_t)size : UINT32_MAX;
+
+    void *mem = (uint8_t *)block + PACKED_HEADER_SIZE;
+    ANNOTATE_HIDE(mem, FREE_HEADER_SIZE - PACKED_HEADER_SIZE);
+    ANNOTATE_MALLOC(mem, size);
+    return mem;
+}
+
+void buddy_packed_free(struct buddy_packed *pool, void *ptr)
+{
+    if (!pool || !ptr || (uint8_t *)ptr < (uint8_t *)pool->base + PACKED_HEADER_SIZE ||
+        (uint8_t *)ptr >= (uint8_t *)pool->base + pool->numbytes) {
+        return;
+    }
+    struct packed_avail *block = (struct packed_avail *)((uint8_t *)ptr - PACKED_HEADER_SIZE);
+    size_t offset = (size_t)((uint8_t *)block - (uint8_t *)pool->base);
+    if ((offset & ((UINT64_C(1) << pool->min_k) - 1)) != 0 || ANNOTATE_HIDDEN(block, PACKED_HEADER_SIZE) ||
+        block_tag(block) != BLOCK_RESERVED) {
+        return;
+    }
+
+    size_t kval = block_kval(block);
+    ANNOTATE_FREE(ptr, (UINT64_C(1) << kval) - PACKED_HEADER_SIZE);
+    ANNOTATE_META(block, FREE_HEADER_SIZE);
+
+    while (kval < pool->kval_m) {
+        struct packed_avail *buddy = (struct packed_avail *)((uint8_t *)pool->base + (offset ^ (UINT64_C(1) << kval)));
+        if (block_tag(buddy) != BLOCK_AVAIL || block_kval(buddy) != kval) {
+            break;
+        }
+        avail_remove(pool, buddy);
+        //The upper header becomes payload
+        if (buddy < block) {
+            ANNOTATE_HIDE(block, FREE_HEADER_SIZE);
+            block = buddy;
+            offset = (size_t)((uint8_t *)block - (uint8_t *)pool->base);
+        } else {
+            ANNOTATE_HIDE(buddy, FREE_HEADER_SIZE);
+        }
+        kval++;
+    }
+    block_set(block, BLOCK_AVAIL, kval);
+    avail_push(pool, block);
+}
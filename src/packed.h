@@ -0,0 +1,102 @@
+#ifndef PACKED_H
+#define PACKED_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * Smallest and largest minimum block order of a packed pool. 16 byte blocks
+   * are the least that can hold a free block's header and both links.
+   */
+#define PACKED_MIN_K 4
+#define PACKED_MAX_MIN_K SMALLEST_K
+
+  /**
+   * Blocks are numbered in units of the minimum block size and linked by that
+   * number, so a pool must hold fewer than 2^32 minimum blocks (PACKED_NIL
+   * is taken).
+   */
+#define PACKED_MAX_BLOCKS_K 32
+#define PACKED_NIL UINT32_MAX
+
+  /**
+   * Block header of a packed pool. Only tagk and next are in-band while the
+   * block is reserved: that is PACKED_HEADER_SIZE bytes, a third of struct
+   * avail. prev is only valid while the block is free and overlaps the first
+   * user bytes otherwise.
+   */
+  struct packed_avail
+  {
+    uint8_t tagk;               /*tag in the top two bits, kval in the low six*/
+    uint8_t unused[3];
+    uint32_t next;              /*free: block number of the next free block, reserved: bytes asked for*/
+    uint32_t prev;              /*free: block number of the prev free block*/
+  };
+
+#define PACKED_HEADER_SIZE offsetof(struct packed_avail, prev)
+
+  /**
+   * A buddy pool with compact headers. Same algorithm as struct buddy_pool but
+   * the avail lists are NULL terminated and linked by block number.
+   */
+  struct buddy_packed
+  {
+    size_t kval_m;              /*The max kval of this pool*/
+    size_t min_k;               /*The kval of the smallest block*/
+    size_t numbytes;            /*The number of bytes this pool is managing*/
+    void *base;                 /*Base address used to scale memory for buddy calculations*/
+    uint32_t avail[MAX_K];      /*First free block of each order or PACKED_NIL*/
+  };
+
+  /**
+   * Initialize a packed pool of size bytes rounded up to a power of two, 0 for
+   * DEFAULT_K. With min_k 4 an allocation of up to 8 bytes takes 16 bytes and
+   * every allocation carries 8 bytes of overhead instead of 24.
+   *
+   * @param pool The pool to initialize
+   * @param size The size of the pool in bytes
+   * @param min_k The order of the smallest block, PACKED_MIN_K to PACKED_MAX_MIN_K
+   * @return 0 on success, -1 with errno set to EINVAL if min_k is out of range
+   * or the pool would need 2^PACKED_MAX_BLOCKS_K blocks or more, ENOMEM if
+   * the memory can not be mapped
+   */
+  int buddy_packed_init(struct buddy_packed *pool, size_t size, size_t min_k);
+
+  /**
+   * Unmap a packed pool.
+   *
+   * @param pool The pool to destroy
+   */
+  void buddy_packed_destroy(struct buddy_packed *pool);
+
+  /**
+   * Same contract as buddy_malloc. User memory is 8 byte aligned.
+   *
+   * @param pool The pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @return A pointer to the memory block or NULL with errno set to ENOMEM
+   */
+  void *buddy_packed_malloc(struct buddy_packed *pool, size_t size);
+
+  /**
+   * Same contract as buddy_free.
+   *
+   * @param pool The pool
+   * @param ptr Pointer to the memory block to free
+   */
+  void buddy_packed_free(struct buddy_packed *pool, void *ptr);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
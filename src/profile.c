@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <execinfo.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+
+#include "profile.h"
+
+/**
+ * Hash buckets for the stack and live sample tables.
+ */
+#define PROFILE_BUCKETS 4096
+
+/**
+ * Frames at the top of every backtrace that belong to the profiler: this file
+ * and the hook in lab.c. The next frame is the buddy_malloc variant that was
+ * called, which is kept so the profile shows which entry point was used.
+ */
+#define PROFILE_SKIP_FRAMES 2
+
+/**
+ * A distinct call stack and what was sampled there.
+ */
+struct profile_stack
+{
+    struct profile_stack *next;     /*next stack in the same bucket*/
+    uint64_t hash;                  /*hash of frames*/
+    size_t live_objs;               /*samples still allocated*/
+    size_t live_bytes;              /*bytes of those samples*/
+    size_t alloc_objs;              /*samples ever taken here*/
+    size_t alloc_bytes;             /*bytes of those samples*/
+    int depth;                      /*frames in use*/
+    void *frames[PROFILE_MAX_DEPTH];
+};
+
+/**
+ * A sampled allocation that has not been freed yet.
+ */
+struct profile_sample
+{
+    struct profile_sample *next;    /*next sample in the same bucket*/
+    void *ptr;                      /*user memory*/
+    size_t size;                    /*bytes requested*/
+    struct profile_stack *stack;    /*where it was allocated*/
+};
+
+/**
+ * An active profile, hung off struct buddy_pool.
+ */
+struct buddy_profile
+{
+    size_t period;                  /*mean bytes between samples*/
+    pthread_mutex_t lock;           /*guards both tables*/
+    struct profile_stack *stacks[PROFILE_BUCKETS];
+    struct profile_sample *live[PROFILE_BUCKETS];
+};
+
+__thread int64_t profile_bytes_until_sample;
+
+/*Per thread generator for the sampling intervals, 0 until seeded*/
+static __thread uint64_t tls_rng;
+
+static uint64_t next_random(void)
+{
+    if (tls_rng == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        tls_rng = (((uint64_t)(uintptr_t)&tls_rng * UINT64_C(0x9E3779B97F4A7C15)) ^
+                   ((uint64_t)ts.tv_nsec << 1) ^ (uint64_t)ts.tv_sec) | 1;
+    }
+    //xorshift64*
+    tls_rng ^= tls_rng >> 12;
+    tls_rng ^= tls_rng << 25;
+    tls_rng ^= tls_rng >> 27;
+    return tls_rng * UINT64_C(0x2545F4914F6CDD1D);
+}
+
+/**
+ * @brief Draw the bytes until the next sample from an exponential distribution
+ * with mean period, which makes the samples a Poisson process over bytes.
+ */
+static int64_t next_interval(size_t period)
+{
+    double u = (double)(next_random() >> 11) * 0x1.0p-53; //[0, 1)
+    double interval = -log(1.0 - u) * (double)period;
+    if (interval > (double)(INT64_MAX / 2)) {
+        return INT64_MAX / 2;
+    }
+    return (int64_t)interval + 1;
+}
+
+static size_t ptr_bucket(void *ptr)
+{
+    return (size_t)(((uint64_t)(uintptr_t)ptr * UINT64_C(0x9E3779B97F4A7C15)) >> 52) & (PROFILE_BUCKETS - 1);
+}
+
+/**
+ * @brief Find or add the stack for frames. Caller holds the profile lock.
+ *
+ * @return struct profile_stack* the stack or NULL if out of memory
+ */
+static struct profile_stack *stack_for(struct buddy_profile *prof, void **frames, int depth)
+{
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uint64_t)(uintptr_t)frames[i]) * UINT64_C(1099511628211);
+    }
+    size_t bucket = (size_t)(hash >> 52) & (PROFILE_BUCKETS - 1);
+
+    struct profile_stack *stack = prof->stacks[bucket];
+    while (stack && (stack->hash != hash || stack->depth != depth ||
+                     memcmp(stack->frames, frames, (size_t)depth * sizeof(void *)) != 0)) {
+        stack = stack->next;
+    }
+    if (!stack) {
+        stack = calloc(1, sizeof(struct profile_stack));
+        if (stack) {
+            stack->hash = hash;
+            stack->depth = depth;
+            memcpy(stack->frames, frames, (size_t)depth * sizeof(void *));
+            stack->next = prof->stacks[bucket];
+            prof->stacks[bucket] = stack;
+        }
+    }
+    return stack;
+}
+
+__attribute__((noinline)) bool profile_malloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    struct buddy_profile *prof = pool->profile;
+
+    //A thread's first allocation only arms its countdown
+    bool armed = tls_rng != 0;
+    profile_bytes_until_sample = next_interval(prof->period);
+    if (!armed) {
+        profile_bytes_until_sample -= (int64_t)size;
+        if (profile_bytes_until_sample >= 0) {
+            return false;
+        }
+        profile_bytes_until_sample = next_interval(prof->period);
+    }
+    if (!ptr) {
+        return false;
+    }
+
+    void *frames[PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES];
+    int depth = backtrace(frames, PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES) - PROFILE_SKIP_FRAMES;
+    if (depth < 0) {
+        depth = 0;
+    }
+
+    struct profile_sample *sample = malloc(sizeof(struct profile_sample));
+    if (!sample) {
+        return false;
+    }
+    pthread_mutex_lock(&prof->lock);
+    struct profile_stack *stack = stack_for(prof, frames + PROFILE_SKIP_FRAMES, depth);
+    if (!stack) {
+        pthread_mutex_unlock(&prof->lock);
+        free(sample);
+        return false;
+    }
+    stack->live_objs++;
+    stack->live_bytes += size;
+    stack->alloc_objs++;
+    stack->alloc_bytes += size;
+
+    size_t bucket = ptr_bucket(ptr);
+    sample->ptr = ptr;
+    sample->size = size;
+    sample->stack = stack;
+    sample->next = prof->live[bucket];
+    prof->live[bucket] = sample;
+    pthread_mutex_unlock(&prof->lock);
+    return true;
+}
+
+void profile_free(struct buddy_pool *pool, void *ptr)
+{
+    struct buddy_profile *prof = pool->profile;
+    size_t bucket = ptr_bucket(ptr);
+
+    pthread_mutex_lock(&prof->lock);
+    struct profile_sample **link = &prof->live[bucket];
+    while (*link && (*link)->ptr != ptr) {
+        link = &(*link)->next;
+    }
+    struct profile_sample *sample = *link;
+    if (sample) {
+        *link = sample->next;
+        sample->stack->live_objs--;
+        sample->stack->live_bytes -= sample->size;
+    }
+    pthread_mutex_unlock(&prof->lock);
+    free(sample);
+}
+
+void profile_reset(struct buddy_pool *pool)
+{
+    struct buddy_profile *prof = pool->profile;
+
+    pthread_mutex_lock(&prof->lock);
+    for (size_t b = 0; b < PROFILE_BUCKETS; b++) {
+        struct profile_sample *sample = prof->live[b];
+        while (sample) {
+            struct profile_sample *next = sample->next;
+            free(sample);
+            sample = next;
+        }
+        prof->live[b] = NULL;
+        for (struct profile_stack *s = prof->stacks[b]; s; s = s->next) {
+            s->live_objs = 0;
+            s->live_bytes = 0;
+        }
+    }
+    pthread_mutex_unlock(&prof->lock);
+}
+
+int buddy_profile_start(struct buddy_pool *pool, size_t sample_period)
+{
+    if (!pool) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pool->profile) {
+        errno = EBUSY;
+        return -1;
+    }
+    struct buddy_profile *prof = calloc(1, sizeof(struct buddy_profile));
+    if (!prof) {
+        return -1;
+    }
+    prof->period = sample_period ? sample_period : PROFILE_DEFAULT_PERIOD;
+    pthread_mutex_init(&prof->lock, NULL);
+
+    //Make sure backtrace has loaded whatever it lazily loads before the first
+    //sample is taken inside an allocation
+    void *frame;
+    backtrace(&frame, 1);
+
+    pool->profile = prof;
+    return 0;
+}
+
+int buddy_profile_dump(struct buddy_pool *pool, FILE *out)
+{
+    if (!pool || !pool->profile || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct buddy_profile *prof = pool->profile;
+
+    pthread_mutex_lock(&prof->lock);
+    size_t live_objs = 0, live_bytes = 0, alloc_objs = 0, alloc_bytes = 0;
+    for (size_t b = 0; b < PROFILE_BUCKETS; b++) {
+        for (struct profile_stack *s = prof->stacks[b]; s; s = s->next) {
+            live_objs += s->live_objs;
+            live_bytes += s->live_bytes;
+            alloc_objs += s->alloc_objs;
+            alloc_bytes += s->alloc_bytes;
+        }
+    }
+    fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", live_objs, live_bytes, alloc_objs,
+            alloc_bytes, prof->period);
+    for (size_t b = 0; b < PROFILE_BUCKETS; b++) {
+        for (struct profile_stack *s = prof->stacks[b]; s; s = s->next) {
+            fprintf(out, "%zu: %zu [%zu: %zu] @", s->live_objs, s->live_bytes, s->alloc_objs, s->alloc_bytes);
+            for (int i = 0; i < s->depth; i++) {
+                fprintf(out, " %p", s->frames[i]);
+            }
+            fputc('\n', out);
+        }
+    }
+    pthread_mutex_unlock(&prof->lock);
+
+    //pprof needs the mappings to turn addresses into symbols
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0) {
+            fwrite(buf, 1, n, out);
+        }
+        fclose(maps);
+    }
+
+    if (fflush(out) == EOF || ferror(out)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+int buddy_profile_stop(struct buddy_pool *pool)
+{
+    if (!pool || !pool->profile) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct buddy_profile *prof = pool->profile;
+    pool->profile = NULL;
+
+    for (size_t b = 0; b < PROFILE_BUCKETS; b++) {
+        struct profile_sample *sample = prof->live[b];
+        while (sample) {
+            struct profile_sample *next = sample->next;
+            free(sample);
+            sample = next;
+        }
+        struct profile_stack *stack = prof->stacks[b];
+        while (stack) {
+            struct profile_stack *next = stack->next;
+            free(stack);
+            stack = next;
+        }
+    }
+    pthread_mutex_destroy(&prof->lock);
+    free(prof);
+    return 0;
+}
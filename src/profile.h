@@ -0,0 +1,91 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * Mean number of bytes allocated between two samples when
+   * buddy_profile_start is passed 0.
+   */
+#define PROFILE_DEFAULT_PERIOD (UINT64_C(512) * 1024)
+
+  /**
+   * Deepest call stack kept for a sample.
+   */
+#define PROFILE_MAX_DEPTH 32
+
+  /**
+   * Start sampling the allocations made from pool. Sampling is by bytes: on
+   * average one allocation per sample_period bytes has its backtrace taken,
+   * with the distance between samples drawn from an exponential distribution
+   * so that every byte is equally likely to be picked no matter how the
+   * allocations are sized. Allocations that are not picked cost a thread local
+   * subtraction, frees cost a flag test on the block header.
+   *
+   * The countdown to the next sample is per thread and shared by every pool,
+   * only one profile per pool can be active.
+   *
+   * @param pool The memory pool to profile
+   * @param sample_period Mean bytes between samples, 0 for PROFILE_DEFAULT_PERIOD
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_profile_start(struct buddy_pool *pool, size_t sample_period);
+
+  /**
+   * Write the bytes in use by call stack in the legacy pprof heap profile text
+   * format (heap_v2). Counts are the raw samples, pprof scales them back up
+   * using the sampling period in the header:
+   *
+   *   pprof --text ./myprogram heap.prof
+   *
+   * @param pool The memory pool being profiled
+   * @param out Where to write the profile
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_profile_dump(struct buddy_pool *pool, FILE *out);
+
+  /**
+   * Stop profiling and drop every sample. No other thread may be using the
+   * pool while this runs.
+   *
+   * @param pool The memory pool being profiled
+   * @return 0 on success, -1 with errno set if pool is not being profiled
+   */
+  int buddy_profile_stop(struct buddy_pool *pool);
+
+  /**
+   * Bytes the calling thread may still allocate before the next sample. Only
+   * here so profile_should_sample can be inlined into the allocation path.
+   */
+  extern __thread int64_t profile_bytes_until_sample;
+
+  /**
+   * Hooks called by the pool when a profile is active. profile_should_sample
+   * is the fast path; when it returns true the pool calls profile_malloc which
+   * draws the next interval and returns true if it recorded a sample of ptr.
+   * profile_reset drops every live sample when the pool is reset.
+   */
+  static inline bool profile_should_sample(size_t size)
+  {
+    profile_bytes_until_sample -= (int64_t)size;
+    return profile_bytes_until_sample < 0;
+  }
+  bool profile_malloc(struct buddy_pool *pool, void *ptr, size_t size);
+  void profile_free(struct buddy_pool *pool, void *ptr);
+  void profile_reset(struct buddy_pool *pool);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <string.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+
+#include "quota.h"
+
+/**
+ * Limits and usage of one tenant.
+ */
+struct quota_tenant
+{
+    size_t used;                    /*bytes of the blocks the tenant holds*/
+    size_t soft;                    /*0 for none*/
+    size_t hard;                    /*0 for none*/
+    buddy_pressure_fn fn;           /*called when soft is crossed*/
+    void *ctx;
+    bool over;                      /*fn was called and used is still above soft*/
+};
+
+/**
+ * A free memory watermark.
+ */
+struct quota_mark
+{
+    size_t low;
+    buddy_pressure_fn fn;
+    void *ctx;
+    bool below;                     /*fn was called and free is still below low*/
+};
+
+/**
+ * Tenant accounting of a pool, hung off struct buddy_pool.
+ */
+struct buddy_quota
+{
+    size_t used;                    /*bytes held by all tenants together*/
+    size_t marks;                   /*watermarks in use*/
+    struct quota_mark mark[BUDDY_WATERMARKS];
+    struct quota_tenant tenant[BUDDY_TENANTS];
+};
+
+static int charge_block(const struct buddy_block *block, void *ctx)
+{
+    struct buddy_quota *quota = ctx;
+    if (block->reserved) {
+        quota->tenant[block->flags >> BLOCK_TENANT_SHIFT].used += block->bytes;
+        quota->used += block->bytes;
+    }
+    return 0;
+}
+
+/**
+ * @brief Start counting, charging every tenant for what it already holds.
+ */
+static struct buddy_quota *quota_start(struct buddy_pool *pool)
+{
+    if (pool->quota) {
+        return pool->quota;
+    }
+    struct buddy_quota *quota = calloc(1, sizeof(struct buddy_quota));
+    if (!quota) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (buddy_walk(pool, charge_block, quota) != 0) {
+        free(quota);
+        return NULL;
+    }
+    pool->quota = quota;
+    return quota;
+}
+
+int buddy_tenant_limit(struct buddy_pool *pool, unsigned int tenant, size_t soft, size_t hard,
+                       buddy_pressure_fn fn, void *ctx)
+{
+    if (!pool || !pool->base || tenant >= BUDDY_TENANTS || (soft != 0 && hard != 0 && soft > hard)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct buddy_quota *quota = quota_start(pool);
+    if (!quota) {
+        return -1;
+    }
+    struct quota_tenant *t = &quota->tenant[tenant];
+    t->soft = soft;
+    t->hard = hard;
+    t->fn = fn;
+    t->ctx = ctx;
+    t->over = soft != 0 && t->used > soft;
+    return 0;
+}
+
+int buddy_watermark(struct buddy_pool *pool, size_t low, buddy_pressure_fn fn, void *ctx)
+{
+    if (!pool || !pool->base || !fn) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct buddy_quota *quota = quota_start(pool);
+    if (!quota) {
+        return -1;
+    }
+    if (quota->marks == BUDDY_WATERMARKS) {
+        errno = ENOSPC;
+        return -1;
+    }
+    struct quota_mark *mark = &quota->mark[quota->marks++];
+    mark->low = low;
+    mark->fn = fn;
+    mark->ctx = ctx;
+    mark->below = false;
+    return 0;
+}
+
+size_t buddy_tenant_usage(const struct buddy_pool *pool, unsigned int tenant)
+{
+    if (!pool || !pool->quota || tenant >= BUDDY_TENANTS) {
+        return 0;
+    }
+    return pool->quota->tenant[tenant].used;
+}
+
+/**
+ * @brief Bytes of the pool that no tenant holds.
+ */
+static size_t quota_free(struct buddy_pool *pool)
+{
+    return pool->numbytes - pool->lead - pool->quota->used;
+}
+
+bool quota_admit(struct buddy_pool *pool, unsigned int tenant, size_t bytes)
+{
+    struct quota_tenant *t = &pool->quota->tenant[tenant];
+    return t->hard == 0 || (bytes <= t->hard && t->used <= t->hard - bytes);
+}
+
+void quota_charge(struct buddy_pool *pool, unsigned int tenant, size_t bytes)
+{
+    struct buddy_quota *quota = pool->quota;
+    struct quota_tenant *t = &quota->tenant[tenant];
+    t->used += bytes;
+    quota->used += bytes;
+
+    //The state is updated before each call so a callback that frees or
+    //allocates sees it and is not called again from inside itself
+    struct buddy_pressure event = {.tenant = tenant};
+    if (t->soft != 0 && !t->over && t->used > t->soft) {
+        t->over = true;
+        if (t->fn) {
+            event.kind = BUDDY_PRESSURE_SOFT;
+            event.used = t->used;
+            event.limit = t->soft;
+            event.free = quota_free(pool);
+            t->fn(pool, &event, t->ctx);
+        }
+    }
+    for (size_t i = 0; i < quota->marks; i++) {
+        struct quota_mark *mark = &quota->mark[i];
+        size_t left = quota_free(pool);
+        if (!mark->below && left < mark->low) {
+            mark->below = true;
+            event.kind = BUDDY_PRESSURE_LOW;
+            event.used = t->used;
+            event.limit = mark->low;
+            event.free = left;
+            mark->fn(pool, &event, mark->ctx);
+        }
+    }
+}
+
+void quota_credit(struct buddy_pool *pool, unsigned int tenant, size_t bytes)
+{
+    struct buddy_quota *quota = pool->quota;
+    struct quota_tenant *t = &quota->tenant[tenant];
+    t->used -= bytes;
+    quota->used -= bytes;
+    if (t->over && t->used <= t->soft) {
+        t->over = false;
+    }
+    size_t left = quota_free(pool);
+    for (size_t i = 0; i < quota->marks; i++) {
+        if (quota->mark[i].below && left >= quota->mark[i].low) {
+            quota->mark[i].below = false;
+        }
+    }
+}
+
+void quota_reset(struct buddy_pool *pool)
+{
+    struct buddy_quota *quota = pool->quota;
+    quota->used = 0;
+    for (size_t i = 0; i < BUDDY_TENANTS; i++) {
+        quota->tenant[i].used = 0;
+        quota->tenant[i].over = false;
+    }
+    for (size_t i = 0; i < quota->marks; i++) {
+        quota->mark[i].below = false;
+    }
+}
@@ -0,0 +1,111 @@
+#ifndef QUOTA_H
+#define QUOTA_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * Number of tenants a pool can tell apart. Tenant 0 is everything that
+   * was not allocated with buddy_tenant_malloc, which includes every handle
+   * from buddy_halloc and buddy_palloc. A realloc keeps the tenant and is
+   * charged or credited only what its block grew or shrank by.
+   */
+#define BUDDY_TENANTS 256
+
+  /**
+   * Number of watermarks a pool can hold.
+   */
+#define BUDDY_WATERMARKS 8
+
+  /**
+   * Kinds of buddy_pressure event.
+   */
+#define BUDDY_PRESSURE_SOFT 1   /*a tenant went over its soft limit*/
+#define BUDDY_PRESSURE_LOW  2   /*the pool's free memory fell below a watermark*/
+
+  /**
+   * What a pressure callback is told.
+   */
+  struct buddy_pressure
+  {
+    int kind;                   /*BUDDY_PRESSURE_SOFT or BUDDY_PRESSURE_LOW*/
+    unsigned int tenant;        /*Tenant whose allocation set it off*/
+    size_t used;                /*Bytes that tenant holds now*/
+    size_t limit;               /*The soft limit or watermark that was crossed*/
+    size_t free;                /*Bytes the pool has left*/
+  };
+
+  /**
+   * Called after the allocation that crossed a soft limit or watermark has
+   * completed, from the thread that made it. The callback may free to the
+   * pool, which is how caches shed load.
+   */
+  typedef void (*buddy_pressure_fn)(struct buddy_pool *pool, const struct buddy_pressure *event, void *ctx);
+
+  /**
+   * Set the limits of a tenant. Tenants are charged the bytes of the blocks
+   * they hold, which is what they take from the pool. An allocation that
+   * would take a tenant over hard fails with ENOMEM before the heap is
+   * touched. Going over soft calls fn once, and again only after the tenant
+   * has dropped back to soft or below. Pass 0 for no limit.
+   *
+   * The first limit or watermark of a pool walks the heap to charge what is
+   * already allocated, from then on every allocation and free is counted.
+   *
+   * @param pool The memory pool
+   * @param tenant The tenant, below BUDDY_TENANTS
+   * @param soft Bytes above which fn is called, 0 for none
+   * @param hard Bytes the tenant may never hold more of, 0 for no limit
+   * @param fn Called when soft is crossed, may be NULL
+   * @param ctx Passed through to fn
+   * @return 0 on success, -1 with errno set to EINVAL or ENOMEM
+   */
+  int buddy_tenant_limit(struct buddy_pool *pool, unsigned int tenant, size_t soft, size_t hard,
+                         buddy_pressure_fn fn, void *ctx);
+
+  /**
+   * Call fn once the free memory of the pool drops below low bytes. It is
+   * called again only after free memory has climbed back to low or more.
+   *
+   * @param pool The memory pool
+   * @param low Free bytes under which fn is called
+   * @param fn The callback
+   * @param ctx Passed through to fn
+   * @return 0 on success, -1 with errno set to EINVAL, ENOMEM, or ENOSPC if
+   * the pool already has BUDDY_WATERMARKS
+   */
+  int buddy_watermark(struct buddy_pool *pool, size_t low, buddy_pressure_fn fn, void *ctx);
+
+  /**
+   * Bytes of the pool a tenant holds, 0 while no limit or watermark is set.
+   *
+   * @param pool The memory pool
+   * @param tenant The tenant
+   * @return size_t the bytes charged to tenant
+   */
+  size_t buddy_tenant_usage(const struct buddy_pool *pool, unsigned int tenant);
+
+  /**
+   * Hooks called by the pool once pool->quota is set. quota_admit is checked
+   * before an allocation of bytes and returns false if it would break the hard
+   * limit. quota_charge and quota_credit count blocks in and out and fire the
+   * callbacks. quota_reset forgets every charge when the pool is reset.
+   */
+  bool quota_admit(struct buddy_pool *pool, unsigned int tenant, size_t bytes);
+  void quota_charge(struct buddy_pool *pool, unsigned int tenant, size_t bytes);
+  void quota_credit(struct buddy_pool *pool, unsigned int tenant, size_t bytes);
+  void quota_reset(struct buddy_pool *pool);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+
+#include "registry.h"
+
+#define FANOUT ((size_t)1 << REGISTRY_BITS)
+#define ADDRESS_BITS (REGISTRY_PAGE_SHIFT + REGISTRY_BITS * REGISTRY_LEVELS)
+#define PAGE ((uintptr_t)1 << REGISTRY_PAGE_SHIFT)
+#define GRAIN ((uintptr_t)1 << REGISTRY_GRAIN_SHIFT)
+
+/**
+ * An entry is 0, a pointer to the node of the next level, or a pool pointer
+ * with ENTRY_POOL set when the pool covers everything the entry does. Pools
+ * are at least pointer aligned so the low bit is free.
+ */
+#define ENTRY_POOL ((uintptr_t)1)
+
+typedef _Atomic(uintptr_t) registry_entry;
+
+static registry_entry registry_root[FANOUT];
+
+/*Writers take the lock, readers only load entries*/
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Level REGISTRY_LEVELS splits one page into grains*/
+static size_t level_shift(size_t level)
+{
+    if (level == REGISTRY_LEVELS) {
+        return REGISTRY_GRAIN_SHIFT;
+    }
+    return REGISTRY_PAGE_SHIFT + REGISTRY_BITS * (REGISTRY_LEVELS - 1 - level);
+}
+
+static size_t level_fanout(size_t level)
+{
+    return level == REGISTRY_LEVELS ? (size_t)1 << (REGISTRY_PAGE_SHIFT - REGISTRY_GRAIN_SHIFT) : FANOUT;
+}
+
+struct buddy_pool *buddy_pool_of(const void *ptr)
+{
+    uintptr_t addr = (uintptr_t)ptr;
+    if ((addr >> ADDRESS_BITS) != 0) {
+        return NULL;
+    }
+    registry_entry *node = registry_root;
+    for (size_t level = 0; level <= REGISTRY_LEVELS; level++) {
+        uintptr_t e = atomic_load_explicit(&node[(addr >> level_shift(level)) & (level_fanout(level) - 1)],
+                                           memory_order_acquire);
+        if (e & ENTRY_POOL) {
+            return (struct buddy_pool *)(e & ~ENTRY_POOL);
+        }
+        if (e == 0) {
+            return NULL;
+        }
+        node = (registry_entry *)e;
+    }
+    return NULL;
+}
+
+void buddy_free_any(void *ptr)
+{
+    struct buddy_pool *pool = buddy_pool_of(ptr);
+    if (pool) {
+        buddy_free(pool, ptr);
+    }
+}
+
+/**
+ * @brief Set every entry under node that lies in [start, end) to value,
+ * splitting entries that are only partly in the range into nodes of the
+ * next level. Nodes are never freed, readers may still be in them.
+ *
+ * @param node The node to update
+ * @param level Its level, 0 for the root
+ * @param base The first address node covers
+ * @param start The first address to set, grain aligned
+ * @param end One past the last address to set, grain aligned
+ * @param value The tagged pool or 0
+ * @return int 0 on success, -1 with errno set to ENOMEM
+ */
+static int set_range(registry_entry *node, size_t level, uintptr_t base, uintptr_t start, uintptr_t end,
+                     uintptr_t value)
+{
+    size_t shift = level_shift(level);
+    uintptr_t span = (uintptr_t)1 << shift;
+    while (start < end) {
+        size_t idx = (size_t)((start - base) >> shift);
+        uintptr_t e_start = base + idx * span;
+        uintptr_t stop = end < e_start + span ? end : e_start + span;
+        uintptr_t e = atomic_load_explicit(&node[idx], memory_order_relaxed);
+        bool whole = start == e_start && stop == e_start + span;
+        if (e == value) {
+            //Already there, a failed insert undoes itself without new nodes
+        } else if (whole && (e == 0 || (e & ENTRY_POOL))) {
+            atomic_store_explicit(&node[idx], value, memory_order_release);
+        } else {
+            if (e == 0 || (e & ENTRY_POOL)) {
+                //Fill the new node before it is published
+                size_t fanout = level_fanout(level + 1);
+                registry_entry *child = mmap(NULL, fanout * sizeof(registry_entry), PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (MAP_FAILED == child) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+                for (size_t i = 0; i < fanout; i++) {
+                    atomic_init(&child[i], e);
+                }
+                atomic_store_explicit(&node[idx], (uintptr_t)child, memory_order_release);
+                e = (uintptr_t)child;
+            }
+            if (set_range((registry_entry *)e, level + 1, e_start, start, stop, value) == -1) {
+                return -1;
+            }
+        }
+        start = stop;
+    }
+    return 0;
+}
+
+/**
+ * @brief The address range of a pool, false if it does not cover whole grains
+ * or lies past the addresses the registry maps.
+ */
+static bool pool_range(struct buddy_pool *pool, uintptr_t *start, uintptr_t *end)
+{
+    *start = (uintptr_t)pool->base;
+    *end = *start + pool->numbytes;
+    if (!pool->parent) {
+        //A mapped pool owns the rest of its last page
+        *end = (*end + PAGE - 1) & ~(PAGE - 1);
+    }
+    return (*start & (GRAIN - 1)) == 0 && (*end & (GRAIN - 1)) == 0 && (*end >> ADDRESS_BITS) == 0;
+}
+
+/**
+ * @brief What the memory of pool maps to without it, the parent a child was
+ * carved from.
+ */
+static uintptr_t pool_previous(struct buddy_pool *pool)
+{
+    return pool->parent ? (uintptr_t)pool->parent | ENTRY_POOL : 0;
+}
+
+int registry_insert(struct buddy_pool *pool)
+{
+    uintptr_t start, end;
+    if (!pool_range(pool, &start, &end)) {
+        return 0;
+    }
+    pthread_mutex_lock(&registry_lock);
+    int rval = set_range(registry_root, 0, 0, start, end, (uintptr_t)pool | ENTRY_POOL);
+    if (rval == -1) {
+        //Only splits can fail and the entries that were split keep their node
+        set_range(registry_root, 0, 0, start, end, pool_previous(pool));
+        errno = ENOMEM;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return rval;
+}
+
+void registry_remove(struct buddy_pool *pool)
+{
+    uintptr_t start, end;
+    if (!pool_range(pool, &start, &end)) {
+        return;
+    }
+    pthread_mutex_lock(&registry_lock);
+    set_range(registry_root, 0, 0, start, end, pool_previous(pool));
+    pthread_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,64 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * The registry maps addresses to pools. It is a three level radix tree
+   * over 48 bit addresses like a page table: each level resolves 12 bits,
+   * and an entry that a pool covers completely points at the pool directly,
+   * so a lookup is at most three loads whatever the number or size of the
+   * pools. A page that child pools smaller than a page share gets one more
+   * level that resolves the page down to the smallest block, which is the
+   * finest a child can be carved.
+   */
+#define REGISTRY_PAGE_SHIFT 12
+#define REGISTRY_BITS 12
+#define REGISTRY_LEVELS 3
+#define REGISTRY_GRAIN_SHIFT SMALLEST_K
+
+  /**
+   * Find the pool that manages ptr. Every pool made by buddy_init,
+   * buddy_init_opts or buddy_init_in is registered until buddy_destroy, and a
+   * child pool is found instead of its parent for every byte of its block. A
+   * buddy_reset of the parent takes the memory of its children back. The
+   * lookup takes no lock and may run while other threads create and destroy
+   * pools. A pool must not be moved to another address while it is
+   * registered.
+   *
+   * @param ptr Any address
+   * @return struct buddy_pool* the pool whose memory holds ptr or NULL
+   */
+  struct buddy_pool *buddy_pool_of(const void *ptr);
+
+  /**
+   * Free ptr to whichever pool it came from, found with buddy_pool_of.
+   * Pointers no registered pool owns are ignored.
+   *
+   * @param ptr Pointer returned by any of the registered pools, or NULL
+   */
+  void buddy_free_any(void *ptr);
+
+  /**
+   * Called by the pool to add its memory, or take it away and give it back to
+   * a parent or to nobody. Return -1 with errno set if the registry could not
+   * grow. Inserting a pool that is already registered can not fail and takes
+   * back the memory of its children.
+   */
+  int registry_insert(struct buddy_pool *pool);
+  void registry_remove(struct buddy_pool *pool);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
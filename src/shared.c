@@ -0,0 +1,734 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+
+#include "shared.h"
+
+/*Turn an offset into a pointer in this process and back again*/
+#define AT(pool, off) ((struct shared_avail *)((uint8_t *)(pool)->hdr + (off)))
+#define OFF(pool, p) ((uint64_t)((uint8_t *)(p) - (uint8_t *)(pool)->hdr))
+
+/*Offset of the list head for kval k*/
+#define HEAD(k) (offsetof(struct shared_header, avail) + (k) * sizeof(struct shared_avail))
+
+static int shared_recover(struct buddy_shared *pool);
+
+/**
+ * @brief Take the pool lock. A robust mutex tells us when the previous owner
+ * died while holding it, possibly halfway through unlinking or splitting a
+ * block. The avail lists are then rebuilt from the block headers before the
+ * lock is made usable again; if the headers are damaged too the lock is left
+ * unrecoverable so nobody walks the broken lists.
+ *
+ * @param pool The shared pool
+ * @return int 0 with the lock held, -1 with errno set to EIO or
+ * ENOTRECOVERABLE if the pool can not be used anymore
+ */
+static int shared_lock(struct buddy_shared *pool)
+{
+    int rval = pthread_mutex_lock(&pool->hdr->lock);
+    if (rval == EOWNERDEAD) {
+        if (shared_recover(pool) == -1) {
+            pthread_mutex_unlock(&pool->hdr->lock);
+            errno = EIO;
+            return -1;
+        }
+        rval = pthread_mutex_consistent(&pool->hdr->lock);
+    }
+    if (rval != 0) {
+        errno = rval;
+        return -1;
+    }
+    return 0;
+}
+
+static void shared_unlock(struct buddy_shared *pool)
+{
+    pthread_mutex_unlock(&pool->hdr->lock);
+}
+
+/**
+ * @brief Create an anonymous memory object that can be shared over fork or
+ * passed to another process as a descriptor.
+ *
+ * @return int file descriptor or -1 with errno set
+ */
+static int shared_memfd(void)
+{
+#ifdef __linux__
+    return memfd_create("buddy_shared", 0);
+#else
+    char name[64];
+    snprintf(name, sizeof(name), "/buddy_shared.%ld.%p", (long)getpid(), (void *)name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd != -1) {
+        shm_unlink(name);
+    }
+    return fd;
+#endif
+}
+
+/**
+ * @brief Map a formatted pool and make sure it is one of ours. Takes
+ * ownership of fd, which is closed on failure.
+ *
+ * @param pool The handle to fill in
+ * @param fd Descriptor for the memory object
+ * @return int 0 on success, -1 with errno set
+ */
+static int shared_map(struct buddy_shared *pool, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct shared_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == base) {
+        close(fd);
+        return -1;
+    }
+
+    struct shared_header *hdr = base;
+    if (hdr->magic != SHARED_MAGIC || hdr->version != SHARED_VERSION ||
+        hdr->header_size != sizeof(struct shared_header) ||
+        hdr->maplen != (uint64_t)st.st_size || hdr->kval_m < MIN_K || hdr->kval_m >= MAX_K ||
+        hdr->numbytes != UINT64_C(1) << hdr->kval_m || hdr->data + hdr->numbytes != hdr->maplen ||
+        (hdr->root != 0 && (hdr->root < hdr->data || hdr->root >= hdr->maplen))) {
+        munmap(base, (size_t)st.st_size);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    pool->hdr = hdr;
+    pool->maplen = (size_t)st.st_size;
+    pool->fd = fd;
+    return 0;
+}
+
+/**
+ * @brief Mark a block available, coalesce it with its free buddies and put the
+ * result on the avail lists. Caller holds the lock.
+ *
+ * @param pool The shared pool
+ * @param current Offset of the block header
+ */
+static void shared_release(struct buddy_shared *pool, uint64_t current)
+{
+    struct shared_header *hdr = pool->hdr;
+    struct shared_avail *block = AT(pool, current);
+    block->tag = BLOCK_AVAIL;
+
+    //Coalesce, buddies are computed relative to the start of the managed memory
+    size_t k_val = block->kval;
+    while (k_val < hdr->kval_m) {
+        uint64_t buddy_off = ((current - hdr->data) ^ (UINT64_C(1) << k_val)) + hdr->data;
+        struct shared_avail *buddy = AT(pool, buddy_off);
+        if (buddy->tag != BLOCK_AVAIL || buddy->kval != k_val) {
+            break;
+        }
+        AT(pool, buddy->prev)->next = buddy->next;
+        AT(pool, buddy->next)->prev = buddy->prev;
+        if (buddy_off < current) {
+            current = buddy_off;
+            block = buddy;
+        }
+        k_val++;
+        block->kval = k_val;
+    }
+
+    block->next = hdr->avail[k_val].next;
+    block->prev = HEAD(k_val);
+    AT(pool, hdr->avail[k_val].next)->prev = current;
+    hdr->avail[k_val].next = current;
+}
+
+/**
+ * @brief Walk the managed memory block by block using the kval in each
+ * header and count the free blocks of each order.
+ *
+ * @param pool The shared pool
+ * @param counts Filled in with the number of free blocks per kval
+ * @return int 0 if every header is sane, -1 otherwise
+ */
+static int shared_walk(struct buddy_shared *pool, size_t counts[MAX_K])
+{
+    struct shared_header *hdr = pool->hdr;
+    memset(counts, 0, MAX_K * sizeof(size_t));
+    uint64_t off = hdr->data;
+    while (off < hdr->maplen) {
+        struct shared_avail *block = AT(pool, off);
+        size_t k = block->kval;
+        uint64_t bytes = UINT64_C(1) << k;
+        if (k < SMALLEST_K || k > hdr->kval_m || ((off - hdr->data) & (bytes - 1)) != 0 ||
+            off + bytes > hdr->maplen) {
+            return -1;
+        }
+        if (block->tag == BLOCK_AVAIL) {
+            counts[k]++;
+        } else if (block->tag != BLOCK_RESERVED) {
+            return -1;
+        }
+        off += bytes;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check that the pool can be trusted: every block header is sane and
+ * the avail lists hold exactly the free blocks, correctly linked both ways.
+ * Caller holds the lock or is the only user of the pool.
+ *
+ * @param pool The shared pool
+ * @return int 0 if consistent, -1 with errno set to EIO otherwise
+ */
+static int shared_check(struct buddy_shared *pool)
+{
+    struct shared_header *hdr = pool->hdr;
+    size_t counts[MAX_K];
+    if (shared_walk(pool, counts) == -1) {
+        errno = EIO;
+        return -1;
+    }
+
+    for (size_t k = 0; k < MAX_K; k++) {
+        uint64_t prev = HEAD(k);
+        uint64_t cur = hdr->avail[k].next;
+        size_t n = 0;
+        while (cur != HEAD(k)) {
+            //Bounding n by the walk also stops us going around a corrupt cycle
+            if (n == counts[k] || cur < hdr->data || cur + sizeof(struct shared_avail) > hdr->maplen) {
+                errno = EIO;
+                return -1;
+            }
+            struct shared_avail *block = AT(pool, cur);
+            if (block->tag != BLOCK_AVAIL || block->kval != k || block->prev != prev) {
+                errno = EIO;
+                return -1;
+            }
+            n++;
+            prev = cur;
+            cur = block->next;
+        }
+        if (n != counts[k] || hdr->avail[k].prev != prev) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Bring a reopened persistent pool back to a consistent state. If a
+ * crash left the avail lists broken but every block header intact, the lists
+ * are rebuilt from the headers and no allocation is lost.
+ *
+ * @param pool The shared pool, not in use by any other process or locked
+ * @return int 0 on success, -1 with errno set to EIO if the headers are damaged
+ */
+static int shared_recover(struct buddy_shared *pool)
+{
+    if (shared_check(pool) == 0) {
+        return 0;
+    }
+    struct shared_header *hdr = pool->hdr;
+    size_t counts[MAX_K];
+    if (shared_walk(pool, counts) == -1) {
+        errno = EIO;
+        return -1;
+    }
+
+    for (size_t i = 0; i < MAX_K; i++) {
+        hdr->avail[i].next = hdr->avail[i].prev = HEAD(i);
+    }
+
+    //First hide the free blocks so releasing one can not coalesce with a
+    //neighbour that is not on a list yet, then release them in address order
+    for (uint64_t off = hdr->data; off < hdr->maplen; off += UINT64_C(1) << AT(pool, off)->kval) {
+        if (AT(pool, off)->tag == BLOCK_AVAIL) {
+            AT(pool, off)->tag = BLOCK_UNUSED;
+        }
+    }
+    uint64_t off = hdr->data;
+    while (off < hdr->maplen) {
+        struct shared_avail *block = AT(pool, off);
+        uint64_t next = off + (UINT64_C(1) << block->kval);
+        if (block->tag == BLOCK_UNUSED) {
+            shared_release(pool, off);
+        }
+        off = next;
+    }
+    return shared_check(pool);
+}
+
+/**
+ * @brief Set up the process shared lock in a pool header. Also used to
+ * reinitialize the lock of a persistent pool nobody else has open.
+ *
+ * @param hdr The pool header
+ * @return int 0 on success, -1 with errno set
+ */
+static int shared_init_lock(struct shared_header *hdr)
+{
+    pthread_mutexattr_t attr;
+    int rval = pthread_mutexattr_init(&attr);
+    if (rval == 0) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        rval = pthread_mutex_init(&hdr->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    if (rval != 0) {
+        errno = rval;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Work out where everything goes in a pool of size bytes.
+ *
+ * @param size The requested pool size, rounded the same way buddy_init does
+ * @param kval Set to the kval of the managed memory
+ * @param data Set to the offset of the managed memory
+ * @return size_t the length of the whole mapping
+ */
+static size_t shared_layout(size_t size, size_t *kval, size_t *data)
+{
+    //Same rounding rules as buddy_init
+    *kval = size == 0 ? DEFAULT_K : btok(size);
+    if (*kval < MIN_K)
+        *kval = MIN_K;
+    if (*kval > MAX_K)
+        *kval = MAX_K - 1;
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    *data = (sizeof(struct shared_header) + page - 1) & ~(page - 1);
+    return *data + (UINT64_C(1) << *kval);
+}
+
+/**
+ * @brief Size the memory object behind fd, map it and format an empty pool
+ * in it. The descriptor is left open for the caller whether or not this
+ * succeeds.
+ *
+ * A durable format is flushed to the file before the magic number is
+ * stored and flushed on its own, so the magic never reaches the file ahead
+ * of the format it vouches for.
+ *
+ * @param pool The handle to fill in
+ * @param fd Descriptor for an empty memory object or file
+ * @param size The requested pool size, rounded the same way buddy_init does
+ * @param durable Whether fd is a file the pool has to survive a crash in
+ * @return int 0 on success, -1 with errno set
+ */
+static int shared_format(struct buddy_shared *pool, int fd, size_t size, bool durable)
+{
+    size_t kval;
+    size_t data;
+    size_t maplen = shared_layout(size, &kval, &data);
+    size_t numbytes = UINT64_C(1) << kval;
+
+    if (ftruncate(fd, (off_t)maplen) == -1) {
+        return -1;
+    }
+    struct shared_header *hdr = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == hdr) {
+        return -1;
+    }
+
+    hdr->version = SHARED_VERSION;
+    hdr->header_size = sizeof(struct shared_header);
+    hdr->kval_m = kval;
+    hdr->numbytes = numbytes;
+    hdr->data = data;
+    hdr->maplen = maplen;
+    hdr->root = 0;
+
+    if (shared_init_lock(hdr) == -1) {
+        int saved = errno;
+        munmap(hdr, maplen);
+        errno = saved;
+        return -1;
+    }
+
+    //Same circular lists as buddy_init, the heads just link by offset
+    for (size_t i = 0; i < MAX_K; i++) {
+        hdr->avail[i].next = hdr->avail[i].prev = HEAD(i);
+        hdr->avail[i].kval = i;
+        hdr->avail[i].tag = BLOCK_UNUSED;
+    }
+
+    struct shared_avail *m = (struct shared_avail *)((uint8_t *)hdr + data);
+    m->tag = BLOCK_AVAIL;
+    m->kval = kval;
+    m->next = m->prev = HEAD(kval);
+    hdr->avail[kval].next = hdr->avail[kval].prev = data;
+
+    //Only now can anyone else attach
+    if (durable && msync(hdr, maplen, MS_SYNC) == -1) {
+        int saved = errno;
+        munmap(hdr, maplen);
+        errno = saved;
+        return -1;
+    }
+    hdr->magic = SHARED_MAGIC;
+    if (durable && msync(hdr, data, MS_SYNC) == -1) {
+        int saved = errno;
+        munmap(hdr, maplen);
+        errno = saved;
+        return -1;
+    }
+
+    pool->hdr = hdr;
+    pool->maplen = maplen;
+    pool->fd = fd;
+    return 0;
+}
+
+/**
+ * @brief Check whether a file holds no pool yet: it is empty, or a crash cut
+ * the format of a pool of size bytes short before the magic number was
+ * written. Anything else without a magic number is somebody else's file.
+ *
+ * @param fd Descriptor for the file, locked so nobody else is using it
+ * @param st The file status of fd
+ * @param size The pool size the caller asked for
+ * @return bool true if the file should be formatted
+ */
+static bool shared_unformatted(int fd, const struct stat *st, size_t size)
+{
+    if (st->st_size == 0) {
+        return true;
+    }
+    size_t kval, data;
+    uint64_t magic = 0;
+    return (uint64_t)st->st_size == shared_layout(size, &kval, &data) &&
+           pread(fd, &magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) && magic == 0;
+}
+
+int buddy_shared_create(struct buddy_shared *pool, const char *name, size_t size)
+{
+    if (!pool) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) : shared_memfd();
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (shared_format(pool, fd, size, false) == -1) {
+        int saved = errno;
+        close(fd);
+        if (name) {
+            shm_unlink(name);
+        }
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+int buddy_shared_open_file(struct buddy_shared *pool, const char *path, size_t size)
+{
+    if (!pool || !path) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+
+    //Every process holds a shared flock for as long as it has the pool open.
+    //Whoever gets it exclusively is alone, which makes it safe to format a new
+    //file or to reset the lock and check an old one.
+    bool alone = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    if (!alone && flock(fd, LOCK_SH) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        goto fail;
+    }
+
+    if (alone && shared_unformatted(fd, &st, size)) {
+        //Start over from an empty file so nothing of the broken format is left
+        if (ftruncate(fd, 0) == -1 || shared_format(pool, fd, size, true) == -1) {
+            goto fail;
+        }
+    } else {
+        if (shared_map(pool, fd) == -1) {
+            return -1; //shared_map closed fd for us
+        }
+        //A lock left behind by a crashed process could be held forever, and the
+        //crash could have interrupted a malloc or free
+        if (alone && (shared_init_lock(pool->hdr) == -1 || shared_recover(pool) == -1)) {
+            int saved = errno;
+            buddy_shared_close(pool);
+            errno = saved;
+            return -1;
+        }
+    }
+
+    if (alone) {
+        flock(fd, LOCK_SH);
+    }
+    return 0;
+
+fail:;
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+}
+
+int buddy_shared_open(struct buddy_shared *pool, const char *name)
+{
+    if (!pool || !name) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    return shared_map(pool, fd);
+}
+
+int buddy_shared_attach(struct buddy_shared *pool, int fd)
+{
+    if (!pool) {
+        errno = EINVAL;
+        return -1;
+    }
+    int dupfd = dup(fd);
+    if (dupfd == -1) {
+        return -1;
+    }
+    return shared_map(pool, dupfd);
+}
+
+void buddy_shared_close(struct buddy_shared *pool)
+{
+    if (!pool || !pool->hdr) {
+        return;
+    }
+    munmap(pool->hdr, pool->maplen);
+    close(pool->fd);
+    memset(pool, 0, sizeof(struct buddy_shared));
+}
+
+int buddy_shared_unlink(const char *name)
+{
+    return shm_unlink(name);
+}
+
+void *buddy_shared_malloc(struct buddy_shared *pool, size_t size)
+{
+    //Validate Values
+    if (size == 0 || !pool || !pool->hdr || size > pool->hdr->numbytes) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct shared_header *hdr = pool->hdr;
+    size_t required_kval = btok(size + sizeof(struct shared_avail));
+
+    if (shared_lock(pool) == -1) {
+        return NULL;
+    }
+
+    //Find a block where k <= j <= m
+    size_t target_kval = required_kval;
+    while (target_kval <= hdr->kval_m && hdr->avail[target_kval].next == HEAD(target_kval)) {
+        target_kval++;
+    }
+    if (target_kval > hdr->kval_m) {
+        shared_unlock(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    //Remove from list
+    uint64_t current = hdr->avail[target_kval].next;
+    struct shared_avail *block = AT(pool, current);
+    AT(pool, block->prev)->next = block->next;
+    AT(pool, block->next)->prev = block->prev;
+
+    //Split down to the requested size, handing the upper halves to the lists
+    while (target_kval > required_kval) {
+        target_kval--;
+        uint64_t buddy_off = current + (UINT64_C(1) << target_kval);
+        struct shared_avail *buddy = AT(pool, buddy_off);
+        buddy->kval = target_kval;
+        buddy->tag = BLOCK_AVAIL;
+        buddy->next = hdr->avail[target_kval].next;
+        buddy->prev = HEAD(target_kval);
+        AT(pool, hdr->avail[target_kval].next)->prev = buddy_off;
+        hdr->avail[target_kval].next = buddy_off;
+        block->kval = target_kval;
+    }
+    block->tag = BLOCK_RESERVED;
+
+    shared_unlock(pool);
+    return (uint8_t *)block + sizeof(struct shared_avail);
+}
+
+int buddy_shared_free(struct buddy_shared *pool, void *ptr)
+{
+    //Validate Values
+    if (!pool || !pool->hdr || !ptr) {
+        return 0;
+    }
+    struct shared_header *hdr = pool->hdr;
+    if ((uint8_t *)ptr < (uint8_t *)hdr + hdr->data + sizeof(struct shared_avail) ||
+        (uint8_t *)ptr >= (uint8_t *)hdr + hdr->maplen) {
+        return 0; // Pointer is outside our pool
+    }
+    uint64_t current = OFF(pool, ptr) - sizeof(struct shared_avail);
+
+    if (shared_lock(pool) == -1) {
+        return -1;
+    }
+    if (AT(pool, current)->tag == BLOCK_RESERVED) {
+        shared_release(pool, current);
+    }
+    shared_unlock(pool);
+    return 0;
+}
+
+int buddy_shared_check(struct buddy_shared *pool)
+{
+    if (!pool || !pool->hdr) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (shared_lock(pool) == -1) {
+        return -1;
+    }
+    int rval = shared_check(pool);
+    shared_unlock(pool);
+    return rval;
+}
+
+int buddy_shared_walk(struct buddy_shared *pool, buddy_walk_fn fn, void *ctx)
+{
+    if (!pool || !pool->hdr || !fn) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct shared_header *hdr = pool->hdr;
+    if (shared_lock(pool) == -1) {
+        return -1;
+    }
+    int rval = 0;
+    uint64_t off = hdr->data;
+    while (rval == 0 && off < hdr->maplen) {
+        struct shared_avail *header = AT(pool, off);
+        size_t k = header->kval;
+        uint64_t bytes = UINT64_C(1) << k;
+        if (k < SMALLEST_K || k > hdr->kval_m || ((off - hdr->data) & (bytes - 1)) != 0 ||
+            off + bytes > hdr->maplen || (header->tag != BLOCK_AVAIL && header->tag != BLOCK_RESERVED)) {
+            errno = EIO;
+            rval = -1;
+            break;
+        }
+        struct buddy_block block = {0};
+        block.start = header;
+        block.bytes = bytes;
+        block.kval = k;
+        block.reserved = header->tag == BLOCK_RESERVED;
+        block.ptr = block.reserved ? (uint8_t *)header + sizeof(struct shared_avail) : NULL;
+        rval = fn(&block, ctx);
+        off += bytes;
+    }
+    shared_unlock(pool);
+    return rval;
+}
+
+int buddy_shared_sync(struct buddy_shared *pool)
+{
+    if (!pool || !pool->hdr) {
+        errno = EINVAL;
+        return -1;
+    }
+    //Holding the lock keeps the metadata still while it is written out
+    if (shared_lock(pool) == -1) {
+        return -1;
+    }
+    int rval = msync(pool->hdr, pool->maplen, MS_SYNC);
+    shared_unlock(pool);
+    return rval;
+}
+
+int buddy_shared_root_set(struct buddy_shared *pool, const void *ptr)
+{
+    uint64_t offset = buddy_shared_offset(pool, ptr);
+    if (!pool || !pool->hdr || (ptr && offset == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (shared_lock(pool) == -1) {
+        return -1;
+    }
+    pool->hdr->root = offset;
+    shared_unlock(pool);
+    return 0;
+}
+
+void *buddy_shared_root_get(struct buddy_shared *pool)
+{
+    if (!pool || !pool->hdr) {
+        return NULL;
+    }
+    if (shared_lock(pool) == -1) {
+        return NULL;
+    }
+    uint64_t offset = pool->hdr->root;
+    shared_unlock(pool);
+    return buddy_shared_ptr(pool, offset);
+}
+
+uint64_t buddy_shared_offset(struct buddy_shared *pool, const void *ptr)
+{
+    if (!pool || !pool->hdr || !ptr) {
+        return 0;
+    }
+    const uint8_t *base = (const uint8_t *)pool->hdr;
+    if ((const uint8_t *)ptr < base + pool->hdr->data || (const uint8_t *)ptr >= base + pool->maplen) {
+        return 0;
+    }
+    return (uint64_t)((const uint8_t *)ptr - base);
+}
+
+void *buddy_shared_ptr(struct buddy_shared *pool, uint64_t offset)
+{
+    if (!pool || !pool->hdr || offset < pool->hdr->data || offset >= pool->maplen) {
+        return NULL;
+    }
+    return (uint8_t *)pool->hdr + offset;
+}
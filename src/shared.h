@@ -0,0 +1,247 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * Identifies a mapping that holds a shared buddy pool.
+   */
+#define SHARED_MAGIC UINT64_C(0x4c4f4f5059444442) /*"BDDYPOOL"*/
+#define SHARED_VERSION 2
+
+  /**
+   * Free list entry of a shared pool. Same layout as struct avail except the
+   * links are byte offsets from the start of the mapping instead of pointers,
+   * so every process can follow them no matter where the mapping landed.
+   */
+  struct shared_avail
+  {
+    unsigned short int tag;     /*Tag for block status BLOCK_AVAIL, BLOCK_RESERVED*/
+    unsigned short int kval;    /*The kval of this block*/
+    uint64_t next;              /*offset of the next memory block*/
+    uint64_t prev;              /*offset of the prev memory block*/
+  };
+
+  /**
+   * All of the pool metadata. It lives at offset 0 of the shared mapping and
+   * the managed memory starts at the first page boundary after it.
+   */
+  struct shared_header
+  {
+    uint64_t magic;                     /*SHARED_MAGIC once the pool is formatted*/
+    uint32_t version;                   /*SHARED_VERSION*/
+    uint32_t header_size;               /*sizeof(struct shared_header) of the creator*/
+    uint64_t kval_m;                    /*The max kval of this pool*/
+    uint64_t numbytes;                  /*The number of bytes this pool is managing*/
+    uint64_t data;                      /*Offset of the managed memory in the mapping*/
+    uint64_t maplen;                    /*Total length of the mapping*/
+    uint64_t root;                      /*Offset set with buddy_shared_root_set, 0 for none*/
+    pthread_mutex_t lock;               /*Process shared lock guarding everything below*/
+    struct shared_avail avail[MAX_K];   /*The array of available memory blocks*/
+  };
+
+  /**
+   * A process local handle on a shared pool. Each process that attaches gets
+   * its own handle; the addresses differ between processes but offsets do not.
+   */
+  struct buddy_shared
+  {
+    struct shared_header *hdr;  /*Start of the mapping in this process*/
+    size_t maplen;              /*Length of the mapping*/
+    int fd;                     /*The memfd, shm object or file backing the mapping*/
+  };
+
+  /**
+   * Create a new shared pool of at least size bytes, rounded up to a power of
+   * two the same way buddy_init does. If name is NULL the pool is backed by an
+   * anonymous memfd that other processes reach through fork or by being passed
+   * the fd; otherwise it is a POSIX shared memory object that other processes
+   * attach to with buddy_shared_open.
+   *
+   * @param pool The handle to initialize
+   * @param name The shm_open name or NULL for an anonymous memfd
+   * @param size The size of the pool in bytes, 0 for DEFAULT_K
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_shared_create(struct buddy_shared *pool, const char *name, size_t size);
+
+  /**
+   * Open a persistent pool backed by the file at path, creating and formatting
+   * it with size bytes if the file is empty or missing. An existing file is
+   * mapped as is, so every allocation made before the last close (or crash)
+   * is still there at the same offset; size is ignored in that case. The
+   * magic number is written and flushed only after the rest of the format
+   * is on disk, so a file whose format a crash cut short has none; it is
+   * formatted again if it has the size a pool of size bytes takes. Any
+   * other file that is not a pool is left alone and the open fails with
+   * EINVAL. Keep the allocation everything else
+   * hangs off in buddy_shared_root_set to find it after the reopen.
+   *
+   * Several processes may have the same file open at once. The first one to
+   * open it resets the pool lock and runs buddy_shared_check. If a crash left
+   * the avail lists inconsistent they are rebuilt from the block headers; if
+   * the headers themselves are damaged the open fails with EIO.
+   *
+   * Data reaches the file through the page cache; use buddy_shared_sync for a
+   * durability point.
+   *
+   * @param pool The handle to initialize
+   * @param path The file to map
+   * @param size The size of a new pool in bytes, 0 for DEFAULT_K
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_shared_open_file(struct buddy_shared *pool, const char *path, size_t size);
+
+  /**
+   * Attach to a shared pool created by another process with a name.
+   *
+   * @param pool The handle to initialize
+   * @param name The name passed to buddy_shared_create
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_shared_open(struct buddy_shared *pool, const char *name);
+
+  /**
+   * Attach to a shared pool through a file descriptor, for example a memfd
+   * inherited over fork or received over a unix socket. The descriptor is
+   * duplicated so the caller keeps ownership of fd.
+   *
+   * @param pool The handle to initialize
+   * @param fd A descriptor for the pool's memory object
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_shared_attach(struct buddy_shared *pool, int fd);
+
+  /**
+   * Unmap the pool from this process and close the descriptor. The pool itself
+   * lives on until every process has closed it (and, for named pools, the name
+   * has been removed with buddy_shared_unlink).
+   *
+   * @param pool The handle to close
+   */
+  void buddy_shared_close(struct buddy_shared *pool);
+
+  /**
+   * Remove the name of a shared pool.
+   *
+   * @param name The name passed to buddy_shared_create
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_shared_unlink(const char *name);
+
+  /**
+   * Allocate size bytes from the shared pool. Same contract as buddy_malloc.
+   *
+   * A process that dies holding the pool lock may leave the avail lists half
+   * updated. The next process to take the lock rebuilds them from the block
+   * headers, losing at most the block the dead process was allocating. If the
+   * headers are damaged as well the pool can not be used anymore: that call
+   * fails with EIO and every later one with ENOTRECOVERABLE. The same goes
+   * for every other call below that takes the lock.
+   *
+   * @param pool The shared pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @return A pointer to the memory block valid in this process, or NULL with
+   * errno set to ENOMEM, EIO or ENOTRECOVERABLE
+   */
+  void *buddy_shared_malloc(struct buddy_shared *pool, size_t size);
+
+  /**
+   * Free memory allocated by any process from the shared pool. Same contract
+   * as buddy_free.
+   *
+   * @param pool The shared pool
+   * @param ptr Pointer to the memory block to free
+   * @return 0 on success, -1 with errno set to EIO or ENOTRECOVERABLE if the
+   * pool can not be used anymore
+   */
+  int buddy_shared_free(struct buddy_shared *pool, void *ptr);
+
+  /**
+   * Verify the pool metadata: every block header is sane and the avail lists
+   * hold exactly the free blocks, linked correctly in both directions.
+   *
+   * @param pool The shared pool
+   * @return 0 if consistent, -1 with errno set to EIO if not
+   */
+  int buddy_shared_check(struct buddy_shared *pool);
+
+  /**
+   * buddy_walk for a shared pool. The pool lock is held for the whole walk so
+   * other threads and processes see it as one operation; the callback must not
+   * call into the pool. Shared headers do not record the size asked for, so
+   * size is always 0 and flags are always 0.
+   *
+   * @param pool The shared pool
+   * @param fn Called once per block
+   * @param ctx Passed through to fn
+   * @return 0 once every block was visited, whatever fn returned if it stopped
+   * the walk, or -1 with errno set to EINVAL or EIO
+   */
+  int buddy_shared_walk(struct buddy_shared *pool, buddy_walk_fn fn, void *ctx);
+
+  /**
+   * Durability point for file backed pools. Flushes the whole mapping to the
+   * file with msync while holding the pool lock, so the metadata on disk is a
+   * consistent snapshot.
+   *
+   * @param pool The shared pool
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_shared_sync(struct buddy_shared *pool);
+
+  /**
+   * Remember ptr in the pool header as the root of the data in the pool, the
+   * one place a process that opens or reopens the pool starts from. It is
+   * kept as an offset, so it is found at whatever address the pool is mapped
+   * and survives a close or crash like the allocations do.
+   *
+   * @param pool The shared pool
+   * @param ptr Pointer into the pool, or NULL to clear the root
+   * @return 0 on success, -1 with errno set to EINVAL if ptr is outside the pool
+   */
+  int buddy_shared_root_set(struct buddy_shared *pool, const void *ptr);
+
+  /**
+   * Get the root set with buddy_shared_root_set, by this or any other process.
+   *
+   * @param pool The shared pool
+   * @return Pointer in this process, or NULL if no root is set
+   */
+  void *buddy_shared_root_get(struct buddy_shared *pool);
+
+  /**
+   * Convert a pointer into the pool to an offset that can be handed to another
+   * process.
+   *
+   * @param pool The shared pool
+   * @param ptr Pointer into the pool
+   * @return The offset of ptr, or 0 if ptr is NULL or outside the pool
+   */
+  uint64_t buddy_shared_offset(struct buddy_shared *pool, const void *ptr);
+
+  /**
+   * Convert an offset from buddy_shared_offset back to a pointer in this
+   * process.
+   *
+   * @param pool The shared pool
+   * @param offset An offset from buddy_shared_offset
+   * @return Pointer in this process, or NULL if the offset is 0 or out of range
+   */
+  void *buddy_shared_ptr(struct buddy_shared *pool, uint64_t offset);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+
+#include "trace.h"
+
+/**
+ * Records of one thread waiting to be written out.
+ */
+struct trace_buffer
+{
+    struct trace_buffer *next;      /*next buffer of the same trace*/
+    pthread_t owner;                /*thread that fills this buffer*/
+    size_t count;                   /*records in use*/
+    struct trace_record records[TRACE_BUFFER_RECORDS];
+};
+
+/**
+ * An active trace, hung off struct buddy_pool.
+ */
+struct buddy_trace
+{
+    int fd;                         /*trace file*/
+    int error;                      /*first errno from a failed write*/
+    uint64_t serial;                /*unique per trace so stale thread caches are spotted*/
+    uint64_t start;                 /*CLOCK_MONOTONIC at start in nanoseconds*/
+    pthread_mutex_t lock;           /*guards buffers and writes to fd*/
+    struct trace_buffer *buffers;   /*one per thread that has recorded*/
+};
+
+static atomic_uint_fast64_t next_serial = 1;
+static atomic_uint_fast32_t next_thread = 1;
+
+/*Each thread remembers the buffer it used last and which trace it belongs to*/
+static __thread struct trace_buffer *tls_buffer;
+static __thread uint64_t tls_serial;
+static __thread uint32_t tls_thread;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief write(2) until everything is out
+ *
+ * @return int 0 on success, -1 with errno set
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write out a buffer and empty it. Caller holds the trace lock.
+ */
+static void trace_flush_locked(struct buddy_trace *trace, struct trace_buffer *buf)
+{
+    if (buf->count > 0 && write_all(trace->fd, buf->records, buf->count * sizeof(struct trace_record)) == -1 &&
+        trace->error == 0) {
+        trace->error = errno;
+    }
+    buf->count = 0;
+}
+
+/**
+ * @brief Find the calling thread's buffer for trace, creating it if needed.
+ * The common case is a thread local compare and nothing else.
+ *
+ * @return struct trace_buffer* the buffer or NULL if out of memory
+ */
+static struct trace_buffer *trace_buffer_for(struct buddy_trace *trace)
+{
+    if (tls_serial == trace->serial) {
+        return tls_buffer;
+    }
+
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&trace->lock);
+    struct trace_buffer *buf = trace->buffers;
+    while (buf && !pthread_equal(buf->owner, self)) {
+        buf = buf->next;
+    }
+    if (!buf) {
+        buf = malloc(sizeof(struct trace_buffer));
+        if (buf) {
+            buf->owner = self;
+            buf->count = 0;
+            buf->next = trace->buffers;
+            trace->buffers = buf;
+        }
+    }
+    pthread_mutex_unlock(&trace->lock);
+
+    if (buf) {
+        tls_buffer = buf;
+        tls_serial = trace->serial;
+    }
+    if (tls_thread == 0) {
+        tls_thread = (uint32_t)atomic_fetch_add(&next_thread, 1);
+    }
+    return buf;
+}
+
+/**
+ * @brief Convert a pointer into a trace id, 0 for NULL
+ */
+static uint64_t trace_id(struct buddy_pool *pool, void *ptr)
+{
+    return ptr ? (uint64_t)((uint8_t *)ptr - (uint8_t *)pool->base) + 1 : 0;
+}
+
+static void trace_record(struct buddy_pool *pool, uint32_t op, uint64_t id, uint64_t old_id, size_t size)
+{
+    struct buddy_trace *trace = pool->trace;
+    struct trace_buffer *buf = trace_buffer_for(trace);
+    if (!buf) {
+        return;
+    }
+    if (buf->count == TRACE_BUFFER_RECORDS) {
+        pthread_mutex_lock(&trace->lock);
+        trace_flush_locked(trace, buf);
+        pthread_mutex_unlock(&trace->lock);
+    }
+    struct trace_record *rec = &buf->records[buf->count++];
+    rec->ts = now_ns() - trace->start;
+    rec->id = id;
+    rec->old_id = old_id;
+    rec->size = size;
+    rec->thread = tls_thread;
+    rec->op = op;
+}
+
+void trace_malloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    trace_record(pool, TRACE_MALLOC, trace_id(pool, ptr), 0, size);
+}
+
+void trace_free(struct buddy_pool *pool, void *ptr)
+{
+    if ((uint8_t *)ptr < (uint8_t *)pool->base || (uint8_t *)ptr >= (uint8_t *)pool->base + pool->numbytes) {
+        return;
+    }
+    trace_record(pool, TRACE_FREE, trace_id(pool, ptr), 0, 0);
+}
+
+void trace_realloc(struct buddy_pool *pool, void *old_ptr, void *ptr, size_t size)
+{
+    trace_record(pool, TRACE_REALLOC, trace_id(pool, ptr), trace_id(pool, old_ptr), size);
+}
+
+void trace_reset(struct buddy_pool *pool)
+{
+    trace_record(pool, TRACE_RESET, 0, 0, 0);
+}
+
+int buddy_trace_start(struct buddy_pool *pool, const char *path)
+{
+    if (!pool || !path) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pool->trace) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    struct buddy_trace *trace = calloc(1, sizeof(struct buddy_trace));
+    if (!trace) {
+        return -1;
+    }
+    trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace->fd == -1) {
+        free(trace);
+        return -1;
+    }
+
+    struct trace_file_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(struct trace_record);
+    hdr.kval_m = pool->kval_m;
+    if (write_all(trace->fd, &hdr, sizeof(hdr)) == -1) {
+        int saved = errno;
+        close(trace->fd);
+        free(trace);
+        errno = saved;
+        return -1;
+    }
+
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->serial = atomic_fetch_add(&next_serial, 1);
+    trace->start = now_ns();
+    pool->trace = trace;
+    return 0;
+}
+
+int buddy_trace_stop(struct buddy_pool *pool)
+{
+    if (!pool || !pool->trace) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct buddy_trace *trace = pool->trace;
+    pool->trace = NULL;
+
+    pthread_mutex_lock(&trace->lock);
+    struct trace_buffer *buf = trace->buffers;
+    while (buf) {
+        struct trace_buffer *next = buf->next;
+        trace_flush_locked(trace, buf);
+        free(buf);
+        buf = next;
+    }
+    pthread_mutex_unlock(&trace->lock);
+    pthread_mutex_destroy(&trace->lock);
+
+    int error = trace->error;
+    if (close(trace->fd) == -1 && error == 0) {
+        error = errno;
+    }
+    free(trace);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * Identifies an allocation trace file.
+   */
+#define TRACE_MAGIC "BDDYTRC"
+#define TRACE_VERSION 1
+
+  /**
+   * The operation a trace record describes.
+   */
+#define TRACE_MALLOC  1  /*buddy_malloc, buddy_malloc_order or buddy_malloc_aligned*/
+#define TRACE_FREE    2  /*buddy_free*/
+#define TRACE_REALLOC 3  /*buddy_realloc with a non NULL ptr and non zero size*/
+#define TRACE_RESET   4  /*buddy_reset, every live id is freed*/
+
+  /**
+   * Number of records each thread buffers before writing them out.
+   */
+#define TRACE_BUFFER_RECORDS 4096
+
+  /**
+   * The first bytes of every trace file.
+   */
+  struct trace_file_header
+  {
+    char magic[8];              /*TRACE_MAGIC*/
+    uint32_t version;           /*TRACE_VERSION*/
+    uint32_t record_size;       /*sizeof(struct trace_record)*/
+    uint64_t kval_m;            /*The max kval of the traced pool*/
+  };
+
+  /**
+   * One call into the pool. Pointers are recorded as ids, the offset of the
+   * user memory from the pool base plus one, so 0 always means NULL and ids
+   * are unique among live allocations. Records from different threads are
+   * written in per thread batches, sort by ts to get the original order.
+   */
+  struct trace_record
+  {
+    uint64_t ts;                /*Nanoseconds since the trace was started*/
+    uint64_t id;                /*Pointer returned (malloc, realloc) or freed*/
+    uint64_t old_id;            /*Pointer passed to realloc, 0 otherwise*/
+    uint64_t size;              /*Bytes requested, 0 for free*/
+    uint32_t thread;            /*Small per process thread number*/
+    uint32_t op;                /*TRACE_MALLOC, TRACE_FREE, TRACE_REALLOC or TRACE_RESET*/
+  };
+
+  /**
+   * Start recording every malloc, free and realloc call on pool to the file at
+   * path. Each thread buffers its records and writes them out in batches, so
+   * the cost per call is a clock read and a store into the thread's buffer.
+   * Only one trace per pool can be active.
+   *
+   * @param pool The memory pool to trace
+   * @param path The trace file to create (truncated if it exists)
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_trace_start(struct buddy_pool *pool, const char *path);
+
+  /**
+   * Stop recording, flush every thread's buffer and close the trace file. No
+   * other thread may be using the pool while this runs.
+   *
+   * @param pool The memory pool being traced
+   * @return 0 on success, -1 with errno set if a write failed
+   */
+  int buddy_trace_stop(struct buddy_pool *pool);
+
+  /**
+   * Hooks called by the pool when a trace is active.
+   */
+  void trace_malloc(struct buddy_pool *pool, void *ptr, size_t size);
+  void trace_free(struct buddy_pool *pool, void *ptr);
+  void trace_realloc(struct buddy_pool *pool, void *old_ptr, void *ptr, size_t size);
+  void trace_reset(struct buddy_pool *pool);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
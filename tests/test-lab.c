@@ -1,13 +1,35 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 #include <time.h>
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
 #include <errno.h>
 #endif
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#endif
 #include "harness/unity.h"
 #include "../src/lab.h"
+#include "../src/shared.h"
+#include "../src/trace.h"
+#include "../src/profile.h"
+#include "../src/latency.h"
+#include "../src/heapmap.h"
+#include "../src/packed.h"
+#include "../src/fibonacci.h"
+#include "../src/leaks.h"
+#include "../src/registry.h"
+#include "../src/quota.h"
 
 
 void setUp(void) {
@@ -293,6 +315,1675 @@ void test_buddy_multi_alloc_free(void)
   buddy_destroy(&pool);
 }
 
+void test_buddy_malloc_order(void)
+{
+  fprintf(stderr, "->Testing fixed order allocation\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  //First call has to split all the way down
+  void *mem1 = buddy_malloc_order(&pool, SMALLEST_K);
+  assert(mem1 != NULL);
+  struct avail *tmp = (struct avail *)mem1 - 1;
+  assert(tmp->kval == SMALLEST_K);
+  assert(tmp->tag == BLOCK_RESERVED);
+
+  //Second call takes the buddy left behind by the split
+  void *mem2 = buddy_malloc_order(&pool, SMALLEST_K);
+  assert(mem2 == (uint8_t *)mem1 + (UINT64_C(1) << SMALLEST_K));
+  assert(pool.avail[SMALLEST_K].next == &pool.avail[SMALLEST_K]);
+
+  //Orders outside the pool fail
+  assert(buddy_malloc_order(&pool, SMALLEST_K - 1) == NULL);
+  assert(errno == ENOMEM);
+  assert(buddy_malloc_order(&pool, MIN_K + 1) == NULL);
+  assert(errno == ENOMEM);
+  assert(buddy_malloc_order(NULL, SMALLEST_K) == NULL);
+
+  buddy_free(&pool, mem1);
+  buddy_free(&pool, mem2);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_malloc_aligned(void)
+{
+  fprintf(stderr, "->Testing aligned allocation\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  size_t alignments[] = {1, 8, 16, 64, 4096};
+  void *mem[5];
+  for (size_t i = 0; i < 5; i++)
+    {
+      mem[i] = buddy_malloc_aligned(&pool, 100, alignments[i]);
+      assert(mem[i] != NULL);
+      assert(((uintptr_t)mem[i] & (alignments[i] - 1)) == 0);
+      memset(mem[i], 0xff, 100);
+    }
+
+  //Bad alignments are rejected
+  assert(buddy_malloc_aligned(&pool, 100, 0) == NULL);
+  assert(errno == ENOMEM);
+  assert(buddy_malloc_aligned(&pool, 100, 24) == NULL);
+  assert(errno == ENOMEM);
+
+  //Growing or shrinking moves the data and keeps the alignment
+  size_t sizes[] = {5000, 40, 100};
+  for (size_t i = 0; i < 5; i++)
+    {
+      for (size_t j = 0; j < 3; j++)
+        {
+          mem[i] = buddy_realloc(&pool, mem[i], sizes[j]);
+          assert(mem[i] != NULL);
+          assert(((uintptr_t)mem[i] & (alignments[i] - 1)) == 0);
+          assert(((unsigned char *)mem[i])[0] == 0xff && ((unsigned char *)mem[i])[39] == 0xff);
+        }
+    }
+  void *line = buddy_realloc(&pool, buddy_malloc_exclusive(&pool, 8), 200);
+  assert(line != NULL && ((uintptr_t)line & (BUDDY_CACHE_LINE - 1)) == 0);
+  buddy_free(&pool, line);
+
+  for (size_t i = 0; i < 5; i++)
+    {
+      buddy_free(&pool, mem[i]);
+    }
+  //Freeing an aligned pointer twice is ignored just like a plain one
+  buddy_free(&pool, mem[4]);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_shared_cross_process(void)
+{
+  fprintf(stderr, "->Testing shared pool across processes\n");
+  struct buddy_shared pool;
+  int rval = buddy_shared_create(&pool, NULL, UINT64_C(1) << MIN_K);
+  assert(rval == 0);
+
+  int fds[2];
+  rval = pipe(fds);
+  assert(rval == 0);
+
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0)
+    {
+      //Map the pool again so it lands at a different address than the one
+      //inherited over fork, then hand a buffer back by offset
+      struct buddy_shared child;
+      if (buddy_shared_attach(&child, pool.fd) != 0)
+        _exit(1);
+      char *msg = buddy_shared_malloc(&child, 64);
+      if (!msg || (void *)child.hdr == (void *)pool.hdr)
+        _exit(2);
+      strcpy(msg, "hello from the child");
+      uint64_t off = buddy_shared_offset(&child, msg);
+      if (write(fds[1], &off, sizeof(off)) != sizeof(off))
+        _exit(3);
+      buddy_shared_close(&child);
+      _exit(0);
+    }
+
+  uint64_t off = 0;
+  ssize_t got = read(fds[0], &off, sizeof(off));
+  assert(got == sizeof(off));
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  close(fds[0]);
+  close(fds[1]);
+
+  char *msg = buddy_shared_ptr(&pool, off);
+  assert(msg != NULL);
+  assert(strcmp(msg, "hello from the child") == 0);
+  buddy_shared_free(&pool, msg);
+
+  //With the only allocation gone the pool is back to a single block
+  struct shared_header *hdr = pool.hdr;
+  assert(hdr->avail[hdr->kval_m].next == hdr->data);
+  for (size_t i = 0; i < hdr->kval_m; i++)
+    {
+      assert(hdr->avail[i].next == hdr->avail[i].prev);
+    }
+
+  //Foreign descriptors are rejected
+  struct buddy_shared bad;
+  rval = buddy_shared_attach(&bad, fds[0]);
+  assert(rval == -1);
+
+  buddy_shared_close(&pool);
+}
+
+/**
+ * Fork a child that takes the pool lock and lets damage break the pool the
+ * way a crash in the middle of a malloc or free would, then kill it while it
+ * still holds the lock.
+ */
+static void kill_holding_lock(struct buddy_shared *pool, void (*damage)(struct shared_header *hdr))
+{
+  int fds[2];
+  assert(pipe(fds) == 0);
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0)
+    {
+      pthread_mutex_lock(&pool->hdr->lock);
+      damage(pool->hdr);
+      if (write(fds[1], "", 1) != 1)
+        _exit(1);
+      for (;;)
+        pause();
+    }
+  char ready;
+  assert(read(fds[0], &ready, 1) == 1);
+  kill(pid, SIGKILL);
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static void unlink_half(struct shared_header *hdr)
+{
+  //The block is off the head of its list but still points back at it
+  size_t k = hdr->kval_m;
+  hdr->avail[k].next = offsetof(struct shared_header, avail) + k * sizeof(struct shared_avail);
+}
+
+static void break_header(struct shared_header *hdr)
+{
+  ((struct shared_avail *)((uint8_t *)hdr + hdr->data))->kval = 2;
+}
+
+void test_buddy_shared_owner_dead(void)
+{
+  fprintf(stderr, "->Testing shared pool lock owner dying\n");
+  struct buddy_shared pool;
+  assert(buddy_shared_create(&pool, NULL, UINT64_C(1) << MIN_K) == 0);
+
+  //The next lock rebuilds the lists and the pool works as before
+  kill_holding_lock(&pool, unlink_half);
+  char *mem = buddy_shared_malloc(&pool, 100);
+  assert(mem != NULL);
+  assert(buddy_shared_check(&pool) == 0);
+  assert(buddy_shared_free(&pool, mem) == 0);
+  assert(pool.hdr->avail[pool.hdr->kval_m].next == pool.hdr->data);
+
+  //Damaged headers can not be rebuilt from, so the pool is given up on
+  kill_holding_lock(&pool, break_header);
+  assert(buddy_shared_malloc(&pool, 100) == NULL);
+  assert(errno == EIO);
+  assert(buddy_shared_malloc(&pool, 100) == NULL);
+  assert(errno == ENOTRECOVERABLE);
+  assert(buddy_shared_free(&pool, (uint8_t *)pool.hdr + pool.hdr->data + 64) == -1);
+  assert(errno == ENOTRECOVERABLE);
+  buddy_shared_close(&pool);
+}
+
+void test_buddy_shared_named(void)
+{
+  fprintf(stderr, "->Testing named shared pool\n");
+  char name[64];
+  snprintf(name, sizeof(name), "/buddy-test-%ld", (long)getpid());
+
+  struct buddy_shared a, b;
+  int rval = buddy_shared_create(&a, name, UINT64_C(1) << MIN_K);
+  assert(rval == 0);
+  rval = buddy_shared_open(&b, name);
+  assert(rval == 0);
+
+  //Allocate through one handle and free through the other
+  void *mem = buddy_shared_malloc(&a, 1000);
+  assert(mem != NULL);
+  void *same = buddy_shared_ptr(&b, buddy_shared_offset(&a, mem));
+  buddy_shared_free(&b, same);
+  assert(a.hdr->avail[a.hdr->kval_m].next == a.hdr->data);
+
+  buddy_shared_close(&b);
+  buddy_shared_close(&a);
+  rval = buddy_shared_unlink(name);
+  assert(rval == 0);
+  rval = buddy_shared_open(&b, name);
+  assert(rval == -1);
+}
+
+void test_buddy_shared_persistent(void)
+{
+  fprintf(stderr, "->Testing persistent file backed pool\n");
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/buddy-test-%ld.pool", (long)getpid());
+  unlink(path);
+
+  struct buddy_shared pool;
+  int rval = buddy_shared_open_file(&pool, path, UINT64_C(1) << MIN_K);
+  assert(rval == 0);
+  char *a = buddy_shared_malloc(&pool, 100);
+  char *b = buddy_shared_malloc(&pool, 5000);
+  char *c = buddy_shared_malloc(&pool, 100);
+  assert(a && b && c);
+  strcpy(a, "first");
+  strcpy(b, "second");
+  buddy_shared_free(&pool, c);
+  uint64_t off_a = buddy_shared_offset(&pool, a);
+  uint64_t off_b = buddy_shared_offset(&pool, b);
+  assert(buddy_shared_root_get(&pool) == NULL);
+  assert(buddy_shared_root_set(&pool, &rval) == -1 && errno == EINVAL);
+  assert(buddy_shared_root_set(&pool, b) == 0);
+  rval = buddy_shared_sync(&pool);
+  assert(rval == 0);
+  buddy_shared_close(&pool);
+
+  //Reopening finds both allocations right where they were, and the root
+  rval = buddy_shared_open_file(&pool, path, 0);
+  assert(rval == 0);
+  assert(buddy_shared_check(&pool) == 0);
+  assert(strcmp(buddy_shared_root_get(&pool), "second") == 0);
+  a = buddy_shared_ptr(&pool, off_a);
+  b = buddy_shared_ptr(&pool, off_b);
+  assert(strcmp(a, "first") == 0);
+  assert(strcmp(b, "second") == 0);
+
+  //Break a free list the way a crash in the middle of a free would
+  struct shared_header *hdr = pool.hdr;
+  uint64_t head = offsetof(struct shared_header, avail);
+  size_t k = 0;
+  while (hdr->avail[k].next == head + k * sizeof(struct shared_avail))
+    k++;
+  uint64_t saved = hdr->avail[k].next;
+  hdr->avail[k].next = head + k * sizeof(struct shared_avail);
+  assert(buddy_shared_check(&pool) == -1);
+  assert(errno == EIO);
+  hdr->avail[k].next = saved;
+  hdr->avail[k + 1].next = hdr->avail[k + 1].prev = 0;
+  buddy_shared_close(&pool);
+
+  //The next open rebuilds the lists from the block headers
+  rval = buddy_shared_open_file(&pool, path, 0);
+  assert(rval == 0);
+  assert(buddy_shared_check(&pool) == 0);
+  a = buddy_shared_ptr(&pool, off_a);
+  b = buddy_shared_ptr(&pool, off_b);
+  assert(strcmp(a, "first") == 0);
+  buddy_shared_free(&pool, a);
+  buddy_shared_free(&pool, b);
+  assert(pool.hdr->avail[pool.hdr->kval_m].next == pool.hdr->data);
+  buddy_shared_close(&pool);
+
+  //Damaged block headers can not be recovered
+  rval = buddy_shared_open_file(&pool, path, 0);
+  assert(rval == 0);
+  ((struct shared_avail *)((uint8_t *)pool.hdr + pool.hdr->data))->kval = 2;
+  buddy_shared_close(&pool);
+  rval = buddy_shared_open_file(&pool, path, 0);
+  assert(rval == -1);
+  assert(errno == EIO);
+
+  //A header whose size does not match its order is not a pool of ours
+  unlink(path);
+  rval = buddy_shared_open_file(&pool, path, UINT64_C(1) << MIN_K);
+  assert(rval == 0);
+  pool.hdr->numbytes /= 2;
+  pool.hdr->data += pool.hdr->numbytes;
+  buddy_shared_close(&pool);
+  rval = buddy_shared_open_file(&pool, path, 0);
+  assert(rval == -1);
+  assert(errno == EINVAL);
+
+  //A crash between sizing the file and writing the magic leaves zeros, which
+  //the next open formats again
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  off_t maplen = (off_t)(((sizeof(struct shared_header) + page - 1) & ~(page - 1)) + (UINT64_C(1) << MIN_K));
+  int fd = open(path, O_RDWR | O_TRUNC);
+  assert(fd != -1);
+  assert(ftruncate(fd, maplen) == 0);
+  close(fd);
+  rval = buddy_shared_open_file(&pool, path, UINT64_C(1) << MIN_K);
+  assert(rval == 0);
+  assert(buddy_shared_check(&pool) == 0 && buddy_shared_root_get(&pool) == NULL);
+  buddy_shared_close(&pool);
+
+  //Zeros of any other size, or anything else, are not ours to overwrite
+  fd = open(path, O_RDWR | O_TRUNC);
+  assert(fd != -1);
+  assert(ftruncate(fd, maplen / 2) == 0);
+  close(fd);
+  rval = buddy_shared_open_file(&pool, path, UINT64_C(1) << MIN_K);
+  assert(rval == -1);
+  assert(errno == EINVAL);
+  FILE *fp = fopen(path, "w");
+  assert(fp != NULL && fputs("not a pool", fp) >= 0);
+  fclose(fp);
+  rval = buddy_shared_open_file(&pool, path, UINT64_C(1) << MIN_K);
+  assert(rval == -1);
+  assert(errno == EINVAL);
+  struct stat st;
+  assert(stat(path, &st) == 0 && st.st_size == 10);
+  unlink(path);
+}
+
+void test_buddy_asan_annotations(void)
+{
+  fprintf(stderr, "->Testing sanitizer annotations\n");
+#ifdef __SANITIZE_ADDRESS__
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  //Only the requested bytes are usable, the rest of the block is not
+  uint8_t *mem = buddy_malloc(&pool, 100);
+  assert(!__asan_address_is_poisoned(mem));
+  assert(!__asan_address_is_poisoned(mem + 99));
+  assert(__asan_address_is_poisoned(mem + 100));
+  assert(!__asan_address_is_poisoned((struct avail *)mem - 1));
+
+  //The buddies left behind by the split expose their header only
+  struct avail *buddy = pool.avail[SMALLEST_K + 1].next;
+  assert(!__asan_address_is_poisoned(buddy));
+  assert(__asan_address_is_poisoned((uint8_t *)buddy + HEADER_SIZE));
+
+  //After a free the user memory is gone
+  buddy_free(&pool, mem);
+  assert(__asan_address_is_poisoned(mem));
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+#else
+  TEST_IGNORE_MESSAGE("build with make debug to check the AddressSanitizer annotations");
+#endif
+}
+
+void test_buddy_realloc(void)
+{
+  fprintf(stderr, "->Testing realloc in place and with a move\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  //NULL acts like malloc and a zero size like free
+  char *mem = buddy_realloc(&pool, NULL, 100);
+  assert(mem != NULL);
+  for (int i = 0; i < 100; i++)
+    mem[i] = (char)i;
+
+  //Growing into the free upper buddies keeps the pointer
+  char *grown = buddy_realloc(&pool, mem, 1000);
+  assert(grown == mem);
+  for (int i = 0; i < 100; i++)
+    assert(grown[i] == (char)i);
+
+  //Shrinking always stays in place
+  char *shrunk = buddy_realloc(&pool, grown, 50);
+  assert(shrunk == mem);
+
+  //Block the upper buddy so the next grow has to move
+  void *blocker = buddy_malloc(&pool, 100);
+  assert(blocker != NULL);
+  char *moved = buddy_realloc(&pool, shrunk, 4000);
+  assert(moved != NULL && moved != shrunk);
+  for (int i = 0; i < 50; i++)
+    assert(moved[i] == (char)i);
+
+  //Too big fails and leaves the old block alone
+  assert(buddy_realloc(&pool, moved, pool.numbytes) == NULL);
+  assert(errno == ENOMEM);
+  assert(moved[10] == 10);
+
+  assert(buddy_realloc(&pool, moved, 0) == NULL);
+  buddy_free(&pool, blocker);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_trace(void)
+{
+  fprintf(stderr, "->Testing allocation trace recording\n");
+  char path[] = "/tmp/buddy-trace-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  assert(buddy_trace_start(&pool, path) == 0);
+  assert(buddy_trace_start(&pool, path) == -1);
+  assert(errno == EBUSY);
+
+  void *a = buddy_malloc(&pool, 100);
+  void *b = buddy_malloc(&pool, pool.numbytes);
+  assert(b == NULL);
+  void *c = buddy_realloc(&pool, a, 200);
+  buddy_free(&pool, c);
+  assert(buddy_trace_stop(&pool) == 0);
+  //Not recorded anymore
+  buddy_free(&pool, buddy_malloc(&pool, 10));
+  buddy_destroy(&pool);
+
+  FILE *fp = fopen(path, "rb");
+  assert(fp != NULL);
+  struct trace_file_header hdr;
+  assert(fread(&hdr, sizeof(hdr), 1, fp) == 1);
+  assert(memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0);
+  assert(hdr.version == TRACE_VERSION);
+  assert(hdr.record_size == sizeof(struct trace_record));
+  assert(hdr.kval_m == MIN_K);
+
+  struct trace_record rec[5];
+  assert(fread(rec, sizeof(rec[0]), 5, fp) == 4);
+  fclose(fp);
+  unlink(path);
+
+  assert(rec[0].op == TRACE_MALLOC && rec[0].size == 100 && rec[0].id != 0);
+  assert(rec[1].op == TRACE_MALLOC && rec[1].id == 0);
+  assert(rec[2].op == TRACE_REALLOC && rec[2].old_id == rec[0].id && rec[2].size == 200);
+  assert(rec[3].op == TRACE_FREE && rec[3].id == rec[2].id);
+  for (int i = 1; i < 4; i++)
+    assert(rec[i].ts >= rec[i - 1].ts && rec[i].thread == rec[0].thread);
+}
+
+/*Not inlined so the profile has a call site of its own to attribute bytes to*/
+__attribute__((noinline)) static void *profiled_alloc(struct buddy_pool *pool, size_t size)
+{
+  return buddy_malloc(pool, size);
+}
+
+void test_buddy_profile(void)
+{
+  fprintf(stderr, "->Testing the sampling heap profiler\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  //A period of one byte samples every allocation
+  assert(buddy_profile_start(&pool, 1) == 0);
+  assert(buddy_profile_start(&pool, 1) == -1);
+  assert(errno == EBUSY);
+
+  void *mem[4];
+  for (int i = 0; i < 4; i++)
+    {
+      mem[i] = profiled_alloc(&pool, 100);
+      assert(mem[i] != NULL);
+      assert(((struct avail *)mem[i] - 1)->flags & BLOCK_SAMPLED);
+    }
+  buddy_free(&pool, mem[0]);
+  mem[1] = buddy_realloc(&pool, mem[1], 300);
+
+  FILE *out = tmpfile();
+  assert(out != NULL);
+  assert(buddy_profile_dump(&pool, out) == 0);
+  rewind(out);
+  size_t live_objs, live_bytes, alloc_objs, alloc_bytes, period;
+  assert(fscanf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu", &live_objs, &live_bytes, &alloc_objs,
+                &alloc_bytes, &period) == 5);
+  assert(live_objs == 3 && live_bytes == 500);
+  assert(alloc_objs == 5 && alloc_bytes == 700);
+  assert(period == 1);
+
+  //All four mallocs share one stack, the realloc has its own
+  char line[4096];
+  int stacks = 0;
+  while (fgets(line, sizeof(line), out) && strcmp(line, "MAPPED_LIBRARIES:\n") != 0)
+    {
+      size_t objs, bytes;
+      if (sscanf(line, "%zu: %zu [", &objs, &bytes) == 2)
+        {
+          assert(strstr(line, "@ 0x") != NULL);
+          stacks++;
+        }
+    }
+  assert(stacks == 2);
+  fclose(out);
+
+  for (int i = 1; i < 4; i++)
+    {
+      buddy_free(&pool, mem[i]);
+    }
+  assert(buddy_profile_stop(&pool) == 0);
+  assert(buddy_profile_dump(&pool, stderr) == -1);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+#ifdef BUDDY_LATENCY
+/**
+ * Time one whole block malloc and free on a thread of its own.
+ */
+static void *latency_thread_work(void *arg)
+{
+  struct buddy_pool *pool = arg;
+  buddy_free(pool, buddy_malloc_order(pool, MIN_K));
+  return NULL;
+}
+#endif
+
+void test_buddy_latency(void)
+{
+  fprintf(stderr, "->Testing latency histograms\n");
+  //Bucket floors are increasing and never more than 12.5% apart past the linear part
+  for (size_t b = 1; b < LATENCY_BUCKETS; b++)
+    {
+      uint64_t lo = buddy_latency_bucket_floor(b - 1), hi = buddy_latency_bucket_floor(b);
+      assert(hi > lo);
+      assert(b <= (1u << LATENCY_SUB_BITS) || (hi - lo) * 8 <= lo);
+    }
+
+  struct buddy_latency_snapshot *snap = malloc(sizeof(struct buddy_latency_snapshot));
+  assert(snap != NULL);
+#ifdef BUDDY_LATENCY
+  buddy_latency_reset();
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  //The first malloc splits all the way down, the free merges all the way up
+  void *mem = buddy_malloc(&pool, 1);
+  buddy_free(&pool, mem);
+  mem = buddy_malloc_order(&pool, MIN_K);
+  buddy_free(&pool, mem);
+  //The counts of a thread outlive it
+  pthread_t thread;
+  assert(pthread_create(&thread, NULL, latency_thread_work, &pool) == 0);
+  assert(pthread_join(thread, NULL) == 0);
+  buddy_destroy(&pool);
+
+  assert(buddy_latency_snapshot(snap) == 0);
+  assert(snap->ticks_per_ns > 0);
+  int deepest = MIN_K - SMALLEST_K < LATENCY_LEVELS ? MIN_K - SMALLEST_K : LATENCY_LEVELS - 1;
+  uint64_t splits = 0, merges = 0, whole = 0;
+  for (size_t b = 0; b < LATENCY_BUCKETS; b++)
+    {
+      splits += snap->counts[LATENCY_MALLOC][deepest][b];
+      merges += snap->counts[LATENCY_FREE][deepest][b];
+      whole += snap->counts[LATENCY_MALLOC][0][b] + snap->counts[LATENCY_FREE][0][b];
+    }
+  assert(splits == 1 && merges == 1 && whole == 4);
+  assert(buddy_latency_quantile(snap, LATENCY_MALLOC, -1, 0.5) > 0);
+  assert(buddy_latency_quantile(snap, LATENCY_REALLOC, -1, 0.5) == 0);
+#else
+  assert(buddy_latency_snapshot(snap) == -1);
+  assert(errno == ENOSYS);
+#endif
+  free(snap);
+}
+
+void test_buddy_dump_map(void)
+{
+  fprintf(stderr, "->Testing the heap map dump\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  void *small = buddy_malloc(&pool, 1);
+  void *large = buddy_malloc(&pool, (UINT64_C(1) << (MIN_K - 2)) - HEADER_SIZE);
+  assert(small != NULL && large != NULL);
+
+  FILE *out = tmpfile();
+  assert(out != NULL);
+  assert(buddy_dump_map(&pool, out) == 0);
+  rewind(out);
+  struct heapmap_header hdr;
+  assert(fread(&hdr, sizeof(hdr), 1, out) == 1);
+  assert(memcmp(hdr.magic, HEAPMAP_MAGIC, sizeof(HEAPMAP_MAGIC)) == 0);
+  assert(hdr.kval_m == MIN_K);
+
+  //The small block split the pool all the way down leaving one block per level,
+  //the large one took the free block of its order
+  assert(hdr.blocks == MIN_K - SMALLEST_K + 1);
+  uint8_t entries[64];
+  assert(fread(entries, 1, (size_t)hdr.blocks, out) == hdr.blocks);
+  assert(fgetc(out) == EOF);
+  fclose(out);
+
+  uint64_t total = 0, reserved = 0;
+  for (size_t i = 0; i < hdr.blocks; i++)
+    {
+      uint64_t size = UINT64_C(1) << (entries[i] & HEAPMAP_KVAL_MASK);
+      total += size;
+      if (entries[i] & HEAPMAP_RESERVED)
+        reserved += size;
+    }
+  assert(total == pool.numbytes);
+  assert(entries[0] == (HEAPMAP_RESERVED | SMALLEST_K));
+  assert(reserved == (UINT64_C(1) << SMALLEST_K) + (UINT64_C(1) << (MIN_K - 2)));
+
+  //A damaged header is reported and nothing is written
+  out = tmpfile();
+  unsigned short kval = ((struct avail *)large - 1)->kval;
+  ((struct avail *)large - 1)->kval = MIN_K + 1;
+  assert(buddy_dump_map(&pool, out) == -1);
+  assert(errno == EIO);
+  assert(ftell(out) == 0);
+  ((struct avail *)large - 1)->kval = kval;
+  fclose(out);
+
+  buddy_free(&pool, small);
+  buddy_free(&pool, large);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_handles_compact(void)
+{
+  fprintf(stderr, "->Testing handles and compaction\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  //Fill the pool with 1KiB blocks and free every other one
+  size_t n = UINT64_C(1) << (MIN_K - 10);
+  buddy_handle *h = malloc(n * sizeof(buddy_handle));
+  assert(h != NULL);
+  for (size_t i = 0; i < n; i++)
+    {
+      h[i] = buddy_halloc(&pool, 1024 - HEADER_SIZE);
+      assert(h[i] != 0);
+      size_t *mem = buddy_hpin(&pool, h[i]);
+      assert(mem != NULL);
+      mem[0] = i;
+      buddy_hunpin(&pool, h[i]);
+    }
+  assert(buddy_halloc(&pool, 1) == 0);
+  for (size_t i = 1; i < n; i += 2)
+    {
+      buddy_hfree(&pool, h[i]);
+    }
+  assert(buddy_hpin(&pool, h[1]) == NULL);
+  assert(errno == EINVAL);
+
+  //Half the pool is free but none of it is contiguous
+  size_t half = pool.numbytes / 2 - HEADER_SIZE;
+  assert(buddy_malloc(&pool, half) == NULL);
+
+  //A pinned block stays put and keeps the upper half from coalescing
+  void *pinned = buddy_hpin(&pool, h[n - 2]);
+  assert(buddy_compact(&pool, 0) == 1);
+  while (buddy_compact(&pool, UINT64_C(1000000000)) > 0)
+    ;
+  assert(buddy_hpin(&pool, h[n - 2]) == pinned);
+  buddy_hunpin(&pool, h[n - 2]);
+  assert(buddy_malloc(&pool, half) == NULL);
+
+  buddy_hunpin(&pool, h[n - 2]);
+  assert(buddy_compact(&pool, UINT64_C(1000000000)) == 1);
+  void *big = buddy_malloc(&pool, half);
+  assert(big != NULL);
+
+  //Everything moved with its contents
+  for (size_t i = 0; i < n; i += 2)
+    {
+      size_t *mem = buddy_hpin(&pool, h[i]);
+      assert(mem != NULL && mem[0] == i);
+      assert((uint8_t *)mem < (uint8_t *)big);
+      buddy_hunpin(&pool, h[i]);
+      buddy_hfree(&pool, h[i]);
+    }
+  buddy_free(&pool, big);
+  free(h);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * The largest order with a free block, 0 if the pool is full.
+ */
+static size_t largest_free_kval(struct buddy_pool *pool)
+{
+  for (size_t k = pool->kval_m + 1; k-- > 0;)
+    {
+      if (pool->avail[k].next != &pool->avail[k])
+        {
+          return k;
+        }
+    }
+  return 0;
+}
+
+void test_buddy_compact_keeps_largest(void)
+{
+  fprintf(stderr, "->Testing compaction never shrinks the largest free block\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  //The lower half is one free block below a half of 1KiB handles with holes
+  void *big = buddy_malloc(&pool, pool.numbytes / 2 - HEADER_SIZE);
+  assert(big != NULL);
+  size_t n = UINT64_C(1) << (MIN_K - 11);
+  buddy_handle *h = malloc(n * sizeof(buddy_handle));
+  assert(h != NULL);
+  for (size_t i = 0; i < n; i++)
+    {
+      h[i] = buddy_halloc(&pool, 1024 - HEADER_SIZE);
+      assert(h[i] != 0);
+    }
+  buddy_free(&pool, big);
+  for (size_t i = 1; i < n; i += 2)
+    {
+      buddy_hfree(&pool, h[i]);
+    }
+  assert(largest_free_kval(&pool) == MIN_K - 1);
+
+  //Moving a handle into the lower half would split it; every move is
+  //into a hole instead
+  size_t largest = largest_free_kval(&pool);
+  size_t moves = 0;
+  size_t moved;
+  while ((moved = buddy_compact(&pool, 0)) > 0)
+    {
+      moves += moved;
+      assert(largest_free_kval(&pool) >= largest);
+      largest = largest_free_kval(&pool);
+    }
+  assert(moves > 0);
+  assert(pool.avail[MIN_K - 1].next != &pool.avail[MIN_K - 1]);
+
+  for (size_t i = 0; i < n; i += 2)
+    {
+      buddy_hfree(&pool, h[i]);
+    }
+  free(h);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_packed(void)
+{
+  fprintf(stderr, "->Testing packed headers\n");
+  assert(PACKED_HEADER_SIZE == 8);
+  struct buddy_packed pool;
+  assert(buddy_packed_init(&pool, 0, PACKED_MIN_K - 1) == -1);
+  assert(errno == EINVAL);
+  assert(buddy_packed_init(&pool, UINT64_C(1) << MIN_K, PACKED_MIN_K) == 0);
+  assert(pool.avail[MIN_K] == 0);
+
+  //Eight bytes fit a 16 byte block, nine need 32
+  uint8_t *a = buddy_packed_malloc(&pool, 8);
+  uint8_t *b = buddy_packed_malloc(&pool, 8);
+  uint8_t *c = buddy_packed_malloc(&pool, 9);
+  assert(a != NULL && b != NULL && c != NULL);
+  assert(b - a == 16 && c - b == 16);
+  assert(((uintptr_t)a & 7) == 0);
+  memset(a, 0xaa, 8);
+  memset(b, 0xbb, 8);
+  memset(c, 0xcc, 9);
+  buddy_packed_free(&pool, b);
+  buddy_packed_free(&pool, b);
+  buddy_packed_free(&pool, a);
+  buddy_packed_free(&pool, c);
+  assert(pool.avail[MIN_K] == 0);
+  for (size_t k = 0; k < MIN_K; k++)
+    assert(pool.avail[k] == PACKED_NIL);
+
+  //The whole pool in minimum blocks, then back to a single block
+  size_t n = pool.numbytes >> PACKED_MIN_K;
+  void **mem = malloc(n * sizeof(void *));
+  assert(mem != NULL);
+  for (size_t i = 0; i < n; i++)
+    {
+      mem[i] = buddy_packed_malloc(&pool, 1);
+      assert(mem[i] != NULL);
+    }
+  assert(buddy_packed_malloc(&pool, 1) == NULL);
+  assert(errno == ENOMEM);
+  for (size_t i = 0; i < n; i += 2)
+    buddy_packed_free(&pool, mem[i]);
+  for (size_t i = 1; i < n; i += 2)
+    buddy_packed_free(&pool, mem[i]);
+  assert(pool.avail[MIN_K] == 0);
+  free(mem);
+
+  assert(buddy_packed_malloc(&pool, pool.numbytes) == NULL);
+  void *all = buddy_packed_malloc(&pool, pool.numbytes - PACKED_HEADER_SIZE);
+  assert(all != NULL);
+  buddy_packed_free(&pool, all);
+  buddy_packed_destroy(&pool);
+}
+
+void test_buddy_init_opts(void)
+{
+  fprintf(stderr, "->Testing per pool order limits\n");
+  struct buddy_pool pool;
+  struct buddy_options bad = {.size = 0, .min_k = SMALLEST_K - 1};
+  assert(buddy_init_opts(&pool, &bad) == -1);
+  assert(errno == EINVAL);
+  bad.min_k = 0;
+  bad.size = UINT64_C(1) << MAX_K;
+  assert(buddy_init_opts(&pool, &bad) == -1);
+  assert(errno == EINVAL);
+
+  //A 64KiB pool with no 1MiB floor and 256 byte minimum blocks
+  struct buddy_options opts = {.size = 60000, .min_k = 8};
+  assert(buddy_init_opts(&pool, &opts) == 0);
+  assert(pool.kval_m == 16 && pool.numbytes == 65536 && pool.min_k == 8);
+  check_buddy_pool_full(&pool);
+
+  assert(buddy_malloc_order(&pool, 7) == NULL);
+  size_t n = pool.numbytes >> 8;
+  void **mem = malloc(n * sizeof(void *));
+  assert(mem != NULL);
+  for (size_t i = 0; i < n; i++)
+    {
+      mem[i] = buddy_malloc(&pool, 1);
+      assert(mem[i] != NULL);
+    }
+  assert(buddy_malloc(&pool, 1) == NULL);
+  assert((uint8_t *)mem[1] - (uint8_t *)mem[0] == 256);
+  for (size_t i = 0; i < n; i++)
+    {
+      buddy_free(&pool, mem[i]);
+    }
+  free(mem);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+
+  //A pool can be a single block
+  opts.size = 1;
+  opts.min_k = 0;
+  assert(buddy_init_opts(&pool, &opts) == 0);
+  assert(pool.kval_m == SMALLEST_K);
+  void *one = buddy_malloc(&pool, (UINT64_C(1) << SMALLEST_K) - HEADER_SIZE);
+  assert(one != NULL);
+  buddy_free(&pool, one);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_init_in(void)
+{
+  fprintf(stderr, "->Testing child pools carved from a parent\n");
+  struct buddy_pool parent;
+  buddy_init(&parent, 0);
+  struct buddy_pool child;
+  assert(buddy_init_in(&child, &parent, parent.numbytes) == -1);
+  assert(errno == ENOMEM);
+
+  //The lead costs a little so 40000 bytes still fit in 64KiB
+  assert(buddy_init_in(&child, &parent, 40000) == 0);
+  assert(child.kval_m == 16 && child.parent == &parent && child.lead != 0);
+  assert((uint8_t *)child.base >= (uint8_t *)parent.base);
+  assert((uint8_t *)child.base + child.numbytes <= (uint8_t *)parent.base + parent.numbytes);
+
+  //Everything after the lead can be handed out as one block per order
+  void *big = buddy_malloc_order(&child, child.kval_m - 1);
+  assert(big != NULL);
+  assert((uint8_t *)big - HEADER_SIZE == (uint8_t *)child.base + child.numbytes / 2);
+  assert(buddy_malloc_order(&child, child.kval_m - 1) == NULL);
+  buddy_free(&child, big);
+
+  //Freed blocks merge back up to the lead and no further
+  size_t n = 64;
+  void **mem = malloc(n * sizeof(void *));
+  assert(mem != NULL);
+  for (size_t i = 0; i < n; i++)
+    {
+      mem[i] = buddy_malloc(&child, 100);
+      assert(mem[i] != NULL);
+      assert((uint8_t *)mem[i] >= (uint8_t *)child.base + child.lead);
+    }
+  for (size_t i = 0; i < n; i++)
+    {
+      buddy_free(&child, mem[i]);
+    }
+  for (size_t i = 0; i < child.kval_m; i++)
+    {
+      if ((UINT64_C(1) << i) < child.lead)
+        assert(child.avail[i].next == &child.avail[i]);
+      else
+        assert(child.avail[i].next != &child.avail[i]);
+    }
+  assert(child.avail[child.kval_m].next == &child.avail[child.kval_m]);
+
+  //Memory of the parent is not the child's to free
+  buddy_free(&child, child.avail);
+
+  //Tearing down with live allocations gives the parent everything back
+  for (size_t i = 0; i < n; i++)
+    {
+      mem[i] = buddy_malloc(&child, 100);
+      assert(mem[i] != NULL);
+    }
+  free(mem);
+  buddy_destroy(&child);
+  check_buddy_pool_full(&parent);
+  buddy_destroy(&parent);
+}
+
+void test_buddy_reset(void)
+{
+  fprintf(stderr, "->Testing pool reset\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, 0);
+  assert(buddy_reset(NULL, 0) == -1);
+  assert(errno == EINVAL);
+
+  for (int i = 0; i < 100; i++)
+    {
+      assert(buddy_malloc(&pool, (size_t)(rand() % 5000) + 1) != NULL);
+    }
+  buddy_handle h = buddy_halloc(&pool, 100);
+  assert(h != 0);
+  assert(buddy_reset(&pool, BUDDY_RESET_KEEP) == 0);
+  check_buddy_pool_full(&pool);
+  assert(buddy_hpin(&pool, h) == NULL);
+  assert(buddy_halloc(&pool, 100) != 0);
+
+  //The upper half keeps its contents unless it is released
+  size_t half = pool.kval_m - 1;
+  size_t len = (UINT64_C(1) << half) - HEADER_SIZE;
+  assert(buddy_reset(&pool, BUDDY_RESET_KEEP) == 0);
+  uint8_t *lower = buddy_malloc_order(&pool, half);
+  uint8_t *upper = buddy_malloc_order(&pool, half);
+  assert(lower != NULL && upper != NULL);
+  memset(lower, 0xab, len);
+  memset(upper, 0xab, len);
+  assert(buddy_reset(&pool, BUDDY_RESET_KEEP) == 0);
+  assert(buddy_malloc_order(&pool, half) == lower);
+  assert(buddy_malloc_order(&pool, half) == upper);
+  assert(upper[len - 1] == 0xab);
+
+  //Keeping the lower half releases only the upper one
+  assert(buddy_reset(&pool, pool.numbytes / 2) == 0);
+  check_buddy_pool_full(&pool);
+  assert(buddy_malloc_order(&pool, half) == lower);
+  assert(lower[len - 1] == 0xab);
+  assert(buddy_malloc_order(&pool, half) == upper);
+  assert(upper[len - 1] == 0 && upper[len / 2] == 0);
+  assert(buddy_reset(&pool, 0) == 0);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_trim(void)
+{
+  fprintf(stderr, "->Testing tail trimming\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = {.size = UINT64_C(1) << 20, .trim_k = SMALLEST_K};
+  assert(buddy_init_opts(&pool, &opts) == -1);
+  assert(errno == EINVAL);
+  opts.trim_k = 12;
+  assert(buddy_init_opts(&pool, &opts) == 0);
+
+  //Just over a quarter of the pool takes a half but keeps only what it needs
+  size_t size = (UINT64_C(1) << 18) + 1;
+  uint8_t *big = buddy_malloc(&pool, size);
+  assert(big != NULL);
+  struct avail *block = (struct avail *)big - 1;
+  assert(block->kval == 19 && (block->flags & BLOCK_TRIMMED));
+  assert(buddy_block_span(&pool, block) == (UINT64_C(1) << 18) + 64);
+  memset(big, 0x11, size);
+
+  //The trimmed tail is handed out again and never merges into big
+  void *mem[24];
+  size_t n = 0;
+  for (size_t k = 17; k >= SMALLEST_K; k--)
+    {
+      mem[n] = buddy_malloc_order(&pool, k);
+      assert(mem[n] != NULL);
+      assert((uint8_t *)mem[n] > big && (uint8_t *)mem[n] < big + (UINT64_C(1) << 19));
+      memset(mem[n], 0x22, (UINT64_C(1) << k) - HEADER_SIZE);
+      n++;
+    }
+  assert(buddy_malloc_order(&pool, 19) != NULL);
+  assert(buddy_malloc(&pool, 1) == NULL);
+  for (size_t i = 0; i < n; i += 2)
+    {
+      buddy_free(&pool, mem[i]);
+    }
+  for (size_t i = 0; i < size; i++)
+    {
+      assert(big[i] == 0x11);
+    }
+
+  FILE *fp = tmpfile();
+  assert(fp != NULL);
+  assert(buddy_dump_map(&pool, fp) == 0);
+  fclose(fp);
+
+  //Freed out of order the pieces still come back together
+  buddy_free(&pool, big);
+  for (size_t i = 1; i < n; i += 2)
+    {
+      buddy_free(&pool, mem[i]);
+    }
+  buddy_free(&pool, (uint8_t *)pool.base + (UINT64_C(1) << 19) + HEADER_SIZE);
+  check_buddy_pool_full(&pool);
+
+  //Realloc moves trimmed blocks and trims the new one
+  big = buddy_malloc(&pool, size);
+  uint8_t *grown = buddy_realloc(&pool, big, size + 4096);
+  assert(grown != NULL && grown != big);
+  assert(((struct avail *)grown - 1)->flags & BLOCK_TRIMMED);
+  buddy_free(&pool, grown);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_fibonacci(void)
+{
+  fprintf(stderr, "->Testing Fibonacci size classes\n");
+  struct buddy_fib pool;
+  assert(buddy_fib_init(&pool, UINT64_C(1) << MAX_K) == -1);
+  assert(errno == EINVAL);
+  assert(buddy_fib_init(&pool, UINT64_C(1) << 20) == 0);
+  assert(pool.numbytes >= (UINT64_C(1) << 20) && pool.numbytes < (UINT64_C(1) << 20) * 2);
+  for (size_t c = 2; c <= pool.class_m; c++)
+    assert(pool.sizes[c] == pool.sizes[c - 1] + pool.sizes[c - 2]);
+
+  //150 bytes take a 192 byte block where the binary engine needs 256
+  uint8_t *a = buddy_fib_malloc(&pool, 150);
+  uint8_t *b = buddy_fib_malloc(&pool, 150);
+  assert(a != NULL && b != NULL);
+  assert(((struct avail *)a - 1)->kval == 2 && ((struct avail *)b - 1)->kval == 2);
+  assert(((uintptr_t)a & 7) == 0);
+  buddy_fib_free(&pool, a);
+  buddy_fib_free(&pool, a);
+  buddy_fib_free(&pool, b);
+  assert(pool.avail[pool.class_m].next != &pool.avail[pool.class_m]);
+
+  //Random churn keeps every allocation intact and merges back to one block
+  size_t n = 2000;
+  uint8_t **mem = calloc(n, sizeof(uint8_t *));
+  size_t *sizes = calloc(n, sizeof(size_t));
+  assert(mem != NULL && sizes != NULL);
+  for (size_t round = 0; round < 8 * n; round++)
+    {
+      size_t i = (size_t)rand() % n;
+      if (mem[i])
+        {
+          for (size_t j = 0; j < sizes[i]; j++)
+            assert(mem[i][j] == (uint8_t)i);
+          buddy_fib_free(&pool, mem[i]);
+          mem[i] = NULL;
+        }
+      else
+        {
+          sizes[i] = (size_t)(rand() % 2000) + 1;
+          mem[i] = buddy_fib_malloc(&pool, sizes[i]);
+          if (mem[i])
+            memset(mem[i], (int)(uint8_t)i, sizes[i]);
+        }
+    }
+  for (size_t i = 0; i < n; i++)
+    buddy_fib_free(&pool, mem[i]);
+  free(mem);
+  free(sizes);
+  for (size_t c = 0; c < pool.class_m; c++)
+    assert(pool.avail[c].next == &pool.avail[c]);
+  assert(pool.avail[pool.class_m].next != &pool.avail[pool.class_m]);
+
+  void *all = buddy_fib_malloc(&pool, pool.numbytes - HEADER_SIZE);
+  assert(all != NULL);
+  assert(buddy_fib_malloc(&pool, 1) == NULL);
+  buddy_fib_free(&pool, all);
+  buddy_fib_destroy(&pool);
+}
+
+/*Pages of the managed memory of pool that are resident*/
+static size_t resident_pages(struct buddy_pool *pool)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t pages = pool->numbytes / page;
+  unsigned char *vec = malloc(pages);
+  assert(vec != NULL);
+  assert(mincore(pool->base, pool->numbytes, vec) == 0);
+  size_t resident = 0;
+  for (size_t i = 0; i < pages; i++)
+    resident += vec[i] & 1;
+  free(vec);
+  return resident;
+}
+
+void test_buddy_prefault(void)
+{
+  fprintf(stderr, "->Testing prefault and lock options\n");
+  struct buddy_pool pool;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  struct buddy_options opts = {.size = UINT64_C(1) << 26, .flags = 0x100};
+  assert(buddy_init_opts(&pool, &opts) == -1);
+  assert(errno == EINVAL);
+  opts.flags = BUDDY_MLOCK | BUDDY_MLOCK_ONFAULT;
+  assert(buddy_init_opts(&pool, &opts) == -1);
+  assert(errno == EINVAL);
+
+  //Untouched pages of a plain pool are not there yet
+  opts.flags = 0;
+  assert(buddy_init_opts(&pool, &opts) == 0);
+  assert(resident_pages(&pool) < pool.numbytes / page / 2);
+  buddy_destroy(&pool);
+
+  opts.flags = BUDDY_POPULATE;
+  assert(buddy_init_opts(&pool, &opts) == 0);
+  assert(resident_pages(&pool) == pool.numbytes / page);
+  buddy_destroy(&pool);
+
+  opts.flags = BUDDY_PREFAULT;
+  opts.prefault_threads = 4;
+  assert(buddy_init_opts(&pool, &opts) == 0);
+  assert(resident_pages(&pool) == pool.numbytes / page);
+  void *mem = buddy_malloc(&pool, 1000);
+  assert(mem != NULL);
+  buddy_free(&pool, mem);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+
+  //Locking is up to RLIMIT_MEMLOCK, so only a small pool and only if allowed
+  opts.size = UINT64_C(1) << 16;
+  opts.flags = BUDDY_MLOCK;
+  if (buddy_init_opts(&pool, &opts) == 0)
+    {
+#ifndef __SANITIZE_ADDRESS__
+      //AddressSanitizer turns mlock into a no-op
+      assert(resident_pages(&pool) == pool.numbytes / page);
+#endif
+      buddy_destroy(&pool);
+    }
+  else
+    {
+      assert(errno == EPERM || errno == ENOMEM || errno == EAGAIN);
+    }
+}
+
+/*
+ * One call site for several allocations. The result goes through a volatile
+ * so the call is not a tail call, which would record the caller of the
+ * wrapper instead.
+ */
+__attribute__((noinline)) static void *leaky_alloc(struct buddy_pool *pool, size_t size)
+{
+  void *volatile mem = buddy_malloc(pool, size);
+  return mem;
+}
+
+__attribute__((noinline)) static buddy_handle leaky_halloc(struct buddy_pool *pool, size_t size)
+{
+  volatile buddy_handle handle = buddy_halloc(pool, size);
+  return handle;
+}
+
+void test_buddy_leak_report(void)
+{
+  fprintf(stderr, "->Testing leak reports\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = {.size = UINT64_C(1) << 20, .flags = BUDDY_LEAK_CHECK};
+  assert(buddy_init_opts(&pool, &opts) == 0);
+  FILE *fp = tmpfile();
+  assert(fp != NULL);
+  assert(buddy_leak_report(&pool, fp) == 0);
+  assert(ftell(fp) == 0);
+
+  void *a[3];
+  for (int i = 0; i < 3; i++)
+    {
+      a[i] = leaky_alloc(&pool, 100);
+      assert(a[i] != NULL);
+      assert(((struct avail *)a[i] - 1)->site == ((struct avail *)a[0] - 1)->site);
+    }
+  void *b = buddy_malloc_aligned(&pool, 5000, 4096);
+  assert(b != NULL);
+  assert(((struct avail *)a[0] - 1)->site != ((struct avail *)b - 1)->site);
+  buddy_handle h[2] = {leaky_halloc(&pool, 10), leaky_halloc(&pool, 10)};
+  assert(h[0] != 0 && h[1] != 0);
+  void *hsite = handle_site(&pool, (size_t)(h[0] & UINT32_MAX) - 1);
+  assert(hsite != NULL && hsite == handle_site(&pool, (size_t)(h[1] & UINT32_MAX) - 1));
+  assert(hsite != ((struct avail *)a[0] - 1)->site && hsite != ((struct avail *)b - 1)->site);
+
+  assert(buddy_leak_report(&pool, fp) == 6);
+  char line[512];
+  rewind(fp);
+  assert(fgets(line, sizeof(line), fp) != NULL);
+  assert(strstr(line, "6 blocks with 5320 bytes") != NULL);
+  assert(strstr(line, "from 3 call sites") != NULL);
+  //Biggest group first
+  assert(fgets(line, sizeof(line), fp) != NULL);
+  assert(strstr(line, "5000 bytes in 1 block") != NULL);
+  assert(fgets(line, sizeof(line), fp) != NULL);
+  assert(strstr(line, "300 bytes in 3 blocks") != NULL);
+  assert(fgets(line, sizeof(line), fp) != NULL);
+  //Handles are grouped by the call that made them like everything else
+  assert(strstr(line, "20 bytes in 2 blocks from") != NULL);
+  fclose(fp);
+
+  for (int i = 0; i < 3; i++)
+    buddy_free(&pool, a[i]);
+  buddy_free(&pool, b);
+  //The handle is reported on stderr by buddy_destroy
+  buddy_destroy(&pool);
+}
+
+struct walk_totals
+{
+  size_t blocks;
+  size_t reserved;
+  size_t bytes;
+  size_t asked;
+  uint8_t *last;
+  size_t stop_after;
+};
+
+static int count_block(const struct buddy_block *block, void *ctx)
+{
+  struct walk_totals *t = ctx;
+  assert((uint8_t *)block->start > t->last || t->blocks == 0);
+  assert(block->reserved == (block->ptr != NULL));
+  t->last = block->start;
+  t->blocks++;
+  t->bytes += block->bytes;
+  if (block->reserved)
+    {
+      t->reserved++;
+      t->asked += block->size;
+    }
+  return t->stop_after && t->blocks == t->stop_after ? 7 : 0;
+}
+
+void test_buddy_walk(void)
+{
+  fprintf(stderr, "->Testing heap walks\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = {.size = UINT64_C(1) << 20, .trim_k = 14};
+  assert(buddy_init_opts(&pool, &opts) == 0);
+  assert(buddy_walk(&pool, NULL, NULL) == -1 && errno == EINVAL);
+
+  void *a = buddy_malloc(&pool, 100);
+  void *b = buddy_malloc(&pool, 20000);
+  void *c = buddy_malloc_aligned(&pool, 3000, 1024);
+  assert(a != NULL && b != NULL && c != NULL);
+  struct walk_totals t = {0};
+  assert(buddy_walk(&pool, count_block, &t) == 0);
+  assert(t.reserved == 3 && t.asked == 23100 && t.bytes == pool.numbytes);
+
+  size_t all = t.blocks;
+  memset(&t, 0, sizeof(t));
+  t.stop_after = 2;
+  assert(buddy_walk(&pool, count_block, &t) == 7);
+  assert(t.blocks == 2 && all > 2);
+
+  //A damaged header ends the walk instead of sending it off into the weeds
+  struct avail *hdr = (struct avail *)a - 1;
+  unsigned short kval = hdr->kval;
+  hdr->kval = (unsigned short)(pool.kval_m + 1);
+  memset(&t, 0, sizeof(t));
+  assert(buddy_walk(&pool, count_block, &t) == -1 && errno == EIO);
+  hdr->kval = kval;
+
+  buddy_free(&pool, a);
+  buddy_free(&pool, b);
+  buddy_free(&pool, c);
+  memset(&t, 0, sizeof(t));
+  assert(buddy_walk(&pool, count_block, &t) == 0);
+  assert(t.blocks == 1 && t.reserved == 0);
+  buddy_destroy(&pool);
+
+  struct buddy_shared shared;
+  assert(buddy_shared_create(&shared, NULL, UINT64_C(1) << 20) == 0);
+  assert(buddy_shared_malloc(&shared, 100) != NULL);
+  assert(buddy_shared_malloc(&shared, 5000) != NULL);
+  memset(&t, 0, sizeof(t));
+  assert(buddy_shared_walk(&shared, count_block, &t) == 0);
+  assert(t.reserved == 2 && t.bytes == shared.hdr->numbytes);
+  buddy_shared_close(&shared);
+}
+
+void test_buddy_registry(void)
+{
+  fprintf(stderr, "->Testing pointer ownership and unified frees\n");
+  struct buddy_pool a, b, child;
+  buddy_init(&a, UINT64_C(1) << 20);
+  buddy_init(&b, UINT64_C(1) << 16);
+  assert(buddy_init_in(&child, &a, UINT64_C(1) << 16) == 0);
+
+  void *pa = buddy_malloc(&a, 100);
+  void *pb = buddy_malloc(&b, 100);
+  void *pc = buddy_malloc(&child, 100);
+  int local;
+  assert(buddy_owns(&a, pa) && !buddy_owns(&a, pb) && !buddy_owns(&b, &local));
+  assert(buddy_owns(&a, pc) && buddy_owns(&child, pc) && !buddy_owns(&child, pa));
+  assert(!buddy_owns(&child, child.base) && !buddy_owns(NULL, pa));
+
+  //Any byte of a pool maps to it, the child shadows its block of the parent
+  assert(buddy_pool_of(pa) == &a && buddy_pool_of((uint8_t *)pa + 99) == &a);
+  assert(buddy_pool_of(pb) == &b && buddy_pool_of((uint8_t *)b.base + b.numbytes - 1) == &b);
+  assert(buddy_pool_of(pc) == &child);
+  assert(buddy_pool_of(&local) == NULL && buddy_pool_of(NULL) == NULL);
+
+  buddy_free_any(pc);
+  buddy_free_any(pb);
+  buddy_free_any(pa);
+  buddy_free_any(&local);
+  buddy_free_any(NULL);
+  assert(buddy_malloc(&child, 100) == pc);
+  buddy_free_any(pc);
+  assert(b.avail[b.kval_m].next != &b.avail[b.kval_m]);
+
+  //Once the child is gone its memory is the parent's again
+  void *block = child.base;
+  buddy_destroy(&child);
+  assert(buddy_pool_of(block) == &a);
+  assert(a.avail[a.kval_m].next != &a.avail[a.kval_m]);
+
+  //A child smaller than a page is told apart from the parent next to it
+  struct buddy_pool small;
+  assert(buddy_init_in(&small, &a, 300) == 0);
+  assert(small.numbytes < 4096);
+  void *ps = buddy_malloc(&small, 100);
+  void *next = (uint8_t *)small.base + small.numbytes;
+  assert(buddy_pool_of(ps) == &small && buddy_pool_of(small.base) == &small);
+  assert(buddy_pool_of(next) == &a);
+  buddy_free_any(ps);
+  assert(buddy_malloc(&small, 100) == ps);
+
+  //Resetting the parent frees its children and takes their memory back
+  assert(buddy_init_in(&child, &a, UINT64_C(1) << 16) == 0);
+  block = child.base;
+  assert(buddy_pool_of(block) == &child);
+  assert(buddy_reset(&a, BUDDY_RESET_KEEP) == 0);
+  assert(buddy_pool_of(ps) == &a && buddy_pool_of(block) == &a);
+  check_buddy_pool_full(&a);
+  void *base = a.base;
+  buddy_destroy(&a);
+  buddy_destroy(&b);
+  assert(buddy_pool_of(base) == NULL && buddy_pool_of(block) == NULL);
+}
+
+void test_buddy_free_sized(void)
+{
+  fprintf(stderr, "->Testing sized frees\n");
+  struct buddy_pool pool;
+  size_t size = UINT64_C(1) << MIN_K;
+  buddy_init(&pool, size);
+
+  size_t sizes[] = {1, 24, 100, 4000, 4096, 70000};
+  void *mem[6];
+  for (int i = 0; i < 6; i++)
+    {
+      mem[i] = buddy_malloc(&pool, sizes[i]);
+      assert(mem[i] != NULL);
+    }
+  void *order = buddy_malloc_order(&pool, 12);
+  void *grown = buddy_realloc(&pool, buddy_malloc(&pool, 10), 3000);
+  assert(order != NULL && grown != NULL);
+
+  //Every free order coalesces back into the whole pool
+  for (int i = 5; i >= 0; i -= 2)
+    buddy_free_sized(&pool, mem[i], sizes[i]);
+  buddy_free_sized(&pool, order, (UINT64_C(1) << 12) - sizeof(struct avail));
+  buddy_free_sized(&pool, grown, 3000);
+  for (int i = 0; i < 6; i += 2)
+    buddy_free_sized(&pool, mem[i], sizes[i]);
+  buddy_free_sized(&pool, NULL, 10);
+  check_buddy_pool_full(&pool);
+
+#ifdef BUDDY_DEBUG
+  //A size from the wrong order is caught before it does any harm
+  void *wrong = buddy_malloc(&pool, 100);
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0)
+    {
+      fclose(stderr);
+      buddy_free_sized(&pool, wrong, 1000);
+      _exit(0);
+    }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+  buddy_free(&pool, wrong);
+#endif
+
+  //What is not a plain live block goes to buddy_free and leaves the pool intact
+  void *aligned = buddy_malloc_aligned(&pool, 100, 256);
+  void *exclusive = buddy_malloc_exclusive(&pool, 48);
+  void *twice = buddy_malloc(&pool, 100);
+  buddy_handle handle = buddy_halloc(&pool, 100);
+  int local;
+  assert(aligned && exclusive && twice && handle);
+  buddy_free_sized(&pool, aligned, 100);
+  buddy_free_sized(&pool, exclusive, 48);
+  buddy_free_sized(&pool, twice, 100);
+  buddy_free_sized(&pool, twice, 100);
+  buddy_free_sized(&pool, &local, sizeof(local));
+  buddy_free_sized(&pool, buddy_hpin(&pool, handle), 100);
+  assert(buddy_hpin(&pool, handle) != NULL);
+  buddy_hfree(&pool, handle);
+  check_buddy_pool_full(&pool);
+
+  //Trimmed pools take the regular path
+  buddy_destroy(&pool);
+  struct buddy_options opts = {.size = size, .trim_k = 14};
+  assert(buddy_init_opts(&pool, &opts) == 0);
+  void *a = buddy_malloc(&pool, 9000);
+  void *b = buddy_malloc(&pool, 9000);
+  buddy_free_sized(&pool, a, 9000);
+  buddy_free_sized(&pool, b, 9000);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+struct pressure_log
+{
+  int soft;
+  int low;
+  struct buddy_pressure last;
+  void *shed;                   /*freed by the watermark callback*/
+};
+
+static void on_pressure(struct buddy_pool *pool, const struct buddy_pressure *event, void *ctx)
+{
+  struct pressure_log *log = ctx;
+  log->last = *event;
+  if (event->kind == BUDDY_PRESSURE_SOFT)
+    log->soft++;
+  if (event->kind == BUDDY_PRESSURE_LOW)
+    {
+      log->low++;
+      buddy_free(pool, log->shed);
+      log->shed = NULL;
+    }
+}
+
+void test_buddy_quota(void)
+{
+  fprintf(stderr, "->Testing tenant quotas and watermarks\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  struct pressure_log log = {0};
+
+  //What was allocated before the first limit is charged too
+  void *early = buddy_malloc(&pool, 100);
+  assert(buddy_tenant_limit(&pool, BUDDY_TENANTS, 0, 0, NULL, NULL) == -1 && errno == EINVAL);
+  assert(buddy_tenant_limit(&pool, 1, 8192, 4096, NULL, NULL) == -1 && errno == EINVAL);
+  assert(buddy_tenant_limit(&pool, 1, UINT64_C(1) << 15, UINT64_C(1) << 16, on_pressure, &log) == 0);
+  assert(buddy_tenant_usage(&pool, 0) == 128 && buddy_tenant_usage(&pool, 1) == 0);
+
+  void *mem[17];
+  for (int i = 0; i < 16; i++)
+    {
+      mem[i] = buddy_tenant_malloc(&pool, 1, 4000);
+      assert(mem[i] != NULL);
+      assert(log.soft == (i < 8 ? 0 : 1));
+    }
+  assert(log.last.kind == BUDDY_PRESSURE_SOFT && log.last.tenant == 1 && log.last.used == 9 * 4096);
+  assert(buddy_tenant_usage(&pool, 1) == UINT64_C(1) << 16);
+
+  //The hard limit holds for every way of growing, other tenants are not affected
+  errno = 0;
+  assert(buddy_tenant_malloc(&pool, 1, 1) == NULL && errno == ENOMEM);
+  assert(buddy_realloc(&pool, mem[0], 5000) == NULL && errno == ENOMEM);
+  mem[16] = buddy_malloc(&pool, 100000);
+  assert(mem[16] != NULL && buddy_tenant_usage(&pool, 0) == 128 + 131072);
+
+  //A block that has to move stays with its tenant
+  buddy_free(&pool, mem[15]);
+  void *moved = buddy_realloc(&pool, mem[0], 8000);
+  assert(moved != NULL && moved != mem[0] && buddy_tenant_usage(&pool, 1) == UINT64_C(1) << 16);
+  mem[0] = buddy_realloc(&pool, moved, 100);
+  mem[15] = buddy_tenant_malloc(&pool, 1, 100);
+  assert(mem[0] != NULL && mem[15] != NULL && buddy_tenant_usage(&pool, 1) == 14 * 4096 + 256);
+
+  //Crossing the watermark lets the callback shed memory
+  log.shed = mem[16];
+  size_t left = pool.numbytes - 128 - 131072 - (14 * 4096 + 256);
+  assert(buddy_watermark(&pool, left - 4096, on_pressure, &log) == 0);
+  void *cross = buddy_malloc(&pool, 5000);
+  assert(cross != NULL && log.low == 1 && log.shed == NULL);
+  assert(log.last.kind == BUDDY_PRESSURE_LOW && log.last.free == left - 8192);
+  assert(buddy_tenant_usage(&pool, 0) == 128 + 8192);
+
+  //Soft pressure is signalled again only after the tenant went back under
+  for (int i = 0; i < 16; i++)
+    buddy_free(&pool, mem[i]);
+  assert(buddy_tenant_usage(&pool, 1) == 0);
+  for (int i = 0; i < 9; i++)
+    mem[i] = buddy_tenant_malloc(&pool, 1, 4000);
+  assert(log.soft == 2);
+
+  //Reallocs that keep the block size do not cross the limit again
+  for (int i = 0; i < 4; i++)
+    {
+      mem[8] = buddy_realloc(&pool, mem[8], i % 2 ? 4000 : 4050);
+      assert(mem[8] != NULL);
+    }
+  assert(log.soft == 2 && buddy_tenant_usage(&pool, 1) == 9 * 4096);
+  for (int i = 0; i < 9; i++)
+    buddy_free(&pool, mem[i]);
+  buddy_free(&pool, cross);
+  buddy_free(&pool, early);
+  assert(buddy_tenant_usage(&pool, 0) == 0);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+static void on_purge(struct buddy_pool *pool, buddy_handle handle, void *ctx)
+{
+  (void)pool;
+  (void)handle;
+  (*(int *)ctx)++;
+}
+
+void test_buddy_purgeable(void)
+{
+  fprintf(stderr, "->Testing purgeable allocations\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  int purged = 0;
+
+  //A cache that fills the whole pool
+  buddy_handle h[16];
+  for (int i = 0; i < 16; i++)
+    {
+      h[i] = buddy_palloc(&pool, 60000, on_purge, &purged);
+      assert(h[i] != 0);
+    }
+  char *pinned = buddy_hpin(&pool, h[0]);
+  assert(pinned != NULL);
+  memset(pinned, 'x', 60000);
+
+  //Entries go until two neighbours coalesce, the pinned one stays
+  void *mem = buddy_malloc(&pool, 100000);
+  assert(mem != NULL && purged == 3);
+  assert(buddy_hpin(&pool, h[1]) == NULL && errno == EINVAL);
+  assert(buddy_hpin(&pool, h[4]) != NULL);
+  buddy_hunpin(&pool, h[4]);
+  assert(pinned[59999] == 'x');
+
+  //Ordinary handles and pinned entries are never taken
+  buddy_handle kept = buddy_halloc(&pool, 60000);
+  assert(kept != 0);
+  purged = 0;
+  for (int i = 4; i < 16; i++)
+    buddy_hpin(&pool, h[i]);
+  assert(buddy_malloc(&pool, 60000) == NULL && errno == ENOMEM && purged == 0);
+  for (int i = 0; i < 16; i++)
+    buddy_hunpin(&pool, h[i]);
+  for (int i = 0; i < 16; i++)
+    buddy_hfree(&pool, h[i]);
+  buddy_hfree(&pool, kept);
+  buddy_free(&pool, mem);
+  check_buddy_pool_full(&pool);
+
+  //A single entry big enough goes first, the one unpinned the longest
+  buddy_handle a = buddy_palloc(&pool, 500000, NULL, NULL);
+  buddy_handle b = buddy_palloc(&pool, 500000, on_purge, &purged);
+  assert(a != 0 && b != 0);
+  assert(buddy_hpin(&pool, a) != NULL);
+  buddy_hunpin(&pool, a);
+  mem = buddy_malloc(&pool, 400000);
+  assert(mem != NULL && purged == 1 && buddy_hpin(&pool, b) == NULL && buddy_hpin(&pool, a) != NULL);
+  buddy_hunpin(&pool, a);
+  buddy_free(&pool, mem);
+  buddy_hfree(&pool, a);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_color(void)
+{
+  fprintf(stderr, "->Testing cache coloring\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = {.size = UINT64_C(1) << MIN_K, .flags = BUDDY_COLOR};
+  assert(buddy_init_opts(&pool, &opts) == 0);
+
+  //Page sized objects sit in 8 KiB blocks and get a different line each
+  char *obj[BUDDY_COLORS + 1];
+  for (int i = 0; i <= BUDDY_COLORS; i++)
+    {
+      obj[i] = buddy_malloc(&pool, 4096);
+      assert(obj[i] != NULL);
+      size_t offset = (size_t)(obj[i] - (char *)pool.base) & 8191;
+      assert(offset == sizeof(struct avail) + (size_t)(i % BUDDY_COLORS) * BUDDY_COLOR_LINE);
+      memset(obj[i], i, 4096);
+    }
+
+  //No room for a color, no stub
+  char *small = buddy_malloc(&pool, 100);
+  assert(small != NULL && ((struct avail *)small - 1)->tag == BLOCK_RESERVED);
+
+  //What moves is colored again
+  char *moved = buddy_realloc(&pool, obj[1], 5000);
+  assert(moved != NULL && moved[4095] == 1 && ((struct avail *)moved - 1)->tag == BLOCK_INDIRECT);
+  obj[1] = moved;
+  for (int i = 0; i <= BUDDY_COLORS; i++)
+    buddy_free_sized(&pool, obj[i], i == 1 ? 5000 : 4096);
+  buddy_free(&pool, small);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_exclusive(void)
+{
+  fprintf(stderr, "->Testing cache line exclusive allocations\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  assert(buddy_malloc_exclusive(&pool, 0) == NULL && errno == ENOMEM);
+  assert(buddy_malloc_exclusive(NULL, 8) == NULL && errno == ENOMEM);
+
+  //Small objects packed around the exclusive ones never reach into their lines
+  size_t sizes[] = {1, 8, 40, 64, 65, 200};
+  char *excl[6], *small[24];
+  for (int i = 0; i < 6; i++)
+    {
+      small[4 * i] = buddy_malloc(&pool, 8);
+      small[4 * i + 1] = buddy_malloc(&pool, 30);
+      excl[i] = buddy_malloc_exclusive(&pool, sizes[i]);
+      small[4 * i + 2] = buddy_malloc(&pool, 8);
+      small[4 * i + 3] = buddy_malloc(&pool, 1);
+      assert(excl[i] != NULL && ((uintptr_t)excl[i] & (BUDDY_CACHE_LINE - 1)) == 0);
+      memset(excl[i], 0xff, (sizes[i] + BUDDY_CACHE_LINE - 1) & ~(size_t)(BUDDY_CACHE_LINE - 1));
+    }
+  for (int i = 0; i < 6; i++)
+    {
+      uintptr_t first = (uintptr_t)excl[i] / BUDDY_CACHE_LINE;
+      uintptr_t last = ((uintptr_t)excl[i] + sizes[i] - 1) / BUDDY_CACHE_LINE;
+      for (int j = 0; j < 24; j++)
+        {
+          uintptr_t line = (uintptr_t)small[j] / BUDDY_CACHE_LINE;
+          assert(small[j] != NULL && (line < first - 1 || line > last));
+        }
+      for (int j = 0; j < 6; j++)
+        {
+          uintptr_t line = (uintptr_t)excl[j] / BUDDY_CACHE_LINE;
+          assert(j == i || line < first - 1 || line > last);
+        }
+    }
+  for (int i = 0; i < 24; i++)
+    buddy_free(&pool, small[i]);
+  for (int i = 0; i < 6; i++)
+    buddy_free(&pool, excl[i]);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
 int main(void) {
   time_t t;
   unsigned seed = (unsigned)time(&t);
@@ -310,5 +2001,34 @@ int main(void) {
   RUN_TEST(test_buddy_fragmentation);
   RUN_TEST(test_btok_boundary);
   RUN_TEST(test_buddy_multi_alloc_free);
+  RUN_TEST(test_buddy_malloc_order);
+  RUN_TEST(test_buddy_malloc_aligned);
+  RUN_TEST(test_buddy_shared_cross_process);
+  RUN_TEST(test_buddy_shared_owner_dead);
+  RUN_TEST(test_buddy_shared_named);
+  RUN_TEST(test_buddy_shared_persistent);
+  RUN_TEST(test_buddy_asan_annotations);
+  RUN_TEST(test_buddy_realloc);
+  RUN_TEST(test_buddy_trace);
+  RUN_TEST(test_buddy_profile);
+  RUN_TEST(test_buddy_latency);
+  RUN_TEST(test_buddy_dump_map);
+  RUN_TEST(test_buddy_handles_compact);
+  RUN_TEST(test_buddy_compact_keeps_largest);
+  RUN_TEST(test_buddy_packed);
+  RUN_TEST(test_buddy_init_opts);
+  RUN_TEST(test_buddy_init_in);
+  RUN_TEST(test_buddy_reset);
+  RUN_TEST(test_buddy_trim);
+  RUN_TEST(test_buddy_fibonacci);
+  RUN_TEST(test_buddy_prefault);
+  RUN_TEST(test_buddy_leak_report);
+  RUN_TEST(test_buddy_walk);
+  RUN_TEST(test_buddy_registry);
+  RUN_TEST(test_buddy_free_sized);
+  RUN_TEST(test_buddy_quota);
+  RUN_TEST(test_buddy_purgeable);
+  RUN_TEST(test_buddy_color);
+  RUN_TEST(test_buddy_exclusive);
   return UNITY_END();
 }
@@ -0,0 +1,139 @@
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <memory_resource>
+#include <vector>
+
+#include "harness/unity.h"
+#include "../src/lab.hpp"
+
+void setUp(void) {
+  // set stuff up here
+}
+
+void tearDown(void) {
+  // clean stuff up here
+}
+
+/**
+ * Over-aligned type that can not come from buddy_malloc directly.
+ */
+struct alignas(64) line
+{
+  unsigned char bytes[64];
+};
+
+/**
+ * Check that every allocation of the pool has been given back.
+ */
+static void check_pool_full(struct buddy_pool *pool)
+{
+  for (size_t i = 0; i < pool->kval_m; i++)
+    {
+      assert(pool->avail[i].next == &pool->avail[i]);
+    }
+  assert(pool->avail[pool->kval_m].next == pool->base);
+}
+
+void test_pool(void)
+{
+  fprintf(stderr, "->Testing buddy::pool\n");
+  buddy::pool pool(std::size_t{1} << MIN_K);
+  static_assert(buddy::order_of<std::uint64_t> == SMALLEST_K, "one word fits the smallest block");
+
+  auto *one = pool.allocate<std::uint64_t>();
+  auto *many = pool.allocate<std::uint64_t>(100);
+  auto *fixed = pool.allocate<std::uint64_t, 10>();
+  auto *aligned = pool.allocate<line>(3);
+  assert(one && many && fixed && aligned);
+  assert(reinterpret_cast<std::uintptr_t>(aligned) % alignof(line) == 0);
+  many[99] = 1;
+  aligned[2].bytes[63] = 1;
+
+  //Impossible counts fail without touching the pool
+  assert(pool.allocate<std::uint64_t>(0) == nullptr);
+  assert(pool.allocate<std::uint64_t>(SIZE_MAX / 8) == nullptr);
+  assert(errno == ENOMEM);
+
+  pool.deallocate(one);
+  pool.deallocate(many, 100);
+  pool.deallocate(fixed, 10);
+  pool.deallocate(aligned, 3);
+  check_pool_full(pool.get());
+}
+
+void test_memory_resource(void)
+{
+  fprintf(stderr, "->Testing buddy::memory_resource\n");
+  buddy::pool pool(std::size_t{1} << MIN_K);
+  buddy::pool other(std::size_t{1} << MIN_K);
+  buddy::memory_resource mr(pool);
+  buddy::memory_resource same(pool.get());
+  buddy::memory_resource different(other);
+
+  assert(mr.is_equal(same) && same.is_equal(mr));
+  assert(!mr.is_equal(different));
+  assert(!mr.is_equal(*std::pmr::new_delete_resource()));
+
+  void *plain = mr.allocate(100, 8);
+  void *zero = mr.allocate(0, 1);
+  void *page = mr.allocate(100, 4096);
+  assert(plain && zero && page);
+  assert(reinterpret_cast<std::uintptr_t>(page) % 4096 == 0);
+  mr.deallocate(plain, 100, 8);
+  mr.deallocate(zero, 0, 1);
+  mr.deallocate(page, 100, 4096);
+
+  //A container on the resource gives everything back when it goes away
+  {
+    std::pmr::vector<std::pmr::vector<int>> outer(&mr);
+    for (int i = 0; i < 100; i++)
+      {
+        outer.emplace_back(static_cast<std::size_t>(i) + 1, i);
+      }
+    assert(outer[99].size() == 100 && outer[99][99] == 99);
+  }
+  check_pool_full(pool.get());
+
+  bool threw = false;
+  try
+    {
+      (void)mr.allocate(std::size_t{1} << (MIN_K + 1), 8);
+    }
+  catch (const std::bad_alloc &)
+    {
+      threw = true;
+    }
+  assert(threw);
+}
+
+void test_allocator(void)
+{
+  fprintf(stderr, "->Testing buddy::allocator\n");
+  buddy::pool pool(std::size_t{1} << MIN_K);
+  buddy::pool other(std::size_t{1} << MIN_K);
+  buddy::allocator<int> alloc(pool);
+  buddy::allocator<line> rebound(alloc);
+  assert(rebound == alloc && alloc != buddy::allocator<int>(other));
+
+  line *lines = rebound.allocate(5);
+  assert(reinterpret_cast<std::uintptr_t>(lines) % alignof(line) == 0);
+  rebound.deallocate(lines, 5);
+  {
+    std::vector<int, buddy::allocator<int>> v(alloc);
+    for (int i = 0; i < 10000; i++)
+      {
+        v.push_back(i);
+      }
+    assert(v[9999] == 9999);
+  }
+  check_pool_full(pool.get());
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_pool);
+  RUN_TEST(test_memory_resource);
+  RUN_TEST(test_allocator);
+  return UNITY_END();
+}